@@ -0,0 +1,193 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include "alloc_recorder.h"
+#include "fd_writer.h"
+#include "internal.h"
+
+namespace mesh {
+namespace recorder {
+
+namespace {
+// everything about the open recording, allocated from the internal heap
+// so that it never shows up in the recording itself
+struct State {
+  explicit State(int fd_) : fd(fd_), writer(fd_) {
+  }
+
+  const int fd;
+  FdWriter writer;
+  internal::unordered_map<uintptr_t, uint32_t> ids{};
+  IdPool<internal::vector<uint32_t>> idPool{};
+  internal::unordered_map<pid_t, uint32_t> threads{};
+  uint32_t lastThread{0};
+  bool first{true};
+};
+
+std::mutex Lock;
+State *Current;
+
+void writeRecord(State *state, Op op, uint64_t a, uint64_t b = 0) {
+  uint8_t buf[32];
+  size_t len = 1;
+
+  uint8_t opByte = op;
+  const pid_t tid = gettid();
+  auto it = state->threads.find(tid);
+  if (it == state->threads.end()) {
+    it = state->threads.emplace(tid, state->threads.size()).first;
+  }
+  if (it->second != state->lastThread || state->first) {
+    opByte |= kThreadSwitch;
+    len += putVarint(buf + len, it->second);
+    state->lastThread = it->second;
+    state->first = false;
+  }
+  buf[0] = opByte;
+
+  len += putVarint(buf + len, a);
+  if (op == Memalign || op == Realloc) {
+    len += putVarint(buf + len, b);
+  }
+
+  state->writer.write(reinterpret_cast<const char *>(buf), len);
+}
+
+int closeLocked() {
+  State *state = Current;
+  if (state == nullptr) {
+    return 0;
+  }
+  Current = nullptr;
+
+  state->writer.flush();
+  const bool failed = state->writer.failed();
+  const int fd = state->fd;
+  state->~State();
+  internal::Heap().free(state);
+
+  if (close(fd) != 0 || failed) {
+    return -1;
+  }
+  return 0;
+}
+}  // namespace
+
+int start(const char *path) {
+  std::lock_guard<std::mutex> lock(Lock);
+  Recording.store(false, std::memory_order_relaxed);
+  closeLocked();
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    debug("recorder: couldn't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  char header[kHeaderSize] = {};
+  memcpy(header, kMagic, sizeof(kMagic));
+  memcpy(header + sizeof(kMagic), &kVersion, sizeof(kVersion));
+
+  void *buf = internal::Heap().malloc(sizeof(State));
+  hard_assert(buf != nullptr);
+  Current = new (buf) State(fd);
+  Current->writer.write(header, sizeof(header));
+
+  Recording.store(true, std::memory_order_release);
+  return 0;
+}
+
+int startWithPrefix(const char *prefix) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.%d.meshrec", prefix, getpid());
+  return start(path);
+}
+
+int stop() {
+  std::lock_guard<std::mutex> lock(Lock);
+  Recording.store(false, std::memory_order_relaxed);
+  return closeLocked();
+}
+
+Guard::Guard() {
+  Lock.lock();
+}
+
+Guard::~Guard() {
+  Lock.unlock();
+}
+
+void recordMalloc(Op op, void *ptr, size_t size, size_t alignment) {
+  State *state = Current;
+  if (state == nullptr || ptr == nullptr) {
+    return;
+  }
+
+  const uint32_t id = state->idPool.allocate();
+  state->ids[reinterpret_cast<uintptr_t>(ptr)] = id;
+  if (op == Memalign) {
+    writeRecord(state, op, alignment, size);
+  } else {
+    writeRecord(state, op, size);
+  }
+}
+
+void recordFree(void *ptr) {
+  State *state = Current;
+  if (state == nullptr || ptr == nullptr) {
+    return;
+  }
+
+  // allocated before the recording started
+  auto it = state->ids.find(reinterpret_cast<uintptr_t>(ptr));
+  if (it == state->ids.end()) {
+    return;
+  }
+
+  writeRecord(state, Free, it->second);
+  state->idPool.release(it->second);
+  state->ids.erase(it);
+}
+
+void recordRealloc(void *oldPtr, void *newPtr, size_t newSize) {
+  State *state = Current;
+  // on failure the old object is untouched
+  if (state == nullptr || newPtr == nullptr) {
+    return;
+  }
+
+  auto it = state->ids.find(reinterpret_cast<uintptr_t>(oldPtr));
+  if (oldPtr == nullptr || it == state->ids.end()) {
+    recordMalloc(Malloc, newPtr, newSize);
+    return;
+  }
+
+  // the object keeps its id wherever it moves
+  const uint32_t id = it->second;
+  state->ids.erase(it);
+  state->ids[reinterpret_cast<uintptr_t>(newPtr)] = id;
+  writeRecord(state, Realloc, id, newSize);
+}
+
+void afterForkChild() {
+  // another thread may have held the lock when we forked.  The buffered
+  // records are the parent's to write, so the state is dropped as-is.
+  new (&Lock) std::mutex();
+  Recording.store(false, std::memory_order_relaxed);
+  Current = nullptr;
+}
+
+}  // namespace recorder
+}  // namespace mesh
@@ -0,0 +1,228 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_ALLOC_RECORDER_H
+#define MESH_ALLOC_RECORDER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "common.h"
+
+namespace mesh {
+namespace recorder {
+
+// A recording is a 16-byte header followed by one variable-length
+// record per call:
+//
+//   op byte        low bits: Op; kThreadSwitch set when the calling
+//                  thread differs from the previous record's, and the
+//                  new thread's index (a varint) follows
+//   Malloc, Calloc varint size
+//   Memalign       varint alignment, varint size
+//   Free           varint id
+//   Realloc        varint id, varint new size
+//
+// Sizes and ids are LEB128 varints, so a typical record is 2-4 bytes.
+// Objects are named by small ids rather than addresses: an allocation
+// takes the most recently freed id, or the next unused one when none
+// are free (see IdPool), so ids are implicit in the recording and a
+// replay reproduces them without storing any.  Threads are numbered in
+// order of their first call.
+static constexpr char kMagic[8] = {'M', 'E', 'S', 'H', 'R', 'E', 'C', '\0'};
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kHeaderSize = 16;
+
+enum Op : uint8_t {
+  Malloc = 1,
+  Calloc,
+  Memalign,
+  Free,
+  Realloc,
+};
+
+static constexpr uint8_t kOpMask = 0x7;
+static constexpr uint8_t kThreadSwitch = 0x80;
+
+// the id assignment shared by the recorder and replay
+template <typename Vector>
+class IdPool {
+public:
+  uint32_t allocate() {
+    if (_free.empty()) {
+      return _next++;
+    }
+    const uint32_t id = _free.back();
+    _free.pop_back();
+    return id;
+  }
+
+  void release(uint32_t id) {
+    _free.push_back(id);
+  }
+
+  // one past the largest id handed out
+  uint32_t limit() const {
+    return _next;
+  }
+
+  void clear() {
+    _free.clear();
+    _next = 0;
+  }
+
+private:
+  Vector _free{};
+  uint32_t _next{0};
+};
+
+// returns the number of bytes written, at most 10
+inline size_t putVarint(uint8_t *out, uint64_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  out[len++] = static_cast<uint8_t>(value);
+  return len;
+}
+
+struct Record {
+  Op op;
+  uint32_t thread;
+  uint32_t id;  // Free and Realloc
+  uint64_t size;
+  uint64_t alignment;  // Memalign
+};
+
+// decodes a recording held in memory.  next() returns false at the end
+// of the buffer, or if the data is truncated or malformed.
+class Reader {
+private:
+  DISALLOW_COPY_AND_ASSIGN(Reader);
+
+public:
+  Reader(const void *data, size_t len)
+      : _pos(reinterpret_cast<const uint8_t *>(data)), _end(reinterpret_cast<const uint8_t *>(data) + len) {
+    uint32_t version = 0;
+    if (len >= kHeaderSize && memcmp(data, kMagic, sizeof(kMagic)) == 0) {
+      memcpy(&version, _pos + sizeof(kMagic), sizeof(version));
+    }
+    _valid = version == kVersion;
+    _pos = _valid ? _pos + kHeaderSize : _end;
+  }
+
+  bool valid() const {
+    return _valid;
+  }
+
+  bool next(Record &record) {
+    if (_pos >= _end) {
+      return false;
+    }
+
+    const uint8_t opByte = *_pos++;
+    uint64_t value = 0;
+    if (opByte & kThreadSwitch) {
+      if (!getVarint(value)) {
+        return false;
+      }
+      _thread = static_cast<uint32_t>(value);
+    }
+    record.op = static_cast<Op>(opByte & kOpMask);
+    record.thread = _thread;
+    record.id = 0;
+    record.size = 0;
+    record.alignment = 0;
+
+    switch (record.op) {
+    case Malloc:
+    case Calloc:
+      return getVarint(record.size);
+    case Memalign:
+      return getVarint(record.alignment) && getVarint(record.size);
+    case Free:
+      if (!getVarint(value)) {
+        return false;
+      }
+      record.id = static_cast<uint32_t>(value);
+      return true;
+    case Realloc:
+      if (!getVarint(value)) {
+        return false;
+      }
+      record.id = static_cast<uint32_t>(value);
+      return getVarint(record.size);
+    }
+
+    _valid = false;
+    return false;
+  }
+
+private:
+  bool getVarint(uint64_t &value) {
+    value = 0;
+    for (unsigned shift = 0; _pos < _end && shift < 64; shift += 7) {
+      const uint8_t byte = *_pos++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+    _valid = false;
+    return false;
+  }
+
+  const uint8_t *_pos;
+  const uint8_t *const _end;
+  uint32_t _thread{0};
+  bool _valid;
+};
+
+// set while a recording is open; checked on every allocator call, which
+// takes the slow path while it is set
+inline std::atomic<bool> Recording{false};
+
+inline bool ATTRIBUTE_ALWAYS_INLINE recording() {
+  return unlikely(Recording.load(std::memory_order_relaxed));
+}
+
+// start appending every malloc, free, realloc and memalign (and calloc,
+// operator new and delete) to the given file, replacing any recording
+// in progress.  Returns 0 on success.
+int start(const char *path);
+// start recording to "<prefix>.<pid>.meshrec"
+int startWithPrefix(const char *prefix);
+// flush and close the recording.  Returns 0 on success.
+int stop();
+
+// Recorded calls run one at a time, under the lock a Guard holds, so
+// that the recording has them in the order they happened and an
+// address is never reused before its free is logged.
+class Guard {
+private:
+  DISALLOW_COPY_AND_ASSIGN(Guard);
+
+public:
+  Guard();
+  ~Guard();
+};
+
+// these must be called with a Guard held
+void recordMalloc(Op op, void *ptr, size_t size, size_t alignment = 0);
+void recordFree(void *ptr);
+void recordRealloc(void *oldPtr, void *newPtr, size_t newSize);
+
+// the child would interleave its records with the parent's in the same
+// file, so it stops recording
+void afterForkChild();
+
+}  // namespace recorder
+}  // namespace mesh
+
+#endif  // MESH_ALLOC_RECORDER_H
@@ -128,6 +128,15 @@ inline size_t getPageSize() {
 #endif
 
 static constexpr size_t kMaxFastLargeSize = 256 * 1024;  // 256Kb
+// each thread keeps up to kMidSizeCacheDepth freed spans per page
+// count for allocations in (kMaxSize, kMaxFastLargeSize], and at most
+// kMidSizeCacheBytes of them in total
+static constexpr size_t kMidSizeCacheDepth = 4;
+static constexpr size_t kMidSizeCacheBytes = 1024 * 1024;  // 1MB
+
+// allocations of at least this size are mapped directly with mmap
+// rather than taken from the arena; MESH_HUGE_THRESHOLD overrides it
+static constexpr size_t kDefaultHugeThreshold = 64 * 1024 * 1024;  // 64MB
 
 static constexpr size_t kMaxSplitListSize = 16384;
 static constexpr size_t kMaxMergeSets = 4096;
@@ -160,6 +169,19 @@ static constexpr size_t kMaxMeshesPerIteration = 2500;
 // - On 16KB systems: kMaxDirtyPageThreshold = 16384 pages * 16KB = 256 MB
 static constexpr size_t kMaxDirtyPageThreshold = 1 << 14;  // 16384 pages
 static constexpr size_t kMinDirtyPageThreshold = 32;       // 32 pages
+// number of spans handed to the kernel per process_madvise(2) call
+static constexpr size_t kReleaseBatchSize = 64;
+
+// after fork the child copies the live arena in chunks of at most
+// kForkCopyChunkSize bytes, using kForkCopyThreads threads once there
+// is at least kForkCopyParallelThreshold bytes to copy.
+static constexpr size_t kForkCopyThreads = 4;
+static constexpr size_t kForkCopyChunkSize = 16 * 1024 * 1024;          // 16 MB
+static constexpr size_t kForkCopyParallelThreshold = 64 * 1024 * 1024;  // 64 MB
+
+// walks over every miniheap (heap dumps, statistics) hold the arena
+// lock for at most this many pages of the arena at a time
+static constexpr size_t kArenaWalkBatchPages = 4096;
 
 static constexpr uint32_t kSpanClassCount = 256;
 
@@ -188,6 +210,16 @@ static constexpr bool kAdviseDump = false;
 
 static constexpr std::chrono::milliseconds kZeroMs{0};
 static constexpr std::chrono::milliseconds kMeshPeriodMs{100};  // 100 ms
+// the background thread returns dirty pages to the OS along a curve
+// over this window, advancing it kDirtyDecaySteps times per window.
+static constexpr std::chrono::milliseconds kDirtyDecayMs{10000};  // 10 s
+static constexpr int64_t kDirtyDecaySteps = 10;
+// malloc_trim stops meshing and releasing once this much time has passed
+static constexpr std::chrono::milliseconds kTrimBudgetMs{100};
+// pages malloc_trim releases between checks of its budget
+static constexpr size_t kTrimReleaseBatch = 4096;
+// how often the background thread refreshes the MESH_STATS_SEGMENT memfd
+static constexpr std::chrono::milliseconds kStatsSegmentPeriodMs{1000};
 
 // controls aspects of miniheaps
 static constexpr size_t kMaxMeshes = 256;  // 1 per bit
@@ -196,9 +228,26 @@ static constexpr size_t kArenaSize = 32ULL * 1024ULL * 1024ULL * 1024ULL;  // 32
 #else
 static constexpr size_t kArenaSize = 64ULL * 1024ULL * 1024ULL * 1024ULL;  // 64 GB
 #endif
+// number of memfds backing the arena.  With more than one, the arena
+// is interleaved across the files every kArenaShardStride bytes, so
+// page faults and hole punching in nearby pages of even a small heap
+// don't serialize on a single shmem inode.  Each file is
+// kArenaShardSize bytes long.
+#ifndef ARENA_SHARDS
+#define ARENA_SHARDS 1
+#endif
+static constexpr size_t kArenaShardCount = ARENA_SHARDS;
+static constexpr size_t kArenaShardSize = kArenaSize / kArenaShardCount;
+static constexpr size_t kArenaShardStride = 2 * 1024 * 1024;  // 2 MB
+static_assert(kArenaShardCount > 0 && (kArenaShardCount & (kArenaShardCount - 1)) == 0,
+              "ARENA_SHARDS must be a power of two");
+static_assert(kArenaSize % (kArenaShardStride * kArenaShardCount) == 0,
+              "arena must hold a whole number of strides per shard");
 static constexpr size_t kAltStackSize = 16 * 1024UL;  // 16KB sigaltstacks
 #define SIGQUIESCE (SIGRTMIN + 7)
 #define SIGDUMP (SIGRTMIN + 8)
+#define SIGHEAPPROF (SIGRTMIN + 9)  // write a heap profile
+#define SIGTRACE (SIGRTMIN + 10)    // write the allocator event trace
 
 // BinnedTracker
 static constexpr size_t kBinnedTrackerBinCount = 1;
@@ -425,8 +474,14 @@ private:
     }
   }
 
-  // Mapping from size class to max size storable in that class
-  static const int32_t class_to_size_[kClassSizesMax];
+  // Mapping from size class to max size storable in that class.
+  // Defined here rather than in runtime.cc so that ConstantSizeClass
+  // can be evaluated at compile time.
+  ATTRIBUTE_ALIGNED(CACHELINE_SIZE)
+  static constexpr int32_t class_to_size_[kClassSizesMax] = {
+      16,  16,  32,  48,  64,  80,  96,  112,  128,  160,  192,  224,   256,
+      320, 384, 448, 512, 640, 768, 896, 1024, 2048, 4096, 8192, 16384,
+  };
 
 public:
   static constexpr size_t num_size_classes = 25;
@@ -452,12 +507,38 @@ public:
     return true;
   }
 
+  // GetSizeClass for a size known at compile time: the smallest class
+  // that fits it, which is what class_array_ holds.  -1 for sizes
+  // beyond kMaxSize.
+  static constexpr int32_t ConstantSizeClass(size_t size) {
+    if (size > kMaxSize) {
+      return -1;
+    }
+    int32_t cl = 1;
+    while (static_cast<size_t>(class_to_size_[cl]) < size) {
+      cl++;
+    }
+    return cl;
+  }
+
   // Get the byte-size for a specified class
   // static inline int32_t ATTRIBUTE_ALWAYS_INLINE ByteSizeForClass(uint32_t cl) {
   static inline size_t ATTRIBUTE_ALWAYS_INLINE ByteSizeForClass(int32_t cl) {
     return class_to_size_[static_cast<uint32_t>(cl)];
   }
 
+  // Smallest class at or above cl whose byte size is a multiple of
+  // alignment, a power of two no larger than the largest class.
+  // Objects sit at multiples of their class size from a page-aligned
+  // span start, so every object in that class is aligned.
+  static inline uint32_t AlignedSizeClass(uint32_t cl, size_t alignment) {
+    d_assert(alignment <= static_cast<size_t>(class_to_size_[kClassSizesMax - 1]));
+    while ((static_cast<size_t>(class_to_size_[cl]) & (alignment - 1)) != 0) {
+      cl++;
+    }
+    return cl;
+  }
+
   // Mapping from size class to max size storable in that class
   static inline int32_t class_to_size(uint32_t cl) {
     return class_to_size_[cl];
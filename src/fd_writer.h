@@ -0,0 +1,101 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_FD_WRITER_H
+#define MESH_FD_WRITER_H
+
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "common.h"
+
+namespace mesh {
+
+// buffers output to a file descriptor without allocating, so it can be
+// used while holding heap or profiler locks
+class FdWriter {
+private:
+  DISALLOW_COPY_AND_ASSIGN(FdWriter);
+
+public:
+  explicit FdWriter(int fd) : _fd(fd) {
+  }
+
+  ~FdWriter() {
+    flush();
+  }
+
+  void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(_buf + _len, sizeof(_buf) - _len, fmt, args);
+    va_end(args);
+    if (len < 0) {
+      return;
+    }
+
+    // didn't fit: flush what we have and format again at the start
+    if (static_cast<size_t>(len) >= sizeof(_buf) - _len) {
+      flush();
+      va_start(args, fmt);
+      len = vsnprintf(_buf, sizeof(_buf), fmt, args);
+      va_end(args);
+      if (len < 0) {
+        return;
+      }
+    }
+
+    // output longer than the whole buffer is truncated
+    _len += std::min(static_cast<size_t>(len), sizeof(_buf) - 1 - _len);
+  }
+
+  void write(const char *data, size_t len) {
+    while (len > 0) {
+      const size_t n = std::min(len, sizeof(_buf) - _len);
+      memcpy(_buf + _len, data, n);
+      _len += n;
+      data += n;
+      len -= n;
+      if (_len == sizeof(_buf)) {
+        flush();
+      }
+    }
+  }
+
+  void flush() {
+    size_t off = 0;
+    while (off < _len) {
+      ssize_t n = ::write(_fd, _buf + off, _len - off);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        _failed = true;
+        break;
+      }
+      off += n;
+    }
+    _len = 0;
+  }
+
+  bool failed() const {
+    return _failed;
+  }
+
+private:
+  const int _fd;
+  char _buf[4096];
+  size_t _len{0};
+  bool _failed{false};
+};
+
+}  // namespace mesh
+
+#endif  // MESH_FD_WRITER_H
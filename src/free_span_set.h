@@ -0,0 +1,160 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_FREE_SPAN_SET_H
+#define MESH_FREE_SPAN_SET_H
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "internal.h"
+
+namespace mesh {
+
+// FreeSpanSet holds the free spans of one page type (e.g. clean or
+// dirty) in the arena.  Spans are coalesced with their neighbours as
+// they are inserted, and are indexed both by address (to find those
+// neighbours), by (length, address) so that best-fit lookups are
+// O(log n) regardless of how large the request is, and by (stamp,
+// address).  The stamp is caller-supplied (e.g. the time the span was
+// freed); when spans are merged the oldest stamp wins, so pages that
+// keep being freed next to an old span can't keep it young forever.
+class FreeSpanSet {
+private:
+  DISALLOW_COPY_AND_ASSIGN(FreeSpanSet);
+
+public:
+  FreeSpanSet() {
+  }
+
+  // add span to the set, merging it with any adjacent free spans.
+  // Returns the (possibly larger) span that now holds these pages.
+  Span insert(const Span &span, uint64_t stamp = 0) {
+    d_assert(!span.empty());
+
+    Offset offset = span.offset;
+    Length length = span.length;
+
+    auto next = _byAddress.lower_bound(span.offset);
+    if (next != _byAddress.begin()) {
+      auto prev = std::prev(next);
+      d_assert(prev->first + prev->second.length <= span.offset);
+      if (prev->first + prev->second.length == span.offset) {
+        offset = prev->first;
+        length += prev->second.length;
+        stamp = std::min(stamp, prev->second.stamp);
+        erase(prev);
+      }
+    }
+
+    if (next != _byAddress.end()) {
+      d_assert(span.offset + span.length <= next->first);
+      if (span.offset + span.length == next->first) {
+        length += next->second.length;
+        stamp = std::min(stamp, next->second.stamp);
+        erase(next);
+      }
+    }
+
+    _byAddress.emplace(offset, Entry{length, stamp});
+    _bySize.emplace(length, offset);
+    _byStamp.emplace(stamp, offset);
+    _pageCount += length;
+
+    return Span(offset, length);
+  }
+
+  // remove the smallest span with at least pageCount pages, preferring
+  // the lowest address among equally sized spans.  The whole span is
+  // returned; the caller is responsible for giving back any excess.
+  bool removeBestFit(Length pageCount, Span &result) {
+    auto it = _bySize.lower_bound(std::make_pair(pageCount, static_cast<Offset>(0)));
+    if (it == _bySize.end()) {
+      return false;
+    }
+
+    result = Span(it->second, it->first);
+    erase(_byAddress.find(it->second));
+
+    return true;
+  }
+
+  // remove spans oldest stamp first until at least pageCount pages
+  // have been removed (or the set is empty), calling func(span) on
+  // each after it has been removed.  Returns the number of pages
+  // removed, which can exceed pageCount by up to one span.
+  template <typename Func>
+  size_t removeOldest(size_t pageCount, const Func func) {
+    size_t removed = 0;
+
+    while (removed < pageCount && !_byStamp.empty()) {
+      auto it = _byAddress.find(_byStamp.begin()->second);
+      d_assert(it != _byAddress.end());
+
+      const Span span(it->first, it->second.length);
+      erase(it);
+
+      removed += span.length;
+      func(span);
+    }
+
+    return removed;
+  }
+
+  // calls func(span) for every free span in address order
+  template <typename Func>
+  void forEach(const Func func) const {
+    for (auto const &entry : _byAddress) {
+      func(Span(entry.first, entry.second.length));
+    }
+  }
+
+  void clear() {
+    _byAddress.clear();
+    _bySize.clear();
+    _byStamp.clear();
+    _pageCount = 0;
+  }
+
+  inline bool empty() const {
+    return _byAddress.empty();
+  }
+
+  // number of distinct (coalesced) spans
+  inline size_t size() const {
+    return _byAddress.size();
+  }
+
+  // total number of pages across all spans
+  inline size_t pageCount() const {
+    return _pageCount;
+  }
+
+private:
+  struct Entry {
+    Length length;
+    uint64_t stamp;
+  };
+
+  typedef internal::map<Offset, Entry>::iterator AddressIterator;
+
+  void erase(AddressIterator it) {
+    _bySize.erase(std::make_pair(it->second.length, it->first));
+    _byStamp.erase(std::make_pair(it->second.stamp, it->first));
+    _pageCount -= it->second.length;
+    _byAddress.erase(it);
+  }
+
+  internal::map<Offset, Entry> _byAddress{};
+  internal::set<std::pair<Length, Offset>> _bySize{};
+  internal::set<std::pair<uint64_t, Offset>> _byStamp{};
+  size_t _pageCount{0};
+};
+
+}  // namespace mesh
+
+#endif  // MESH_FREE_SPAN_SET_H
@@ -9,11 +9,17 @@
 
 #include <algorithm>
 #include <array>
+#include <limits>
 #include <mutex>
 
+#include "alloc_recorder.h"
+#include "heap_dump.h"
+#include "heap_profiler.h"
 #include "internal.h"
 #include "meshable_arena.h"
 #include "mini_heap.h"
+#include "stats_segment.h"
+#include "trace.h"
 
 #include "heaplayers.h"
 
@@ -80,6 +86,64 @@ public:
   size_t mhFreeCount;
   size_t mhAllocCount;
   size_t mhHighWaterMark;
+  // passes of meshAllSizeClassesLocked that got as far as meshing
+  size_t meshPassCount;
+  uint64_t meshPassLastNs;
+  uint64_t meshPassTotalNs;
+  uint64_t meshPassMaxNs;
+  // writes that faulted on a span being meshed, and how long the
+  // segfault handler waited for those meshes to finish
+  atomic<uint64_t> meshFaultCount;
+  atomic<uint64_t> meshFaultWaitNs;
+  atomic<uint64_t> meshFaultMaxWaitNs;
+};
+
+// cumulative events for one size class.  They are only updated with
+// that size class's lock held, so they add no contention of their own;
+// they are atomic so they can be read without it.
+struct alignas(CACHELINE_SIZE) SizeClassCounters {
+  atomic<uint64_t> refillCount{0};  // times a thread-local heap was refilled
+  atomic<uint64_t> flushCount{0};   // times a thread-local heap gave its miniheaps back
+  atomic<uint64_t> meshCount{0};    // spans meshed away
+};
+
+// a point-in-time view of one size class, see GlobalHeap::collectStats
+struct SizeClassStats {
+  size_t objectSize;
+  size_t objectCount;  // objects per span
+  size_t spanSize;     // bytes per span
+  size_t inUseObjects;
+  size_t inUseBytes;
+  // physical spans, by the state of their miniheap
+  size_t spans;
+  size_t emptySpans;
+  size_t partialSpans;
+  size_t fullSpans;
+  size_t attachedSpans;
+  // additional virtual spans that share a physical span after meshing
+  size_t meshedSpans;
+  uint64_t refillCount;
+  uint64_t flushCount;
+  uint64_t meshCount;
+};
+
+struct HeapStats {
+  std::array<SizeClassStats, kNumBins> sizeClasses;
+  size_t largeCount;  // including huge allocations
+  size_t largeBytes;
+  size_t hugeCount;  // mapped outside the arena
+  size_t hugeBytes;
+  size_t allocated;  // bytes in live objects, including large allocations
+  size_t active;     // bytes in spans holding at least one live object
+  size_t metadata;   // bytes of miniheap metadata
+  size_t mapped;     // bytes of the arena not returned to the OS
+  size_t dirty;      // free bytes not yet returned to the OS
+  size_t freeSpanCount;
+  size_t cachedBytes;     // freed large spans held in thread mid-size caches
+  size_t arenaMappedMax;  // peak of mapped, not counting huge allocations
+  size_t arenaExtent;     // bytes of the arena handed out so far
+  size_t hugeCountMax;    // peaks of hugeCount and hugeBytes
+  size_t hugeBytesMax;
 };
 
 template <size_t PageSize>
@@ -100,12 +164,13 @@ public:
   class AllLocksGuard {
   private:
     DISALLOW_COPY_AND_ASSIGN(AllLocksGuard);
-    std::array<mutex, kNumBins> &_locks;
-    mutex &_largeLock;
-    mutex &_arenaLockRef;
+    std::array<InstrumentedMutex, kNumBins> &_locks;
+    InstrumentedMutex &_largeLock;
+    InstrumentedMutex &_arenaLockRef;
 
   public:
-    AllLocksGuard(std::array<mutex, kNumBins> &locks, mutex &largeLock, mutex &arenaLockRef)
+    AllLocksGuard(std::array<InstrumentedMutex, kNumBins> &locks, InstrumentedMutex &largeLock,
+                  InstrumentedMutex &arenaLockRef)
         : _locks(locks), _largeLock(largeLock), _arenaLockRef(arenaLockRef) {
       // Lock ordering: size-classes[0..N-1] -> large -> arena
       // This allows the fast path (reusing miniheaps) to only acquire size-class lock,
@@ -130,15 +195,36 @@ public:
   GlobalHeap() : Super(), _maxObjectSize(SizeMap::ByteSizeForClass(kNumBins - 1)), _lastMesh{time::now()} {
   }
 
-  inline void dumpStrings() const {
-    AllLocksGuard allLocks(_miniheapLocks, _largeAllocLock, _arenaLock);
-
-    mesh::debug("TODO: reimplement printOccupancy\n");
-    // for (size_t i = 0; i < kNumBins; i++) {
-    //   _littleheaps[i].printOccupancy();
-    // }
+  // write every miniheap's span, state and occupancy bitmap to fd in
+  // the format described in heap_dump.h.  The arena lock is held for
+  // at most kArenaWalkBatchPages pages at a time, and never while
+  // writing.  Returns 0 on success.
+  int dumpHeap(int fd) const;
+  int dumpHeap(const char *path) const;
+  // dump to "<prefix>.<pid>.<seq>.meshdump", where prefix comes from
+  // MESH_HEAP_DUMP_PREFIX (default "mesh").  Used on SIGDUMP.
+  int dumpHeapToDefaultPath();
+
+  // fill stats from the current state of the heap.  Like dumpHeap,
+  // this only holds the arena lock for short stretches, so the result
+  // is approximate if other threads are allocating.
+  void collectStats(HeapStats &stats) const;
+
+  // create the memfd described in stats_segment.h.  publishStats()
+  // then refreshes it; the background thread does so every
+  // kStatsSegmentPeriodMs.  Returns false if it couldn't be created.
+  bool openStatsSegment();
+  void publishStats();
+
+  inline bool hasStatsSegment() const {
+    return _statsSegment != nullptr;
   }
 
+  // return as much memory to the OS as possible within budget: free
+  // empty miniheaps, mesh, then release dirty pages oldest first.
+  // Returns the number of bytes released.
+  size_t trim(std::chrono::milliseconds budget);
+
   inline void flushAllBins() {
     for (size_t sizeClass = 0; sizeClass < kNumBins; sizeClass++) {
       flushBinLocked(sizeClass);
@@ -190,9 +276,13 @@ public:
       return nullptr;
     }
 
+    if (unlikely(pageCount >= hugeThreshold() / PageSize)) {
+      return hugeAlloc(pageCount * PageSize, pageAlignment * PageSize);
+    }
+
     // Lock ordering: large alloc lock -> arena lock
-    lock_guard<mutex> lock(_largeAllocLock);
-    lock_guard<mutex> arenaLock(_arenaLock);
+    lock_guard<InstrumentedMutex> lock(_largeAllocLock);
+    lock_guard<InstrumentedMutex> arenaLock(_arenaLock);
 
     const size_t pageSize = getPageSize();
     MiniHeapT *mh = allocMiniheapLocked(-1, pageCount, 1, pageCount * pageSize, pageAlignment);
@@ -206,6 +296,79 @@ public:
     return ptr;
   }
 
+  // huge allocations are mapped directly by _hugeHeap, with no
+  // miniheap and no arena pages.  Pointers outside the arena are only
+  // looked up there while there are any.
+  inline size_t hugeThreshold() const {
+    return _hugeThreshold.load(std::memory_order_relaxed);
+  }
+
+  // 0 turns the huge path off
+  inline void setHugeThreshold(size_t threshold) {
+    _hugeThreshold.store(threshold == 0 ? std::numeric_limits<size_t>::max() : threshold,
+                         std::memory_order_relaxed);
+  }
+
+  inline void setHugePages(bool hugePages) {
+    lock_guard<InstrumentedMutex> lock(_hugeLock);
+    _hugeHeap.setHugePages(hugePages);
+  }
+
+  inline void *hugeAlloc(size_t sz, size_t alignment) {
+    lock_guard<InstrumentedMutex> lock(_hugeLock);
+    void *ptr = _hugeHeap.malloc(sz, alignment);
+    if (likely(ptr != nullptr)) {
+      _hugeCount.store(_hugeHeap.count(), std::memory_order_relaxed);
+      _hugeBytes.fetch_add(_hugeHeap.getSize(ptr), std::memory_order_relaxed);
+      updateHugePeaksLocked();
+    }
+    return ptr;
+  }
+
+  inline bool isHuge(void *ptr) const {
+    if (likely(_hugeCount.load(std::memory_order_relaxed) == 0)) {
+      return false;
+    }
+    lock_guard<InstrumentedMutex> lock(_hugeLock);
+    return _hugeHeap.inBounds(ptr);
+  }
+
+  inline size_t hugeSize(const void *ptr) const {
+    if (likely(_hugeCount.load(std::memory_order_relaxed) == 0)) {
+      return 0;
+    }
+    lock_guard<InstrumentedMutex> lock(_hugeLock);
+    return _hugeHeap.getSize(ptr);
+  }
+
+  // ptr must be a huge allocation; grows or shrinks it with mremap
+  inline void *hugeRealloc(void *ptr, size_t sz) {
+    lock_guard<InstrumentedMutex> lock(_hugeLock);
+    const size_t oldLength = _hugeHeap.getSize(ptr);
+    void *newPtr = _hugeHeap.realloc(ptr, sz);
+    if (likely(newPtr != nullptr)) {
+      _hugeBytes.fetch_add(_hugeHeap.getSize(newPtr) - oldLength, std::memory_order_relaxed);
+      updateHugePeaksLocked();
+    }
+    return newPtr;
+  }
+
+  // returns false if ptr isn't a huge allocation
+  inline bool freeHuge(void *ptr) {
+    if (likely(_hugeCount.load(std::memory_order_relaxed) == 0)) {
+      return false;
+    }
+    lock_guard<InstrumentedMutex> lock(_hugeLock);
+    const size_t length = _hugeHeap.getSize(ptr);
+    if (length == 0) {
+      return false;
+    }
+    _hugeHeap.free(ptr);
+    _hugeCount.store(_hugeHeap.count(), std::memory_order_relaxed);
+    _hugeBytes.fetch_sub(length, std::memory_order_relaxed);
+    return true;
+  }
+
   inline MiniHeapListEntryT *freelistFor(uint8_t freelistId, int sizeClass) {
     switch (freelistId) {
     case list::Empty:
@@ -356,7 +519,9 @@ public:
     const int sizeClass = miniheaps[0]->sizeClass();
     d_assert(sizeClass >= 0 && sizeClass < kNumBins);
 
-    lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+    lock_guard<InstrumentedMutex> lock(_miniheapLocks[sizeClass]);
+    _sizeClassCounters[sizeClass].flushCount++;
+    MESH_TRACE(Release, release, sizeClass, miniheaps.size());
     drainPendingPartialLocked(sizeClass);
     for (auto mh : miniheaps) {
       d_assert(mh->sizeClass() == sizeClass);
@@ -410,6 +575,17 @@ public:
     return fillFromList(miniheaps, current, _emptyFreelist[sizeClass], bytesFree);
   }
 
+  // number of objects in each span of a size class
+  static inline size_t objectCountFor(size_t objectSize) {
+    // if we have objects bigger than the size of a page, allocate
+    // multiple pages to amortize the cost of creating a
+    // miniheap/globally locking the heap.  For example, asking for
+    // 2048 byte objects would allocate 4 4KB pages (or 16KB pages on Apple Silicon).
+    // Cap at 1024 to fit within the MiniHeap bitmap size limit (128 bytes = 1024 bits)
+    const size_t bitmapLimit = PageSize / kMinObjectSize;
+    return min(max(PageSize / objectSize, static_cast<size_t>(kMinStringLen)), bitmapLimit);
+  }
+
   template <uint32_t Size>
   inline void allocSmallMiniheaps(int sizeClass, uint32_t objectSize, FixedArray<MiniHeapT, Size> &miniheaps,
                                   pid_t current) {
@@ -426,7 +602,8 @@ public:
     // Lock ordering: size-class lock -> arena lock
     // We acquire size-class lock first and try to reuse existing miniheaps.
     // Only if we need new miniheaps do we acquire the arena lock.
-    lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+    lock_guard<InstrumentedMutex> lock(_miniheapLocks[sizeClass]);
+    _sizeClassCounters[sizeClass].refillCount++;
 
     // Drain pending partial list so freed miniheaps are immediately available
     drainPendingPartialLocked(sizeClass);
@@ -441,20 +618,14 @@ public:
     // Fast path: check our bins for a miniheap to reuse (no arena lock needed)
     auto bytesFree = selectForReuse(sizeClass, miniheaps, current);
     if (bytesFree >= kMiniheapRefillGoalSize || miniheaps.full()) {
+      MESH_TRACE(Refill, refill, sizeClass, miniheaps.size());
       return;
     }
 
     // Slow path: need to allocate new miniheaps, acquire arena lock
-    lock_guard<mutex> arenaLock(_arenaLock);
+    lock_guard<InstrumentedMutex> arenaLock(_arenaLock);
 
-    // if we have objects bigger than the size of a page, allocate
-    // multiple pages to amortize the cost of creating a
-    // miniheap/globally locking the heap.  For example, asking for
-    // 2048 byte objects would allocate 4 4KB pages (or 16KB pages on Apple Silicon).
-    // Cap at 1024 to fit within the MiniHeap bitmap size limit (128 bytes = 1024 bits)
-    const size_t bitmapLimit = PageSize / kMinObjectSize;
-    const size_t objectCount =
-        min(max(getPageSize() / objectSize, static_cast<size_t>(kMinStringLen)), static_cast<size_t>(bitmapLimit));
+    const size_t objectCount = objectCountFor(objectSize);
     const size_t pageCount = PageCount(objectSize * objectCount);
 
     while (bytesFree < kMiniheapRefillGoalSize && !miniheaps.full()) {
@@ -466,7 +637,7 @@ public:
       bytesFree += mh->bytesFree();
     }
 
-    return;
+    MESH_TRACE(Refill, refill, sizeClass, miniheaps.size());
   }
 
   // large, page-multiple allocations
@@ -519,13 +690,13 @@ public:
     const int sizeClass = mh->sizeClass();
     // Lock ordering: size-class/large lock -> arena lock
     if (sizeClass >= 0) {
-      lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
-      lock_guard<mutex> arenaLock(_arenaLock);
+      lock_guard<InstrumentedMutex> lock(_miniheapLocks[sizeClass]);
+      lock_guard<InstrumentedMutex> arenaLock(_arenaLock);
       freeMiniheapLocked(mh, untrack);
     } else {
       // Large allocation
-      lock_guard<mutex> lock(_largeAllocLock);
-      lock_guard<mutex> arenaLock(_arenaLock);
+      lock_guard<InstrumentedMutex> lock(_largeAllocLock);
+      lock_guard<InstrumentedMutex> arenaLock(_arenaLock);
       freeMiniheapLocked(mh, untrack);
     }
   }
@@ -586,12 +757,12 @@ public:
     // Look up miniheap first (doesn't require lock)
     auto mh = miniheapFor(ptr);
     if (unlikely(!mh)) {
-      return 0;
+      return hugeSize(ptr);
     }
 
     const int sizeClass = mh->sizeClass();
     if (sizeClass >= 0) {
-      lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+      lock_guard<InstrumentedMutex> lock(_miniheapLocks[sizeClass]);
       // Re-verify miniheap is still valid after acquiring lock
       mh = miniheapFor(ptr);
       if (likely(mh)) {
@@ -599,7 +770,7 @@ public:
       }
     } else {
       // Large allocation
-      lock_guard<mutex> lock(_largeAllocLock);
+      lock_guard<InstrumentedMutex> lock(_largeAllocLock);
       mh = miniheapFor(ptr);
       if (likely(mh)) {
         return mh->objectSize();
@@ -619,6 +790,37 @@ public:
     _meshPeriodMs.store(period, std::memory_order_release);
   }
 
+  inline HeapProfiler &profiler() {
+    return _profiler;
+  }
+
+  // a zero decay window disables time-based purging of dirty pages
+  void setDirtyDecayMs(std::chrono::milliseconds window) {
+    _dirtyDecayMs.store(window, std::memory_order_release);
+  }
+
+  void setLazyRelease(bool lazy) {
+    lock_guard<InstrumentedMutex> arenaLock(_arenaLock);
+    Super::setLazyRelease(lazy);
+  }
+
+  std::chrono::milliseconds dirtyDecayMs() const {
+    return _dirtyDecayMs.load(std::memory_order_acquire);
+  }
+
+  // called periodically from the background thread: return dirty
+  // pages to the OS along the decay curve for the current window.
+  size_t decayDirty() {
+    const auto window = dirtyDecayMs();
+    if (window == kZeroMs) {
+      return 0;
+    }
+
+    const uint64_t now = Super::decayStamp();
+    lock_guard<InstrumentedMutex> arenaLock(_arenaLock);
+    return Super::decayDirty(now, window.count());
+  }
+
   void lock() {
     // Acquire all locks in consistent order: size-classes -> large -> arena
     for (size_t i = 0; i < kNumBins; i++) {
@@ -626,10 +828,12 @@ public:
     }
     _largeAllocLock.lock();
     _arenaLock.lock();
+    _hugeLock.lock();
   }
 
   void unlock() {
     // Release in reverse order
+    _hugeLock.unlock();
     _arenaLock.unlock();
     _largeAllocLock.unlock();
     for (size_t i = kNumBins; i > 0; i--) {
@@ -696,14 +900,25 @@ public:
 
     const int sizeClass = mh->sizeClass();
     if (sizeClass >= 0) {
-      lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+      lock_guard<InstrumentedMutex> lock(_miniheapLocks[sizeClass]);
       return miniheapFor(ptr) != nullptr;
     } else {
-      lock_guard<mutex> lock(_largeAllocLock);
+      lock_guard<InstrumentedMutex> lock(_largeAllocLock);
       return miniheapFor(ptr) != nullptr;
     }
   }
 
+  // called from the segfault handler after okToProceed let a write
+  // through
+  void recordMeshFault(uint64_t waitNs) {
+    _stats.meshFaultCount.fetch_add(1, std::memory_order_relaxed);
+    _stats.meshFaultWaitNs.fetch_add(waitNs, std::memory_order_relaxed);
+    uint64_t max = _stats.meshFaultMaxWaitNs.load(std::memory_order_relaxed);
+    while (waitNs > max &&
+           !_stats.meshFaultMaxWaitNs.compare_exchange_weak(max, waitNs, std::memory_order_relaxed)) {
+    }
+  }
+
   inline internal::vector<MiniHeapT *> meshingCandidatesLocked(int sizeClass) const {
     // FIXME: duplicated with code in halfSplit
     internal::vector<MiniHeapT *> bucket{};
@@ -721,15 +936,101 @@ public:
   }
 
 private:
-  // check for meshes in all size classes -- must be called LOCKED
-  void meshAllSizeClassesLocked();
+  // calls func(mh) on each miniheap in arena order, skipping spans that
+  // were meshed away (they are covered by the miniheap they were meshed
+  // into).  func runs with only _arenaLock held, which is dropped after
+  // at most kArenaWalkBatchPages pages, or when func returns false (mh
+  // is then visited again in the next batch).  afterBatch() runs after
+  // each batch with no locks held; the walk stops if it returns false.
+  template <typename Func, typename AfterBatch>
+  void forEachMiniheapBatched(const Func func, const AfterBatch afterBatch) const {
+    Offset off = 0;
+    bool done = false;
+    while (!done) {
+      {
+        lock_guard<InstrumentedMutex> lock(_arenaLock);
+        const Offset end = Super::endOffset();
+        const Offset batchEnd = off + min(static_cast<size_t>(end - min(off, end)), kArenaWalkBatchPages);
+        while (off < batchEnd) {
+          auto mh = reinterpret_cast<const MiniHeapT *>(Super::miniheapForArenaOffset(off));
+          if (mh == nullptr || mh->span().offset != off) {
+            off++;
+            continue;
+          }
+          if (!func(mh)) {
+            break;
+          }
+          off += mh->span().length;
+        }
+        done = off >= end;
+      }
+
+      if (!afterBatch()) {
+        return;
+      }
+    }
+  }
+
+  // handles the jemalloc-compatible statistics names.  Returns false if
+  // name isn't one of them.
+  bool statsMallctl(const char *name, void *oldp, size_t *oldlenp, int &result);
+
+  // handles mesh.lock_stats and mesh.locks.<lock>.<field>.  Returns
+  // false if name isn't one of them.
+  bool lockStatsMallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen, int &result);
+
+  // calls func(name, mutex) for each lock that lock stats report on
+  template <typename Func>
+  void forEachLock(Func func) const {
+    char name[16];
+    for (size_t i = 0; i < kNumBins; i++) {
+      snprintf(name, sizeof(name), "bin.%zu", i);
+      func(name, _miniheapLocks[i]);
+    }
+    func("large", _largeAllocLock);
+    func("arena", _arenaLock);
+    func("huge", _hugeLock);
+    func("internal", internal::heapMutex());
+  }
+
+  // check for meshes in all size classes -- must be called LOCKED.
+  // Size classes are skipped once deadline has passed.  Unless
+  // releaseDirty is false, dirty pages are returned to the OS before
+  // and after meshing.
+  void meshAllSizeClassesLocked(time::time_point deadline = time::time_point::max(), bool releaseDirty = true);
   // meshSizeClassLocked returns the number of merged sets found
   size_t meshSizeClassLocked(size_t sizeClass, MergeSetArray<PageSize> &mergeSets, SplitArray<PageSize> &left,
                              SplitArray<PageSize> &right);
 
+  // must be called with _hugeLock held
+  inline void updateHugePeaksLocked() {
+    const size_t count = _hugeCount.load(std::memory_order_relaxed);
+    if (count > _hugeCountMax.load(std::memory_order_relaxed)) {
+      _hugeCountMax.store(count, std::memory_order_relaxed);
+    }
+    const size_t bytes = _hugeBytes.load(std::memory_order_relaxed);
+    if (bytes > _hugeBytesMax.load(std::memory_order_relaxed)) {
+      _hugeBytesMax.store(bytes, std::memory_order_relaxed);
+    }
+  }
+
   const size_t _maxObjectSize;
   atomic_size_t _meshPeriod{kDefaultMeshPeriod};
   std::atomic<std::chrono::milliseconds> _meshPeriodMs{kMeshPeriodMs};
+  std::atomic<std::chrono::milliseconds> _dirtyDecayMs{kDirtyDecayMs};
+
+  HeapProfiler _profiler{};
+  atomic_size_t _heapDumpSeq{0};
+
+  std::array<SizeClassCounters, kNumBins> _sizeClassCounters{};
+
+  // like jemalloc, mallctl statistics are read from a snapshot that is
+  // refreshed by writing to "epoch"
+  mutable mutex _statsLock{};
+  HeapStats _statsSnapshot{};
+  uint64_t _statsEpoch{0};
+
+  StatsSegment *_statsSegment{nullptr};
 
   atomic_size_t ATTRIBUTE_ALIGNED(CACHELINE_SIZE) _lastMeshEffective{0};
 
@@ -756,11 +1057,19 @@ private:
   std::array<CachelinePaddedAtomicMiniHeapID, kNumBins> _pendingPartialHead{};
 
   // Per-size-class locks to reduce contention on freelists
-  mutable std::array<mutex, kNumBins> _miniheapLocks{};
+  mutable std::array<InstrumentedMutex, kNumBins> _miniheapLocks{};
   // Separate lock for large allocations (sizeClass == -1)
-  mutable mutex _largeAllocLock{};
+  mutable InstrumentedMutex _largeAllocLock{};
   // Lock for shared arena/allocator state (pageAlloc, trackMiniHeap, _mhAllocator)
-  mutable mutex _arenaLock{};
+  mutable InstrumentedMutex _arenaLock{};
+  // Lock for _hugeHeap; never held with the others, except by lock()
+  mutable InstrumentedMutex _hugeLock{};
+  MmapHeap _hugeHeap{};
+  atomic_size_t _hugeThreshold{kDefaultHugeThreshold};
+  atomic_size_t _hugeCount{0};
+  atomic_size_t _hugeBytes{0};
+  atomic_size_t _hugeCountMax{0};
+  atomic_size_t _hugeBytesMax{0};
 
   GlobalHeapStats _stats{};
 
@@ -6,10 +6,15 @@
 #ifndef MESH_GLOBAL_HEAP_IMPL_H
 #define MESH_GLOBAL_HEAP_IMPL_H
 
+#include <errno.h>
+#include <limits.h>
+
+#include <cstring>
 #include <utility>
 
 #include "global_heap.h"
 
+#include "measure_rss.h"
 #include "meshing.h"
 #include "runtime.h"
 
@@ -54,6 +59,9 @@ void GlobalHeap<PageSize>::free(void *ptr) {
   size_t startEpoch{0};
   auto mh = miniheapForWithEpoch(ptr, startEpoch);
   if (unlikely(!mh)) {
+    if (freeHuge(ptr)) {
+      return;
+    }
 #ifndef NDEBUG
     if (ptr != nullptr) {
       debug("FIXME: free of untracked ptr %p", ptr);
@@ -70,18 +78,26 @@ void GlobalHeap<PageSize>::freeFor(MiniHeapT *mh, void *ptr, size_t startEpoch)
     return;
   }
 
+  // not in the arena
   if (unlikely(!mh)) {
+    freeHuge(ptr);
     return;
   }
 
+  // every free path ends up here, including threads without a local
+  // heap, so sampled objects leave the profile however they are freed
+  if (unlikely(mh->isSampled())) {
+    _profiler.recordFree(ptr);
+  }
+
   // large objects are tracked with a miniheap per object and don't
   // trigger meshing, because they are multiples of the page size.
   // This can also include, for example, single page allocations w/
   // 16KB alignment.
   if (mh->isLargeAlloc()) {
     // Lock ordering: large alloc lock -> arena lock
-    lock_guard<mutex> lock(_largeAllocLock);
-    lock_guard<mutex> arenaLock(_arenaLock);
+    lock_guard<InstrumentedMutex> lock(_largeAllocLock);
+    lock_guard<InstrumentedMutex> arenaLock(_arenaLock);
     freeMiniheapLocked(mh, false);
     return;
   }
@@ -115,7 +131,7 @@ void GlobalHeap<PageSize>::freeFor(MiniHeapT *mh, void *ptr, size_t startEpoch)
     // a mesh was started in between when we looked up our miniheap
     // and now.  synchronize to avoid races
     d_assert(sizeClass >= 0 && sizeClass < kNumBins);
-    lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+    lock_guard<InstrumentedMutex> lock(_miniheapLocks[sizeClass]);
     drainPendingPartialLocked(sizeClass);
 
     const auto origMh = mh;
@@ -177,7 +193,7 @@ void GlobalHeap<PageSize>::freeFor(MiniHeapT *mh, void *ptr, size_t startEpoch)
         shouldMesh = true;
       } else {
         // remaining == 0: need lock for Empty transition
-        lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+        lock_guard<InstrumentedMutex> lock(_miniheapLocks[sizeClass]);
         drainPendingPartialLocked(sizeClass);
 
         // there are 2 ways we could have raced with meshing:
@@ -249,8 +265,70 @@ void GlobalHeap<PageSize>::freeFor(MiniHeapT *mh, void *ptr, size_t startEpoch)
   }
 }
 
+// copies a statistic of exactly type T out to a mallctl caller
+template <typename T>
+static inline int mallctlRead(void *oldp, size_t *oldlenp, T value) {
+  if (!oldp || !oldlenp || *oldlenp != sizeof(T)) {
+    return -1;
+  }
+  memcpy(oldp, &value, sizeof(T));
+  return 0;
+}
+
 template <size_t PageSize>
 int GlobalHeap<PageSize>::mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
+  // like jemalloc, takes an optional filename: a const char * passed by
+  // pointer through newp
+  if (strcmp(name, "prof.dump") == 0) {
+    if (newp && newlen >= sizeof(const char *)) {
+      return _profiler.dump(*reinterpret_cast<const char **>(newp));
+    }
+    return _profiler.dumpToDefaultPath();
+  } else if (strcmp(name, "heap.dump") == 0) {
+    if (newp && newlen >= sizeof(const char *)) {
+      return dumpHeap(*reinterpret_cast<const char **>(newp));
+    }
+    return dumpHeapToDefaultPath();
+  } else if (strcmp(name, "trace.dump") == 0) {
+    if (newp && newlen >= sizeof(const char *)) {
+      return trace::dump(*reinterpret_cast<const char **>(newp));
+    }
+    return trace::dumpToDefaultPath();
+  } else if (strcmp(name, "trace.active") == 0) {
+    int result = oldp ? mallctlRead<bool>(oldp, oldlenp, trace::Enabled.load(std::memory_order_relaxed)) : 0;
+    if (result == 0 && newp) {
+      if (newlen != sizeof(bool)) {
+        return -1;
+      }
+      trace::Enabled.store(*reinterpret_cast<bool *>(newp), std::memory_order_relaxed);
+    }
+    return result;
+  } else if (strcmp(name, "record.start") == 0) {
+    if (newp && newlen >= sizeof(const char *)) {
+      return recorder::start(*reinterpret_cast<const char **>(newp));
+    }
+    const char *prefix = getenv("MESH_RECORD_PREFIX");
+    return recorder::startWithPrefix(prefix != nullptr ? prefix : "mesh");
+  } else if (strcmp(name, "record.stop") == 0) {
+    return recorder::stop();
+  } else if (strcmp(name, "epoch") == 0) {
+    // refreshes the statistics snapshot, as in jemalloc
+    lock_guard<mutex> lock(_statsLock);
+    if (newp) {
+      collectStats(_statsSnapshot);
+      _statsEpoch++;
+    }
+    return oldp ? mallctlRead<uint64_t>(oldp, oldlenp, _statsEpoch) : 0;
+  }
+
+  int result = 0;
+  if (statsMallctl(name, oldp, oldlenp, result)) {
+    return result;
+  }
+  if (lockStatsMallctl(name, oldp, oldlenp, newp, newlen, result)) {
+    return result;
+  }
+
   if (!oldp || !oldlenp || *oldlenp < sizeof(size_t))
     return -1;
 
@@ -261,6 +339,12 @@ int GlobalHeap<PageSize>::mallctl(const char *name, void *oldp, size_t *oldlenp,
     // scavenge() acquires locks internally
     scavenge(true);
     return 0;
+  } else if (strcmp(name, "prof.interval") == 0) {
+    *statp = _profiler.interval();
+    if (newp && newlen >= sizeof(size_t)) {
+      _profiler.setInterval(*reinterpret_cast<size_t *>(newp));
+    }
+    return 0;
   } else if (strcmp(name, "mesh.compact") == 0) {
     // Acquire all locks for meshing, then release for scavenge
     {
@@ -282,6 +366,21 @@ int GlobalHeap<PageSize>::mallctl(const char *name, void *oldp, size_t *oldlenp,
     auto newVal = reinterpret_cast<size_t *>(newp);
     _meshPeriod = *newVal;
     // resetNextMeshCheck();
+  } else if (strcmp(name, "mesh.huge_threshold") == 0) {
+    *statp = hugeThreshold();
+    if (newp && newlen >= sizeof(size_t)) {
+      setHugeThreshold(*reinterpret_cast<size_t *>(newp));
+    }
+  } else if (strcmp(name, "stats.huge_count") == 0) {
+    *statp = _hugeCount.load(std::memory_order_relaxed);
+  } else if (strcmp(name, "stats.huge_bytes") == 0) {
+    *statp = _hugeBytes.load(std::memory_order_relaxed);
+  } else if (strcmp(name, "mesh.dirty_decay_ms") == 0) {
+    *statp = dirtyDecayMs().count();
+    if (newp && newlen >= sizeof(size_t)) {
+      auto newVal = reinterpret_cast<size_t *>(newp);
+      setDirtyDecayMs(std::chrono::milliseconds{*newVal});
+    }
   } else if (strcmp(name, "arena") == 0) {
     // not sure what this should do
   } else if (strcmp(name, "stats.resident") == 0) {
@@ -289,28 +388,28 @@ int GlobalHeap<PageSize>::mallctl(const char *name, void *oldp, size_t *oldlenp,
     // mesh::debug("measurePssKiB: %zu KiB", pss);
 
     *statp = pss * 1024;  // originally in KB
-  } else if (strcmp(name, "stats.active") == 0) {
-    // all miniheaps at least partially full
-    size_t sz = 0;
-    // for (size_t i = 0; i < kNumBins; i++) {
-    //   const auto count = _littleheaps[i].nonEmptyCount();
-    //   if (count == 0)
-    //     continue;
-    //   sz += count * _littleheaps[i].objectSize() * _littleheaps[i].objectCount();
-    // }
-    *statp = sz;
-  } else if (strcmp(name, "stats.allocated") == 0) {
-    // TODO: revisit this
-    // same as active for us, for now -- memory not returned to the OS
-    size_t sz = 0;
-    for (size_t i = 0; i < kNumBins; i++) {
-      // const auto &bin = _littleheaps[i];
-      // const auto count = bin.nonEmptyCount();
-      // if (count == 0)
-      //   continue;
-      // sz += bin.objectSize() * bin.allocatedObjectCount();
-    }
-    *statp = sz;
+  } else if (strcmp(name, "stats.scavenge_count") == 0) {
+    *statp = this->scavengeStats().count;
+  } else if (strcmp(name, "stats.scavenge_ns") == 0) {
+    *statp = this->scavengeStats().totalNs;
+  } else if (strcmp(name, "stats.scavenge_max_ns") == 0) {
+    *statp = this->scavengeStats().maxNs;
+  } else if (strcmp(name, "stats.scavenge_syscalls") == 0) {
+    *statp = this->scavengeStats().syscalls;
+  } else if (strcmp(name, "stats.mesh_count") == 0) {
+    *statp = _stats.meshCount;
+  } else if (strcmp(name, "stats.mesh_passes") == 0) {
+    *statp = _stats.meshPassCount;
+  } else if (strcmp(name, "stats.mesh_pass_last_ns") == 0) {
+    *statp = _stats.meshPassLastNs;
+  } else if (strcmp(name, "stats.mesh_pass_max_ns") == 0) {
+    *statp = _stats.meshPassMaxNs;
+  } else if (strcmp(name, "stats.mesh_faults") == 0) {
+    *statp = _stats.meshFaultCount.load(std::memory_order_relaxed);
+  } else if (strcmp(name, "stats.mesh_fault_wait_ns") == 0) {
+    *statp = _stats.meshFaultWaitNs.load(std::memory_order_relaxed);
+  } else if (strcmp(name, "stats.mesh_fault_max_wait_ns") == 0) {
+    *statp = _stats.meshFaultMaxWaitNs.load(std::memory_order_relaxed);
   }
   return 0;
 }
@@ -327,6 +426,10 @@ void GlobalHeap<PageSize>::meshLocked(MiniHeapT *dst, MiniHeapT *&src) {
     // marks srcSpans read-only
     const auto srcSpan = reinterpret_cast<void *>(mh->getSpanStart(this->arenaBegin()));
     Super::beginMesh(dstSpanStart, srcSpan, dstSpanSize);
+    // sampled objects will be freed through dst from now on
+    if (mh->isSampled()) {
+      dst->setSampled();
+    }
     return false;
   });
 
@@ -417,11 +520,12 @@ size_t GlobalHeap<PageSize>::meshSizeClassLocked(size_t sizeClass, MergeSetArray
   // of mesh above)
   flushBinLocked(sizeClass);
 
+  _sizeClassCounters[sizeClass].meshCount += meshCount;
   return meshCount;
 }
 
 template <size_t PageSize>
-void GlobalHeap<PageSize>::meshAllSizeClassesLocked() {
+void GlobalHeap<PageSize>::meshAllSizeClassesLocked(time::time_point deadline, bool releaseDirty) {
   static MergeSetArray<PageSize> *MergeSetsPtr = []() {
     void *ptr =
         mmap(nullptr, sizeof(MergeSetArray<PageSize>), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -454,7 +558,11 @@ void GlobalHeap<PageSize>::meshAllSizeClassesLocked() {
   // if we have freed but not reset meshed mappings, this will reset
   // them to the identity mapping, ensuring we don't blow past our VMA
   // limit (which is why we set the force flag to true)
-  Super::scavenge(true);
+  if (releaseDirty) {
+    Super::scavenge(true);
+  } else {
+    Super::resetFreedMeshes();
+  }
 
   if (!_lastMeshEffective.load(std::memory_order::memory_order_acquire)) {
     return;
@@ -466,7 +574,8 @@ void GlobalHeap<PageSize>::meshAllSizeClassesLocked() {
 
   lock_guard<EpochLock> epochLock(_meshEpoch);
 
-  // const auto start = time::now();
+  const auto start = std::chrono::steady_clock::now();
+  MESH_TRACE(MeshStart, mesh_start, 0, 0);
 
   // first, drain pending partial lists and clear out any free memory we might have
   for (size_t sizeClass = 0; sizeClass < kNumBins; sizeClass++) {
@@ -476,7 +585,7 @@ void GlobalHeap<PageSize>::meshAllSizeClassesLocked() {
 
   size_t totalMeshCount = 0;
 
-  for (size_t sizeClass = 0; sizeClass < kNumBins; sizeClass++) {
+  for (size_t sizeClass = 0; sizeClass < kNumBins && time::now() < deadline; sizeClass++) {
     totalMeshCount += meshSizeClassLocked(sizeClass, MergeSets, Left, Right);
   }
 
@@ -487,12 +596,520 @@ void GlobalHeap<PageSize>::meshAllSizeClassesLocked() {
   _lastMeshEffective = totalMeshCount > 256;
   _stats.meshCount += totalMeshCount;
 
-  Super::scavenge(true);
+  if (releaseDirty) {
+    Super::scavenge(true);
+  } else {
+    Super::resetFreedMeshes();
+  }
 
   _lastMesh.store(time::now(), std::memory_order_release);
 
-  // const std::chrono::duration<double> duration = _lastMesh - start;
-  // debug("mesh took %f, found %zu", duration.count(), totalMeshCount);
+  const uint64_t ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  MESH_TRACE(MeshEnd, mesh_end, totalMeshCount, ns);
+  _stats.meshPassCount++;
+  _stats.meshPassLastNs = ns;
+  _stats.meshPassTotalNs += ns;
+  if (ns > _stats.meshPassMaxNs) {
+    _stats.meshPassMaxNs = ns;
+  }
+}
+
+template <size_t PageSize>
+int GlobalHeap<PageSize>::dumpHeap(int fd) const {
+  constexpr size_t kMaxBitmapWords = (PageSize / kMinObjectSize + 63) / 64;
+  constexpr size_t kMaxRecordSize = sizeof(HeapDumpRecord) + kMaxBitmapWords * sizeof(uint64_t);
+  static_assert(kMaxBitmapWords <= UINT8_MAX, "bitmap word count must fit in a record");
+  static_assert(kMaxRecordSize <= kHeapDumpBufferSize, "buffer must hold at least one record");
+
+  HeapDumpHeader header{};
+  memcpy(header.magic, kHeapDumpMagic, sizeof(header.magic));
+  header.version = kHeapDumpVersion;
+  header.pageSize = PageSize;
+  header.arenaBegin = reinterpret_cast<uintptr_t>(this->arenaBegin());
+  header.pid = getpid();
+  if (!internal::writeAll(fd, &header, sizeof(header))) {
+    return -1;
+  }
+
+  // records are copied out a batch at a time and written with no
+  // locks held
+  char buf[kHeapDumpBufferSize];
+  size_t len = 0;
+  bool ok = true;
+  forEachMiniheapBatched(
+      [&](const MiniHeapT *mh) {
+        if (len + kMaxRecordSize > sizeof(buf)) {
+          return false;
+        }
+
+        const Span span = mh->span();
+        const uint32_t objectCount = mh->maxCount();
+
+        HeapDumpRecord record{};
+        record.objectSize = mh->objectSize();
+        record.id = miniheapIDFor(mh).value();
+        record.sizeClass = mh->isLargeAlloc() ? -1 : mh->sizeClass();
+        record.objectCount = objectCount;
+        record.inUseCount = mh->inUseCount();
+        record.spanOffset = span.offset;
+        record.spanLength = span.length;
+        record.meshCount = mh->meshCount();
+        record.flags = (mh->isAttached() ? heapdump::Attached : 0) | (mh->isLargeAlloc() ? heapdump::Large : 0) |
+                       (mh->isSampled() ? heapdump::Sampled : 0);
+        record.bitmapWords = (objectCount + 63) / 64;
+        memcpy(buf + len, &record, sizeof(record));
+        len += sizeof(record);
+
+        uint64_t words[kMaxBitmapWords] = {};
+        const auto &bitmap = mh->bitmap();
+        for (uint32_t i = 0; i < objectCount; i++) {
+          if (bitmap.isSet(i)) {
+            words[i / 64] |= 1ULL << (i % 64);
+          }
+        }
+        memcpy(buf + len, words, record.bitmapWords * sizeof(uint64_t));
+        len += record.bitmapWords * sizeof(uint64_t);
+
+        return true;
+      },
+      [&]() {
+        ok = len == 0 || internal::writeAll(fd, buf, len);
+        len = 0;
+        return ok;
+      });
+
+  return ok ? 0 : -1;
+}
+
+template <size_t PageSize>
+int GlobalHeap<PageSize>::dumpHeap(const char *path) const {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    debug("heap dump: couldn't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int result = dumpHeap(fd);
+  close(fd);
+  return result;
+}
+
+template <size_t PageSize>
+int GlobalHeap<PageSize>::dumpHeapToDefaultPath() {
+  const char *prefix = getenv("MESH_HEAP_DUMP_PREFIX");
+  if (prefix == nullptr) {
+    prefix = "mesh";
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.%d.%zu.meshdump", prefix, getpid(), _heapDumpSeq++);
+  return dumpHeap(path);
+}
+
+template <size_t PageSize>
+void GlobalHeap<PageSize>::collectStats(HeapStats &stats) const {
+  memset(&stats, 0, sizeof(stats));
+
+  for (size_t i = 0; i < kNumBins; i++) {
+    SizeClassStats &sc = stats.sizeClasses[i];
+    sc.objectSize = SizeMap::ByteSizeForClass(i);
+    sc.objectCount = objectCountFor(sc.objectSize);
+    sc.spanSize = PageCount(sc.objectSize * sc.objectCount) * PageSize;
+    sc.refillCount = _sizeClassCounters[i].refillCount.load(std::memory_order_relaxed);
+    sc.flushCount = _sizeClassCounters[i].flushCount.load(std::memory_order_relaxed);
+    sc.meshCount = _sizeClassCounters[i].meshCount.load(std::memory_order_relaxed);
+  }
+
+  forEachMiniheapBatched(
+      [&](const MiniHeapT *mh) {
+        if (mh->isLargeAlloc()) {
+          // freed spans kept in a thread's mid-size cache hold no object
+          if (mh->inUseCount() == 0) {
+            stats.cachedBytes += mh->spanSize();
+          } else {
+            stats.largeCount++;
+            stats.largeBytes += mh->spanSize();
+          }
+          return true;
+        }
+
+        SizeClassStats &sc = stats.sizeClasses[mh->sizeClass()];
+        const size_t inUse = mh->inUseCount();
+        sc.inUseObjects += inUse;
+        sc.spans++;
+        sc.meshedSpans += mh->meshCount() - 1;
+        if (inUse > 0) {
+          stats.active += mh->spanSize();
+        }
+
+        switch (mh->freelistId()) {
+        case list::Empty:
+          sc.emptySpans++;
+          break;
+        case list::Partial:
+          sc.partialSpans++;
+          break;
+        case list::Full:
+          // frees to a full miniheap queue it for the partial list
+          // without taking the size class lock
+          if (mh->isPending()) {
+            sc.partialSpans++;
+          } else {
+            sc.fullSpans++;
+          }
+          break;
+        case list::Attached:
+          sc.attachedSpans++;
+          break;
+        }
+        return true;
+      },
+      []() { return true; });
+
+  for (auto &sc : stats.sizeClasses) {
+    sc.inUseBytes = sc.inUseObjects * sc.objectSize;
+    stats.allocated += sc.inUseBytes;
+  }
+  stats.hugeCount = _hugeCount.load(std::memory_order_relaxed);
+  stats.hugeBytes = _hugeBytes.load(std::memory_order_relaxed);
+  stats.hugeCountMax = _hugeCountMax.load(std::memory_order_relaxed);
+  stats.hugeBytesMax = _hugeBytesMax.load(std::memory_order_relaxed);
+  stats.largeCount += stats.hugeCount;
+  stats.largeBytes += stats.hugeBytes;
+  stats.allocated += stats.largeBytes;
+  stats.active += stats.largeBytes;
+  stats.metadata = _miniheapCount.load(std::memory_order_relaxed) * sizeof(MiniHeapT);
+
+  lock_guard<InstrumentedMutex> lock(_arenaLock);
+  // meshed spans share their physical pages with another span
+  stats.mapped = (Super::endOffset() - Super::cleanPageCount() - Super::meshedPageCount()) * PageSize;
+  stats.mapped += stats.hugeBytes;
+  stats.dirty = Super::dirtyPageCount() * PageSize;
+  stats.freeSpanCount = Super::freeSpanCount();
+  stats.arenaMappedMax = Super::mappedPageHighWaterMark() * PageSize;
+  stats.arenaExtent = Super::endOffset() * PageSize;
+}
+
+template <size_t PageSize>
+size_t GlobalHeap<PageSize>::trim(std::chrono::milliseconds budget) {
+  const auto deadline = time::now() + budget;
+
+  size_t before = 0;
+  {
+    AllLocksGuard allLocks(_miniheapLocks, _largeAllocLock, _arenaLock);
+    before = this->scavengeStats().pageCount + Super::meshedPageCount();
+
+    // meshing starts by freeing empty miniheaps, so only do that by
+    // hand when there is no meshing to do
+    if (kMeshingEnabled) {
+      // an explicit trim should mesh even if the last attempt found
+      // little to do
+      _lastMeshEffective.store(1, std::memory_order_release);
+      meshAllSizeClassesLocked(deadline, false);
+    } else {
+      for (size_t sizeClass = 0; sizeClass < kNumBins; sizeClass++) {
+        drainPendingPartialLocked(sizeClass);
+        flushBinLocked(sizeClass);
+      }
+    }
+  }
+
+  // return dirty pages oldest first, a batch at a time, while budget
+  // remains.  The first batch always goes, so a trim makes progress
+  // even if meshing used up the budget.
+  for (;;) {
+    lock_guard<InstrumentedMutex> lock(_arenaLock);
+    Super::releaseOldest(kTrimReleaseBatch);
+    if (Super::dirtyPageCount() == 0 || time::now() >= deadline) {
+      break;
+    }
+  }
+
+  // meshing releases the physical pages behind each newly meshed span;
+  // freeing an old meshed span can lower the count, hence the clamp
+  lock_guard<InstrumentedMutex> lock(_arenaLock);
+  const size_t after = this->scavengeStats().pageCount + Super::meshedPageCount();
+  return after > before ? (after - before) * PageSize : 0;
+}
+
+template <size_t PageSize>
+bool GlobalHeap<PageSize>::openStatsSegment() {
+#ifdef USE_MEMFD
+  static_assert(kNumBins <= kStatsSegmentMaxBins, "stats segment can't hold every size class");
+
+  if (_statsSegment != nullptr) {
+    return true;
+  }
+
+  // an exec'd program has a heap (and segment) of its own
+  int fd = sys_memfd_create(kStatsSegmentName, MFD_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  const size_t size = RoundUpToPage(sizeof(StatsSegment));
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return false;
+  }
+
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  // the fd stays open so monitors can find the segment under
+  // /proc/<pid>/fd
+  auto segment = new (ptr) StatsSegment();
+  memcpy(segment->magic, kStatsSegmentMagic, sizeof(segment->magic));
+  segment->version = kStatsSegmentVersion;
+  segment->pageSize = PageSize;
+  segment->pid = getpid();
+  segment->binCount = kNumBins;
+  _statsSegment = segment;
+
+  publishStats();
+  return true;
+#else
+  return false;
+#endif
+}
+
+template <size_t PageSize>
+void GlobalHeap<PageSize>::publishStats() {
+  StatsSegment *segment = _statsSegment;
+  if (segment == nullptr) {
+    return;
+  }
+
+  // gather everything before entering the write section, so readers
+  // retry for as short a time as possible
+  HeapStats stats;
+  collectStats(stats);
+
+  size_t meshedPages;
+  size_t meshedPagesHWM;
+  typename Super::ScavengeStats scavengeStats;
+  {
+    lock_guard<InstrumentedMutex> lock(_arenaLock);
+    meshedPages = Super::meshedPageCount();
+    meshedPagesHWM = Super::meshedPageHighWaterMark();
+    scavengeStats = this->scavengeStats();
+  }
+
+  const int rssKb = get_rss_kb();
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  const uint64_t seq = segment->seq.load(std::memory_order_relaxed);
+  segment->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  segment->pid = getpid();
+  segment->updateCount++;
+  segment->timestampNs = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+
+  segment->rss = rssKb > 0 ? static_cast<uint64_t>(rssKb) * 1024 : 0;
+  segment->mapped = stats.mapped;
+  segment->dirty = stats.dirty;
+  segment->allocated = stats.allocated;
+  segment->active = stats.active;
+  segment->metadata = stats.metadata;
+  segment->largeCount = stats.largeCount;
+  segment->largeBytes = stats.largeBytes;
+
+  segment->meshedPages = meshedPages;
+  segment->meshedPagesHWM = meshedPagesHWM;
+  segment->meshCount = _stats.meshCount;
+  segment->meshPassCount = _stats.meshPassCount;
+  segment->meshPassLastNs = _stats.meshPassLastNs;
+  segment->meshPassTotalNs = _stats.meshPassTotalNs;
+  segment->meshPassMaxNs = _stats.meshPassMaxNs;
+
+  segment->scavengeCount = scavengeStats.count;
+  segment->scavengedPages = scavengeStats.pageCount;
+
+  for (size_t i = 0; i < kNumBins; i++) {
+    const SizeClassStats &sc = stats.sizeClasses[i];
+    StatsSegmentSizeClass &out = segment->sizeClasses[i];
+    out.objectSize = sc.objectSize;
+    out.spanSize = sc.spanSize;
+    out.inUseObjects = sc.inUseObjects;
+    out.inUseBytes = sc.inUseBytes;
+    out.spans = sc.spans;
+    out.emptySpans = sc.emptySpans;
+    out.partialSpans = sc.partialSpans;
+    out.fullSpans = sc.fullSpans;
+    out.attachedSpans = sc.attachedSpans;
+    out.meshedSpans = sc.meshedSpans;
+    out.meshCount = sc.meshCount;
+  }
+
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->seq.store(seq + 2, std::memory_order_release);
+}
+
+template <size_t PageSize>
+bool GlobalHeap<PageSize>::statsMallctl(const char *name, void *oldp, size_t *oldlenp, int &result) {
+  // jemalloc's MALLCTL_ARENAS_ALL; we only have one arena
+  constexpr unsigned kArenasAll = 4096;
+
+  unsigned arena = 0;
+  unsigned bin = 0;
+  char field[32] = {};
+  int len = 0;
+
+  if (strcmp(name, "arenas.narenas") == 0) {
+    result = mallctlRead<unsigned>(oldp, oldlenp, 1);
+    return true;
+  } else if (strcmp(name, "arenas.nbins") == 0) {
+    result = mallctlRead<unsigned>(oldp, oldlenp, kNumBins);
+    return true;
+  } else if (sscanf(name, "arenas.bin.%u.%31[a-z_]%n", &bin, field, &len) == 2 && name[len] == '\0') {
+    if (bin >= kNumBins) {
+      result = -1;
+      return true;
+    }
+    const size_t objectSize = SizeMap::ByteSizeForClass(bin);
+    const size_t objectCount = objectCountFor(objectSize);
+    if (strcmp(field, "size") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, objectSize);
+    } else if (strcmp(field, "nregs") == 0) {
+      result = mallctlRead<uint32_t>(oldp, oldlenp, objectCount);
+    } else if (strcmp(field, "slab_size") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, PageCount(objectSize * objectCount) * PageSize);
+    } else {
+      result = -1;
+    }
+    return true;
+  }
+
+  // everything else is read from the snapshot
+  if (strcmp(name, "stats.allocated") != 0 && strcmp(name, "stats.active") != 0 &&
+      strcmp(name, "stats.metadata") != 0 && strcmp(name, "stats.mapped") != 0 &&
+      strncmp(name, "stats.arenas.", strlen("stats.arenas.")) != 0) {
+    return false;
+  }
+
+  lock_guard<mutex> lock(_statsLock);
+  if (_statsEpoch == 0) {
+    collectStats(_statsSnapshot);
+    _statsEpoch++;
+  }
+  const HeapStats &stats = _statsSnapshot;
+
+  if (strcmp(name, "stats.allocated") == 0) {
+    result = mallctlRead<size_t>(oldp, oldlenp, stats.allocated);
+  } else if (strcmp(name, "stats.active") == 0) {
+    result = mallctlRead<size_t>(oldp, oldlenp, stats.active);
+  } else if (strcmp(name, "stats.metadata") == 0) {
+    result = mallctlRead<size_t>(oldp, oldlenp, stats.metadata);
+  } else if (strcmp(name, "stats.mapped") == 0) {
+    result = mallctlRead<size_t>(oldp, oldlenp, stats.mapped);
+  } else if (sscanf(name, "stats.arenas.%u.large.%31[a-z_]%n", &arena, field, &len) == 2 && name[len] == '\0') {
+    if (arena != 0 && arena != kArenasAll) {
+      result = -1;
+    } else if (strcmp(field, "allocated") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, stats.largeBytes);
+    } else if (strcmp(field, "curlextents") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, stats.largeCount);
+    } else {
+      result = -1;
+    }
+  } else if (sscanf(name, "stats.arenas.%u.small.%31[a-z_]%n", &arena, field, &len) == 2 && name[len] == '\0') {
+    if (arena != 0 && arena != kArenasAll) {
+      result = -1;
+    } else if (strcmp(field, "allocated") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, stats.allocated - stats.largeBytes);
+    } else {
+      result = -1;
+    }
+  } else if (sscanf(name, "stats.arenas.%u.bins.%u.%31[a-z_]%n", &arena, &bin, field, &len) == 3 &&
+             name[len] == '\0') {
+    if ((arena != 0 && arena != kArenasAll) || bin >= kNumBins) {
+      result = -1;
+      return true;
+    }
+
+    const SizeClassStats &sc = stats.sizeClasses[bin];
+    if (strcmp(field, "curregs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.inUseObjects);
+    } else if (strcmp(field, "curslabs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.spans);
+    } else if (strcmp(field, "nonfull_slabs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.emptySpans + sc.partialSpans);
+    } else if (strcmp(field, "nfills") == 0) {
+      result = mallctlRead<uint64_t>(oldp, oldlenp, sc.refillCount);
+    } else if (strcmp(field, "nflushes") == 0) {
+      result = mallctlRead<uint64_t>(oldp, oldlenp, sc.flushCount);
+      // the rest are Mesh-specific
+    } else if (strcmp(field, "empty_slabs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.emptySpans);
+    } else if (strcmp(field, "partial_slabs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.partialSpans);
+    } else if (strcmp(field, "full_slabs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.fullSpans);
+    } else if (strcmp(field, "attached_slabs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.attachedSpans);
+    } else if (strcmp(field, "meshed_slabs") == 0) {
+      result = mallctlRead<size_t>(oldp, oldlenp, sc.meshedSpans);
+    } else if (strcmp(field, "nmeshes") == 0) {
+      result = mallctlRead<uint64_t>(oldp, oldlenp, sc.meshCount);
+    } else {
+      result = -1;
+    }
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+template <size_t PageSize>
+bool GlobalHeap<PageSize>::lockStatsMallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen,
+                                            int &result) {
+  if (strcmp(name, "mesh.lock_stats") == 0) {
+    // like jemalloc's prof.active: reads the old value, and optionally
+    // sets a new one
+    result = oldp ? mallctlRead<bool>(oldp, oldlenp, lockstats::enabled()) : 0;
+    if (result == 0 && newp) {
+      if (newlen != sizeof(bool)) {
+        result = -1;
+      } else {
+        lockstats::Enabled.store(*reinterpret_cast<bool *>(newp), std::memory_order_relaxed);
+      }
+    }
+    return true;
+  }
+
+  constexpr const char *kPrefix = "mesh.locks.";
+  if (strncmp(name, kPrefix, strlen(kPrefix)) != 0) {
+    return false;
+  }
+  const char *lockName = name + strlen(kPrefix);
+
+  result = -1;
+  forEachLock([&](const char *candidate, const InstrumentedMutex &mutex) {
+    const size_t len = strlen(candidate);
+    if (result == 0 || strncmp(lockName, candidate, len) != 0 || lockName[len] != '.') {
+      return;
+    }
+    const char *field = lockName + len + 1;
+    const LockStats stats = mutex.stats();
+    if (strcmp(field, "acquisitions") == 0) {
+      result = mallctlRead<uint64_t>(oldp, oldlenp, stats.acquisitions);
+    } else if (strcmp(field, "contended") == 0) {
+      result = mallctlRead<uint64_t>(oldp, oldlenp, stats.contended);
+    } else if (strcmp(field, "wait_ns") == 0) {
+      result = mallctlRead<uint64_t>(oldp, oldlenp, stats.waitNs);
+    } else if (strcmp(field, "max_hold_ns") == 0) {
+      result = mallctlRead<uint64_t>(oldp, oldlenp, stats.maxHoldNs);
+    }
+  });
+  return true;
 }
 
 template <size_t PageSize>
@@ -500,6 +1117,12 @@ void GlobalHeap<PageSize>::dumpStats(int level, bool beDetailed) const {
   if (level < 1)
     return;
 
+  // collectStats takes the arena lock itself
+  HeapStats stats;
+  if (level > 1) {
+    collectStats(stats);
+  }
+
   AllLocksGuard allLocks(_miniheapLocks, _largeAllocLock, _arenaLock);
 
   const auto meshedPageHWM = this->meshedPageHighWaterMark();
@@ -512,10 +1135,53 @@ void GlobalHeap<PageSize>::dumpStats(int level, bool beDetailed) const {
   debug("MH Alloc Count:     %zu\n", (size_t)_stats.mhAllocCount);
   debug("MH Free  Count:     %zu\n", (size_t)_stats.mhFreeCount);
   debug("MH High Water Mark: %zu\n", (size_t)_stats.mhHighWaterMark);
+  const auto &scavengeStats = this->scavengeStats();
+  debug("Scavenge Count:     %zu\n", scavengeStats.count);
+  debug("Scavenged MB:       %.1f\n", scavengeStats.pageCount * (double)PageSize / 1024.0 / 1024.0);
+  debug("Scavenge ms total:  %.3f\n", scavengeStats.totalNs / 1000000.0);
+  debug("Scavenge ms max:    %.3f\n", scavengeStats.maxNs / 1000000.0);
+  debug("Scavenge syscalls:  %zu\n", scavengeStats.syscalls);
+  debug("Mesh passes:        %zu\n", _stats.meshPassCount);
+  debug("Mesh pass ms total: %.3f\n", _stats.meshPassTotalNs / 1000000.0);
+  debug("Mesh pass ms max:   %.3f\n", _stats.meshPassMaxNs / 1000000.0);
+  debug("Mesh faults:        %zu\n", (size_t)_stats.meshFaultCount.load());
+  debug("Fault ms total:     %.3f\n", _stats.meshFaultWaitNs.load() / 1000000.0);
+  debug("Fault ms max:       %.3f\n", _stats.meshFaultMaxWaitNs.load() / 1000000.0);
   if (level > 1) {
-    // for (size_t i = 0; i < kNumBins; i++) {
-    //   _littleheaps[i].dumpStats(beDetailed);
-    // }
+    debug("Allocated MB:       %.1f\n", stats.allocated / 1024.0 / 1024.0);
+    debug("Active MB:          %.1f\n", stats.active / 1024.0 / 1024.0);
+    debug("Large allocs:       %zu (%.1f MB)\n", stats.largeCount, stats.largeBytes / 1024.0 / 1024.0);
+    debug("Cached large MB:    %.1f\n", stats.cachedBytes / 1024.0 / 1024.0);
+    debug("%6s %10s %7s %7s %7s %7s %8s %7s %9s%s\n", "size", "in use KB", "spans", "empty", "partial", "full",
+          "attached", "meshed", "refills", beDetailed ? "   flushes    meshes" : "");
+    for (const auto &sc : stats.sizeClasses) {
+      if (sc.spans == 0 && sc.refillCount == 0) {
+        continue;
+      }
+      // debug() ends every call with a newline, so print each row at once
+      if (beDetailed) {
+        debug("%6zu %10.1f %7zu %7zu %7zu %7zu %8zu %7zu %9zu %9zu %9zu\n", sc.objectSize, sc.inUseBytes / 1024.0,
+              sc.spans, sc.emptySpans, sc.partialSpans, sc.fullSpans, sc.attachedSpans, sc.meshedSpans,
+              static_cast<size_t>(sc.refillCount), static_cast<size_t>(sc.flushCount),
+              static_cast<size_t>(sc.meshCount));
+      } else {
+        debug("%6zu %10.1f %7zu %7zu %7zu %7zu %8zu %7zu %9zu\n", sc.objectSize, sc.inUseBytes / 1024.0, sc.spans,
+              sc.emptySpans, sc.partialSpans, sc.fullSpans, sc.attachedSpans, sc.meshedSpans,
+              static_cast<size_t>(sc.refillCount));
+      }
+    }
+  }
+
+  if (lockstats::enabled()) {
+    debug("%-9s %12s %12s %12s %12s\n", "lock", "acquired", "contended", "wait ms", "max hold us");
+    forEachLock([](const char *name, const InstrumentedMutex &mutex) {
+      const LockStats stats = mutex.stats();
+      if (stats.acquisitions == 0) {
+        return;
+      }
+      debug("%-9s %12zu %12zu %12.3f %12.3f\n", name, static_cast<size_t>(stats.acquisitions),
+            static_cast<size_t>(stats.contended), stats.waitNs / 1000000.0, stats.maxHoldNs / 1000.0);
+    });
   }
 }
 
@@ -552,8 +1218,6 @@ template <size_t PageSize>
 void ATTRIBUTE_NEVER_INLINE shiftedSplitting(
     MWC &prng, MiniHeapListEntry<PageSize> *miniheaps, SplitArray<PageSize> &left, SplitArray<PageSize> &right,
     const function<bool(std::pair<MiniHeap<PageSize> *, MiniHeap<PageSize> *> &&)> &meshFound) noexcept {
-  constexpr size_t t = 64;
-
   if (miniheaps->empty()) {
     return;
   }
@@ -563,48 +1227,17 @@ void ATTRIBUTE_NEVER_INLINE shiftedSplitting(
 
   halfSplit<PageSize>(prng, miniheaps, left, leftSize, right, rightSize);
 
-  if (leftSize == 0 || rightSize == 0) {
-    return;
-  }
-
   // Bitmap size increased from 32 bytes (256 bits) to 128 bytes (1024 bits)
   // Using PageSize to calculate nBytes
   constexpr size_t nBytes = PageSize / kMinObjectSize / 8;
-  const size_t limit = rightSize < t ? rightSize : t;
-  d_assert(nBytes == left[0]->bitmap().byteCount());
-
-  size_t foundCount = 0;
-  for (size_t j = 0; j < leftSize; j++) {
-    const size_t idxLeft = j;
-    size_t idxRight = j;
-
-    for (size_t i = 0; i < limit; i++, idxRight++) {
-      if (unlikely(idxRight >= rightSize)) {
-        idxRight %= rightSize;
-      }
-      auto h1 = left[idxLeft];
-      auto h2 = right[idxRight];
-
-      if (h1 == nullptr || h2 == nullptr)
-        continue;
+  d_assert(leftSize == 0 || nBytes == left[0]->bitmap().byteCount());
 
-      const auto bitmap1 = h1->bitmap().bits();
-      const auto bitmap2 = h2->bitmap().bits();
-
-      const bool areMeshable = mesh::bitmapsMeshable(bitmap1, bitmap2, nBytes);
-
-      if (unlikely(areMeshable)) {
-        std::pair<MiniHeap<PageSize> *, MiniHeap<PageSize> *> heaps{h1, h2};
-        bool shouldContinue = meshFound(std::move(heaps));
-        left[idxLeft] = nullptr;
-        right[idxRight] = nullptr;
-        foundCount++;
-        if (unlikely(foundCount > kMaxMeshesPerIteration || !shouldContinue)) {
-          return;
-        }
-      }
-    }
-  }
+  shiftedProbe(
+      &left[0], leftSize, &right[0], rightSize, nBytes,
+      [](const MiniHeap<PageSize> *mh) { return mh->bitmap().bits(); },
+      [&](MiniHeap<PageSize> *h1, MiniHeap<PageSize> *h2) {
+        return meshFound(std::pair<MiniHeap<PageSize> *, MiniHeap<PageSize> *>{h1, h2});
+      });
 }
 
 }  // namespace method
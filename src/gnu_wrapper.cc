@@ -53,6 +53,9 @@
 
 #define CUSTOM_PREFIX(x) mesh_##x
 
+#define WEAK_REDEF0(type, fname) \
+  MESH_EXPORT type fname(void)   \
+  __THROW WEAK(mesh_##fname)
 #define WEAK_REDEF1(type, fname, arg1) \
   MESH_EXPORT type fname(arg1)         \
   __THROW WEAK(mesh_##fname)
@@ -76,6 +79,13 @@ WEAK_REDEF2(void *, memalign, size_t, size_t);
 WEAK_REDEF3(int, posix_memalign, void **, size_t, size_t);
 WEAK_REDEF2(void *, aligned_alloc, size_t, size_t);
 WEAK_REDEF1(size_t, malloc_usable_size, void *);
+WEAK_REDEF1(int, malloc_trim, size_t);
+WEAK_REDEF0(void, malloc_stats);
+WEAK_REDEF0(struct mallinfo, mallinfo);
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+WEAK_REDEF0(struct mallinfo2, mallinfo2);
+#endif
+WEAK_REDEF2(int, malloc_info, int, FILE *);
 WEAK_REDEF6(int, posix_spawn, pid_t *, const char *, const posix_spawn_file_actions_t *, const posix_spawnattr_t *,
             char *const[], char *const[]);
 WEAK_REDEF6(int, posix_spawnp, pid_t *, const char *, const posix_spawn_file_actions_t *, const posix_spawnattr_t *,
@@ -0,0 +1,64 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_HEAP_DUMP_H
+#define MESH_HEAP_DUMP_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mesh {
+
+// A heap dump (see GlobalHeap::dumpHeap) is a HeapDumpHeader followed
+// by one HeapDumpRecord per miniheap, in arena order, until the end of
+// the file.  Each record is followed by bitmapWords 64-bit words of
+// its occupancy bitmap, where bit i of word i / 64 is set if object i
+// is in use.  Everything is in host byte order.
+// theory/mesh_dump_to_json.py converts dumps for the theory/ tools.
+
+static constexpr char kHeapDumpMagic[8] = {'M', 'E', 'S', 'H', 'D', 'U', 'M', 'P'};
+static constexpr uint32_t kHeapDumpVersion = 1;
+
+// bytes of records gathered under the arena lock before writing them out
+static constexpr size_t kHeapDumpBufferSize = 16384;
+
+namespace heapdump {
+enum Flags : uint8_t {
+  Attached = 1 << 0,  // owned by a thread-local heap
+  Large = 1 << 1,     // a single large allocation
+  Sampled = 1 << 2,   // holds an object tracked by the heap profiler
+};
+}  // namespace heapdump
+
+struct HeapDumpHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t pageSize;
+  uint64_t arenaBegin;
+  uint32_t pid;
+  uint32_t reserved;
+};
+
+struct HeapDumpRecord {
+  uint64_t objectSize;
+  uint32_t id;  // MiniHeapID, only unique while the miniheap is alive
+  int32_t sizeClass;  // -1 for large allocations
+  uint32_t objectCount;
+  uint32_t inUseCount;
+  uint32_t spanOffset;  // in pages from the start of the arena
+  uint32_t spanLength;  // in pages
+  uint16_t meshCount;   // number of spans meshed into this one, including itself
+  uint8_t flags;
+  uint8_t bitmapWords;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(HeapDumpHeader) == 32, "heap dump header layout changed");
+static_assert(sizeof(HeapDumpRecord) == 40, "heap dump record layout changed");
+
+}  // namespace mesh
+
+#endif  // MESH_HEAP_DUMP_H
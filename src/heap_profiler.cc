@@ -0,0 +1,119 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "fd_writer.h"
+#include "heap_profiler.h"
+
+namespace mesh {
+
+void HeapProfiler::setInterval(size_t interval) {
+  if (interval > 0) {
+    // the first call to backtrace can load libgcc_s and allocate, so
+    // get that out of the way before any thread samples
+    void *stack[1];
+    backtrace(stack, 1);
+  }
+  _interval.store(interval, std::memory_order_relaxed);
+}
+
+void HeapProfiler::recordAllocation(void *ptr, size_t sz) {
+  // skip this function and ThreadLocalHeap::sampledMalloc
+  constexpr int kSkip = 2;
+  void *stack[kMaxStackDepth + kSkip];
+  const int depth = backtrace(stack, kMaxStackDepth + kSkip);
+
+  Sample sample;
+  sample.size = sz;
+  sample.depth = depth > kSkip ? depth - kSkip : 0;
+  memcpy(sample.stack, stack + kSkip, sample.depth * sizeof(void *));
+
+  lock_guard<mutex> lock(_mutex);
+  _samples[ptr] = sample;
+  _sampledCount++;
+  _sampledBytes += sz;
+}
+
+bool HeapProfiler::recordFree(void *ptr) {
+  lock_guard<mutex> lock(_mutex);
+  return _samples.erase(ptr) > 0;
+}
+
+int HeapProfiler::dump(int fd) const {
+  FdWriter out(fd);
+
+  {
+    lock_guard<mutex> lock(_mutex);
+
+    size_t liveBytes = 0;
+    for (auto const &entry : _samples) {
+      liveBytes += entry.second.size;
+    }
+
+    // pprof scales each sample by the sampling interval to estimate
+    // the true number of objects and bytes
+    out.printf("heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", _samples.size(), liveBytes, _sampledCount,
+               _sampledBytes, interval());
+
+    for (auto const &entry : _samples) {
+      const Sample &sample = entry.second;
+      out.printf("1: %zu [1: %zu] @", sample.size, sample.size);
+      for (size_t i = 0; i < sample.depth; i++) {
+        out.printf(" %p", sample.stack[i]);
+      }
+      out.printf("\n");
+    }
+  }
+
+  // lets pprof symbolize addresses in shared libraries
+  out.printf("\nMAPPED_LIBRARIES:\n");
+  int mapsFd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (mapsFd >= 0) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(mapsFd, buf, sizeof(buf))) > 0) {
+      out.write(buf, n);
+    }
+    close(mapsFd);
+  }
+
+  out.flush();
+  return out.failed() ? -1 : 0;
+}
+
+int HeapProfiler::dump(const char *path) const {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    debug("heap profile: couldn't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int result = dump(fd);
+  close(fd);
+  return result;
+}
+
+int HeapProfiler::dumpToDefaultPath() {
+  const char *prefix = getenv("MESH_HEAP_PROFILE_PREFIX");
+  if (prefix == nullptr) {
+    prefix = "mesh";
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.%d.%zu.heap", prefix, getpid(), _dumpSeq++);
+  return dump(path);
+}
+
+}  // namespace mesh
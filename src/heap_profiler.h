@@ -0,0 +1,93 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_HEAP_PROFILER_H
+#define MESH_HEAP_PROFILER_H
+
+#include <atomic>
+#include <cmath>
+#include <mutex>
+
+#include "internal.h"
+
+namespace mesh {
+
+// HeapProfiler tracks a sample of live allocations, along with the
+// stack that allocated them, so that live memory can be attributed to
+// call sites.  As in tcmalloc, each thread samples roughly one
+// allocation per interval bytes allocated (see
+// ThreadLocalHeap::sampledMalloc); the objects sampled are remembered
+// here until they are freed.  dump() writes the live samples in the
+// legacy text heap profile format ("heap_v2") that pprof reads.
+class HeapProfiler {
+private:
+  DISALLOW_COPY_AND_ASSIGN(HeapProfiler);
+
+public:
+  static constexpr size_t kMaxStackDepth = 32;
+  // how often threads check if profiling was turned on while disabled
+  static constexpr size_t kDisabledCheckBytes = 64 * 1024 * 1024;
+
+  HeapProfiler() {
+  }
+
+  // average number of bytes allocated between samples; 0 disables
+  // sampling (but keeps what has been sampled so far).
+  void setInterval(size_t interval);
+
+  inline size_t interval() const {
+    return _interval.load(std::memory_order_relaxed);
+  }
+
+  // bytes to allocate before taking the next sample, drawn from an
+  // exponential distribution so that samples aren't correlated with
+  // allocation patterns.  u must be uniform in (0, 1].
+  inline size_t nextSampleBytes(double u) const {
+    const size_t mean = interval();
+    if (mean == 0) {
+      return kDisabledCheckBytes;
+    }
+    return static_cast<size_t>(-std::log(u) * mean) + 1;
+  }
+
+  // called from the allocating thread, outside of any heap locks
+  void recordAllocation(void *ptr, size_t sz);
+
+  // returns true if ptr was a sampled object (which is no longer tracked)
+  bool recordFree(void *ptr);
+
+  // write a heap profile to fd.  Returns 0 on success.
+  int dump(int fd) const;
+  int dump(const char *path) const;
+
+  // dump to "<prefix>.<pid>.<seq>.heap", where prefix comes from
+  // MESH_HEAP_PROFILE_PREFIX (default "mesh").  Used on SIGHEAPPROF.
+  int dumpToDefaultPath();
+
+  inline size_t liveSampleCount() const {
+    lock_guard<mutex> lock(_mutex);
+    return _samples.size();
+  }
+
+private:
+  struct Sample {
+    size_t size;
+    size_t depth;
+    void *stack[kMaxStackDepth];
+  };
+
+  std::atomic<size_t> _interval{0};
+  std::atomic<size_t> _dumpSeq{0};
+
+  mutable mutex _mutex{};
+  internal::unordered_map<void *, Sample> _samples{};
+  size_t _sampledCount{0};  // total samples taken
+  size_t _sampledBytes{0};
+};
+
+}  // namespace mesh
+
+#endif  // MESH_HEAP_PROFILER_H
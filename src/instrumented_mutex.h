@@ -0,0 +1,133 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_INSTRUMENTED_MUTEX_H
+#define MESH_INSTRUMENTED_MUTEX_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include "common.h"
+
+namespace mesh {
+
+namespace lockstats {
+// set by MESH_LOCK_STATS=1 or the mesh.lock_stats mallctl
+inline std::atomic<bool> Enabled{false};
+
+inline bool enabled() {
+  return Enabled.load(std::memory_order_relaxed);
+}
+}  // namespace lockstats
+
+struct LockStats {
+  uint64_t acquisitions;
+  uint64_t contended;  // acquisitions that had to wait
+  uint64_t waitNs;     // total time spent waiting
+  uint64_t maxHoldNs;  // longest time the lock was held
+};
+
+// a std::mutex that, while lock stats are enabled, counts how often it
+// is taken and how long threads wait for and hold it.  When they are
+// disabled, lock() costs one extra relaxed load and unlock() one extra
+// compare.  Counters are only written by the lock holder, so they
+// don't need atomic read-modify-writes.
+class InstrumentedMutex {
+private:
+  DISALLOW_COPY_AND_ASSIGN(InstrumentedMutex);
+
+public:
+  InstrumentedMutex() = default;
+
+  inline void lock() {
+    if (likely(!lockstats::enabled())) {
+      _mutex.lock();
+      return;
+    }
+    lockInstrumented();
+  }
+
+  inline bool try_lock() {
+    if (!_mutex.try_lock()) {
+      return false;
+    }
+    if (unlikely(lockstats::enabled())) {
+      acquired(nowNs(), false, 0);
+    }
+    return true;
+  }
+
+  inline void unlock() {
+    if (unlikely(_acquiredNs != 0)) {
+      released();
+    }
+    _mutex.unlock();
+  }
+
+  LockStats stats() const {
+    return LockStats{
+        _acquisitions.load(std::memory_order_relaxed),
+        _contended.load(std::memory_order_relaxed),
+        _waitNs.load(std::memory_order_relaxed),
+        _maxHoldNs.load(std::memory_order_relaxed),
+    };
+  }
+
+private:
+  static inline uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  template <typename T>
+  static inline void bump(std::atomic<T> &counter, T delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  ATTRIBUTE_NEVER_INLINE void lockInstrumented() {
+    if (_mutex.try_lock()) {
+      acquired(nowNs(), false, 0);
+      return;
+    }
+
+    const uint64_t start = nowNs();
+    _mutex.lock();
+    const uint64_t now = nowNs();
+    acquired(now, true, now - start);
+  }
+
+  inline void acquired(uint64_t now, bool contended, uint64_t waitNs) {
+    // a zero timestamp means "not instrumented" to unlock()
+    _acquiredNs = now != 0 ? now : 1;
+    bump<uint64_t>(_acquisitions, 1);
+    if (contended) {
+      bump<uint64_t>(_contended, 1);
+      bump<uint64_t>(_waitNs, waitNs);
+    }
+  }
+
+  ATTRIBUTE_NEVER_INLINE void released() {
+    const uint64_t held = nowNs() - _acquiredNs;
+    if (held > _maxHoldNs.load(std::memory_order_relaxed)) {
+      _maxHoldNs.store(held, std::memory_order_relaxed);
+    }
+    _acquiredNs = 0;
+  }
+
+  std::mutex _mutex{};
+  uint64_t _acquiredNs{0};  // when the current holder took the lock
+  std::atomic<uint64_t> _acquisitions{0};
+  std::atomic<uint64_t> _contended{0};
+  std::atomic<uint64_t> _waitNs{0};
+  std::atomic<uint64_t> _maxHoldNs{0};
+};
+
+}  // namespace mesh
+
+#endif  // MESH_INSTRUMENTED_MUTEX_H
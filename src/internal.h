@@ -13,12 +13,14 @@
 #endif
 
 #include <atomic>
+#include <set>
 #include <unordered_set>
 
 #include <signal.h>
 #include <stdint.h>
 
 #include "common.h"
+#include "instrumented_mutex.h"
 #include "rng/mwc.h"
 
 // never allocate executable heap
@@ -285,13 +287,35 @@ inline void *MaskToPage(const void *ptr) {
   return reinterpret_cast<void *>(ptrval & (uintptr_t)~(CPUInfo::PageSize - 1));
 }
 
-// efficiently copy data from srcFd to dstFd
-int copyFile(int dstFd, int srcFd, off_t off, size_t sz);
+// efficiently copy sz bytes at offset off in srcFd to the same offset
+// in dstFd.  Returns sz on success, -1 on error.
+ssize_t copyFile(int dstFd, int srcFd, off_t off, size_t sz);
+
+// write all len bytes of buf to fd, retrying short writes.  Returns
+// false on error.
+bool writeAll(int fd, const void *buf, size_t len);
+
+// there is exactly one internal heap, so its lock lives out here
+// where lock stats can find it
+inline InstrumentedMutex &heapMutex() {
+  static InstrumentedMutex mutex;
+  return mutex;
+}
+
+class HeapLock {
+public:
+  inline void lock() {
+    heapMutex().lock();
+  }
+  inline void unlock() {
+    heapMutex().unlock();
+  }
+};
 
 // for mesh-internal data structures, like heap metadata
-class Heap : public ExactlyOneHeap<LockedHeap<PosixLockType, PartitionedHeap>> {
+class Heap : public ExactlyOneHeap<LockedHeap<HeapLock, PartitionedHeap>> {
 private:
-  typedef ExactlyOneHeap<LockedHeap<PosixLockType, PartitionedHeap>> SuperHeap;
+  typedef ExactlyOneHeap<LockedHeap<HeapLock, PartitionedHeap>> SuperHeap;
 
 public:
   Heap() : SuperHeap() {
@@ -320,6 +344,9 @@ using unordered_set = std::unordered_set<K, hash<K>, equal_to<K>, STLAllocator<K
 template <typename K, typename V>
 using map = std::map<K, V, std::less<K>, STLAllocator<pair<const K, V>, Heap>>;
 
+template <typename K>
+using set = std::set<K, std::less<K>, STLAllocator<K, Heap>>;
+
 typedef std::basic_string<char, std::char_traits<char>, STLAllocator<char, Heap>> string;
 
 template <typename T>
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #endif
 
+#include "alloc_recorder.h"
 #include "runtime.h"
 #include "thread_local_heap.h"
 #include "runtime_impl.h"
@@ -18,6 +19,10 @@
 
 using namespace mesh;
 
+// when set, posix_spawn quiesces the whole heap for the duration of the
+// spawn (see mesh_posix_spawn)
+static bool spawnLocksHeap = false;
+
 static __attribute__((constructor)) void libmesh_init() {
   mesh::real::init();
 
@@ -50,17 +55,99 @@ static __attribute__((constructor)) void libmesh_init() {
     dispatchByPageSize([period](auto &rt) { rt.setMeshPeriodMs(std::chrono::milliseconds{period}); });
   }
 
+  char *dirtyDecayStr = getenv("MESH_DIRTY_DECAY_MS");
+  if (dirtyDecayStr) {
+    long window = strtol(dirtyDecayStr, nullptr, 10);
+    if (window < 0) {
+      window = 0;
+    }
+    dispatchByPageSize([window](auto &rt) { rt.setDirtyDecayMs(std::chrono::milliseconds{window}); });
+  }
+
+  // allocations of at least MESH_HUGE_THRESHOLD bytes (0 for none) are
+  // mapped directly rather than taken from the arena; MESH_HUGE_PAGES=1
+  // asks for transparent huge pages for them
+  char *hugeThresholdStr = getenv("MESH_HUGE_THRESHOLD");
+  if (hugeThresholdStr) {
+    long long threshold = strtoll(hugeThresholdStr, nullptr, 10);
+    if (threshold < 0) {
+      threshold = 0;
+    }
+    dispatchByPageSize([threshold](auto &rt) { rt.heap().setHugeThreshold(threshold); });
+  }
+
+  char *hugePagesStr = getenv("MESH_HUGE_PAGES");
+  if (hugePagesStr && atoi(hugePagesStr)) {
+    dispatchByPageSize([](auto &rt) { rt.heap().setHugePages(true); });
+  }
+
+  char *lazyReleaseStr = getenv("MESH_LAZY_RELEASE");
+  if (lazyReleaseStr && atoi(lazyReleaseStr)) {
+    dispatchByPageSize([](auto &rt) { rt.setLazyRelease(true); });
+  }
+
+  // sample roughly every N bytes allocated for heap profiles; dump
+  // them with the prof.dump mallctl, or SIGRTMIN+9 when the background
+  // thread is running.
+  char *profileIntervalStr = getenv("MESH_HEAP_PROFILE_INTERVAL");
+  if (profileIntervalStr) {
+    long interval = strtol(profileIntervalStr, nullptr, 10);
+    if (interval < 0) {
+      interval = 0;
+    }
+    dispatchByPageSize([interval](auto &rt) { rt.setHeapProfileInterval(interval); });
+  }
+
+  // count acquisitions, contention, wait and hold times for each heap
+  // lock; see the mesh.locks.* mallctls
+  char *lockStatsStr = getenv("MESH_LOCK_STATS");
+  if (lockStatsStr && atoi(lockStatsStr)) {
+    lockstats::Enabled.store(true, std::memory_order_relaxed);
+  }
+
+  // record allocator events in per-thread rings; dump them with the
+  // trace.dump mallctl, or SIGRTMIN+10 when the background thread is
+  // running.
+  char *traceStr = getenv("MESH_TRACE");
+  if (traceStr && atoi(traceStr)) {
+    trace::Enabled.store(true, std::memory_order_relaxed);
+  }
+
+  // log every allocator call to <MESH_RECORD_PREFIX>.<pid>.meshrec
+  // (default prefix "mesh") for the replay benchmark.  Calls are
+  // serialized while recording.
+  char *recordStr = getenv("MESH_RECORD");
+  if (recordStr && atoi(recordStr)) {
+    const char *prefix = getenv("MESH_RECORD_PREFIX");
+    recorder::startWithPrefix(prefix != nullptr ? prefix : "mesh");
+  }
+
+  char *spawnLockStr = getenv("MESH_SPAWN_LOCK");
+  if (spawnLockStr && atoi(spawnLockStr)) {
+    spawnLocksHeap = true;
+  }
+
+  // publish stats for meshtop in a memfd; the background thread keeps
+  // it up to date, so this starts one if needed.
+  bool shouldThread = false;
+  char *statsSegmentStr = getenv("MESH_STATS_SEGMENT");
+  if (statsSegmentStr && atoi(statsSegmentStr)) {
+    dispatchByPageSize([&shouldThread](auto &rt) { shouldThread = rt.heap().openStatsSegment(); });
+  }
+
   char *bgThread = getenv("MESH_BACKGROUND_THREAD");
-  if (!bgThread)
-    return;
+  if (bgThread && atoi(bgThread)) {
+    shouldThread = true;
+  }
 
-  int shouldThread = atoi(bgThread);
   if (shouldThread) {
     dispatchByPageSize([](auto &rt) { rt.startBgThread(); });
   }
 }
 
 static __attribute__((destructor)) void libmesh_fini() {
+  recorder::stop();
+
   char *mstats = getenv("MALLOCSTATS");
   if (!mstats)
     return;
@@ -76,20 +163,48 @@ static __attribute__((destructor)) void libmesh_fini() {
 
 namespace mesh {
 
+// while a recording is open every call comes through these slow paths
+// (see recorder::recording), which log it under the recorder's lock
+
 template <size_t PageSize>
 ATTRIBUTE_NEVER_INLINE void *allocSlowpath(size_t sz) {
   ThreadLocalHeap<PageSize> *localHeap = ThreadLocalHeap<PageSize>::GetHeap();
+  if (recorder::recording()) {
+    recorder::Guard guard;
+    void *ptr = localHeap->malloc(sz);
+    recorder::recordMalloc(recorder::Malloc, ptr, sz);
+    return ptr;
+  }
   return localHeap->malloc(sz);
 }
 
 template <size_t PageSize>
 ATTRIBUTE_NEVER_INLINE __attribute__((unused)) void *cxxNewSlowpath(size_t sz) {
   ThreadLocalHeap<PageSize> *localHeap = ThreadLocalHeap<PageSize>::GetHeap();
+  if (recorder::recording()) {
+    recorder::Guard guard;
+    void *ptr = localHeap->cxxNew(sz);
+    recorder::recordMalloc(recorder::Malloc, ptr, sz);
+    return ptr;
+  }
   return localHeap->cxxNew(sz);
 }
 
 template <size_t PageSize>
 ATTRIBUTE_NEVER_INLINE void freeSlowpath(void *ptr) {
+  if (recorder::recording()) {
+    recorder::Guard guard;
+    // logged before the free, so no other thread can be handed this
+    // address first
+    recorder::recordFree(ptr);
+    ThreadLocalHeap<PageSize> *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
+    if (localHeap != nullptr) {
+      localHeap->free(ptr);
+    } else {
+      runtime<PageSize>().heap().free(ptr);
+    }
+    return;
+  }
   // instead of instantiating a thread-local heap on free, just free
   // to the global heap directly
   runtime<PageSize>().heap().free(ptr);
@@ -98,12 +213,24 @@ ATTRIBUTE_NEVER_INLINE void freeSlowpath(void *ptr) {
 template <size_t PageSize>
 ATTRIBUTE_NEVER_INLINE void *reallocSlowpath(void *oldPtr, size_t newSize) {
   ThreadLocalHeap<PageSize> *localHeap = ThreadLocalHeap<PageSize>::GetHeap();
+  if (recorder::recording()) {
+    recorder::Guard guard;
+    void *ptr = localHeap->realloc(oldPtr, newSize);
+    recorder::recordRealloc(oldPtr, ptr, newSize);
+    return ptr;
+  }
   return localHeap->realloc(oldPtr, newSize);
 }
 
 template <size_t PageSize>
 ATTRIBUTE_NEVER_INLINE void *callocSlowpath(size_t count, size_t size) {
   ThreadLocalHeap<PageSize> *localHeap = ThreadLocalHeap<PageSize>::GetHeap();
+  if (recorder::recording()) {
+    recorder::Guard guard;
+    void *ptr = localHeap->calloc(count, size);
+    recorder::recordMalloc(recorder::Calloc, ptr, count * size);
+    return ptr;
+  }
   return localHeap->calloc(count, size);
 }
 
@@ -116,6 +243,12 @@ ATTRIBUTE_NEVER_INLINE size_t usableSizeSlowpath(void *ptr) {
 template <size_t PageSize>
 ATTRIBUTE_NEVER_INLINE void *memalignSlowpath(size_t alignment, size_t size) {
   ThreadLocalHeap<PageSize> *localHeap = ThreadLocalHeap<PageSize>::GetHeap();
+  if (recorder::recording()) {
+    recorder::Guard guard;
+    void *ptr = localHeap->memalign(alignment, size);
+    recorder::recordMalloc(recorder::Memalign, ptr, size, alignment);
+    return ptr;
+  }
   return localHeap->memalign(alignment, size);
 }
 }  // namespace mesh
@@ -124,7 +257,7 @@ ATTRIBUTE_NEVER_INLINE void *memalignSlowpath(size_t alignment, size_t size) {
 template <size_t PageSize>
 static void *mesh_malloc_impl(size_t sz) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     return mesh::allocSlowpath<PageSize>(sz);
   }
   return localHeap->malloc(sz);
@@ -133,7 +266,7 @@ static void *mesh_malloc_impl(size_t sz) {
 template <size_t PageSize>
 static void mesh_free_impl(void *ptr) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     mesh::freeSlowpath<PageSize>(ptr);
     return;
   }
@@ -143,7 +276,7 @@ static void mesh_free_impl(void *ptr) {
 template <size_t PageSize>
 static void mesh_sized_free_impl(void *ptr, size_t sz) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     mesh::freeSlowpath<PageSize>(ptr);
     return;
   }
@@ -153,7 +286,7 @@ static void mesh_sized_free_impl(void *ptr, size_t sz) {
 template <size_t PageSize>
 static void *mesh_realloc_impl(void *oldPtr, size_t newSize) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     return mesh::reallocSlowpath<PageSize>(oldPtr, newSize);
   }
   return localHeap->realloc(oldPtr, newSize);
@@ -171,7 +304,7 @@ static size_t mesh_malloc_usable_size_impl(void *ptr) {
 template <size_t PageSize>
 static void *mesh_memalign_impl(size_t alignment, size_t size) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     return mesh::memalignSlowpath<PageSize>(alignment, size);
   }
   return localHeap->memalign(alignment, size);
@@ -180,7 +313,7 @@ static void *mesh_memalign_impl(size_t alignment, size_t size) {
 template <size_t PageSize>
 static void *mesh_calloc_impl(size_t count, size_t size) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     return mesh::callocSlowpath<PageSize>(count, size);
   }
   return localHeap->calloc(count, size);
@@ -467,10 +600,19 @@ public:
 };
 }  // namespace
 
+// posix_spawn never gives the child a copy of our heap: glibc (2.24+)
+// and musl clone the child with CLONE_VM | CLONE_VFORK, FreeBSD uses
+// vfork, and on macOS the kernel creates it.  The child runs no atfork
+// handlers and execs without allocating, so by default we spawn
+// without taking any heap locks and allocating threads keep running.
+// MESH_SPAWN_LOCK=1 restores the old behaviour of holding every heap
+// lock across the call.
 extern "C" {
 int MESH_EXPORT mesh_posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
                                  const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]) {
-  if (likely(getPageSize() == kPageSize4K)) {
+  if (likely(!spawnLocksHeap)) {
+    return mesh::real::posix_spawn(pid, path, file_actions, attrp, argv, envp);
+  } else if (likely(getPageSize() == kPageSize4K)) {
     SpawnLockGuard<kPageSize4K> guard;
     return mesh::real::posix_spawn(pid, path, file_actions, attrp, argv, envp);
   } else {
@@ -481,7 +623,9 @@ int MESH_EXPORT mesh_posix_spawn(pid_t *pid, const char *path, const posix_spawn
 
 int MESH_EXPORT mesh_posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
                                   const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]) {
-  if (likely(getPageSize() == kPageSize4K)) {
+  if (likely(!spawnLocksHeap)) {
+    return mesh::real::posix_spawnp(pid, file, file_actions, attrp, argv, envp);
+  } else if (likely(getPageSize() == kPageSize4K)) {
     SpawnLockGuard<kPageSize4K> guard;
     return mesh::real::posix_spawnp(pid, file, file_actions, attrp, argv, envp);
   } else {
@@ -3,13 +3,66 @@
 // Use of this source code is governed by the Apache License,
 // Version 2.0, that can be found in the LICENSE file.
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
 #include "meshable_arena.h"
+#include "alloc_recorder.h"
 #include "runtime.h"
 
 namespace mesh {
 
+#ifdef __linux__
+namespace {
+// threads that help copy the arena after fork are started with a raw
+// clone(2) rather than pthread_create, which would calloc the new
+// thread's TLS out of our own heap while the arena is still shared
+// with the parent.  They share our address space and TLS pointer, so
+// they must stick to system calls: no allocation, no locks.
+constexpr size_t kForkCopyStackSize = 256 * 1024;
+
+struct ForkCopyWorker {
+  void *stack;
+  pid_t tid;  // cleared by the kernel when the worker exits
+};
+
+bool startForkCopyWorker(ForkCopyWorker &worker, int (*fn)(void *), void *arg) {
+  void *stack =
+      mmap(nullptr, kForkCopyStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) {
+    return false;
+  }
+
+  const int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM |
+                    CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+  worker.stack = stack;
+  worker.tid = 0;
+  if (clone(fn, reinterpret_cast<char *>(stack) + kForkCopyStackSize, flags, arg, &worker.tid, nullptr,
+            &worker.tid) == -1) {
+    munmap(stack, kForkCopyStackSize);
+    return false;
+  }
+
+  return true;
+}
+
+void joinForkCopyWorker(ForkCopyWorker &worker) {
+  for (pid_t tid = __atomic_load_n(&worker.tid, __ATOMIC_ACQUIRE); tid != 0;
+       tid = __atomic_load_n(&worker.tid, __ATOMIC_ACQUIRE)) {
+    syscall(SYS_futex, &worker.tid, FUTEX_WAIT, tid, nullptr, nullptr, 0);
+  }
+  munmap(worker.stack, kForkCopyStackSize);
+}
+}  // namespace
+#endif
+
 template <size_t PageSize>
 void MeshableArena<PageSize>::prepareForFork() {
+  MESH_TRACE(ForkPrepare, fork_prepare, getpid(), 0);
+
   if (!kMeshingEnabled) {
     return;
   }
@@ -26,6 +79,8 @@ void MeshableArena<PageSize>::prepareForFork() {
 
 template <size_t PageSize>
 void MeshableArena<PageSize>::afterForkParent() {
+  MESH_TRACE(ForkParent, fork_parent, getpid(), 0);
+
   if (!kMeshingEnabled) {
     return;
   }
@@ -59,6 +114,16 @@ template <size_t PageSize>
 void MeshableArena<PageSize>::afterForkChild() {
   runtime<PageSize>().updatePid();
 
+  trace::afterForkChild();
+  MESH_TRACE(ForkChild, fork_child, getpid(), 0);
+  recorder::afterForkChild();
+
+  // the pidfd used for batched page release refers to our parent
+  if (_pidFd != -1) {
+    close(_pidFd);
+    _pidFd = -1;
+  }
+
   if (!kMeshingEnabled) {
     return;
   }
@@ -74,38 +139,95 @@ void MeshableArena<PageSize>::afterForkChild() {
   int r = mprotect(_arenaBegin, kArenaSize, PROT_READ | PROT_WRITE);
   hard_assert(r == 0);
 
+  // the internal heap is private to each process, but the arena is
+  // still backed by our parent's files: the heap stays locked until it
+  // has been copied and remapped below, and nothing in between may
+  // allocate from it.
   internal::Heap().unlock();
-  runtime<PageSize>().unlock();
-  runtime<PageSize>().heap().unlock();
 
   close(_forkPipe[0]);
 
   char *oldSpanDir = _spanDir;
+  // the child's shard files get their own span directory
+  _spanDir = nullptr;
 
-  int newFd = openSpanFile(kArenaSize);
+  int newFds[kArenaShardCount];
+  for (size_t i = 0; i < kArenaShardCount; i++) {
+    newFds[i] = openSpanFile(kArenaShardSize);
 
-  struct stat fileinfo;
-  memset(&fileinfo, 0, sizeof(fileinfo));
-  fstat(newFd, &fileinfo);
-  d_assert(fileinfo.st_size >= 0 && (size_t)fileinfo.st_size == kArenaSize);
+    struct stat fileinfo;
+    memset(&fileinfo, 0, sizeof(fileinfo));
+    fstat(newFds[i], &fileinfo);
+    d_assert(fileinfo.st_size >= 0 && (size_t)fileinfo.st_size == kArenaShardSize);
+  }
 
-  const int oldFd = _fd;
+  // copy each run of contiguous live pages with a single call.  Pages
+  // in meshed spans are skipped: their backing pages were released when
+  // they were meshed, and they're remapped onto their keep span below.
+  auto bitmap = allocatedBitmap();
+  for (auto const &i : _meshedBitmap) {
+    bitmap.unset(i);
+  }
 
-  const auto bitmap = allocatedBitmap();
-  for (auto const &i : bitmap) {
-    int result = internal::copyFile(newFd, oldFd, i << kPageShift, PageSize);
-    d_assert(result == CPUInfo::PageSize);
+  // large runs are split up so the copy spreads evenly across threads
+  internal::vector<std::pair<size_t, size_t>> ranges{};
+  size_t copySize = 0;
+  forEachRun(bitmap, [&](size_t first, size_t pageCount) {
+    size_t off = first << kPageShift;
+    size_t sz = pageCount << kPageShift;
+    copySize += sz;
+    while (sz > 0) {
+      const size_t len = std::min(sz, kForkCopyChunkSize);
+      ranges.emplace_back(off, len);
+      off += len;
+      sz -= len;
+    }
+  });
+
+  ForkCopy copy{_fd, newFds, ranges.data(), ranges.size()};
+
+  size_t maxCopyThreads = 1;
+  if (copySize >= kForkCopyParallelThreshold) {
+    const long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    maxCopyThreads = std::min(kForkCopyThreads, static_cast<size_t>(std::max(cpuCount, 1L)));
+  }
+
+#ifdef __linux__
+  // workers have no signal handling of their own, so they start with
+  // every signal blocked
+  ForkCopyWorker workers[kForkCopyThreads];
+  size_t workerCount = 0;
+  if (maxCopyThreads > 1) {
+    if (unlikely(mesh::real::sigprocmask == nullptr)) {
+      mesh::real::init();
+    }
+    sigset_t allSignals;
+    sigset_t oldMask;
+    sigfillset(&allSignals);
+    mesh::real::sigprocmask(SIG_SETMASK, &allSignals, &oldMask);
+    while (workerCount < maxCopyThreads - 1 && startForkCopyWorker(workers[workerCount], forkCopyThread, &copy)) {
+      workerCount++;
+    }
+    mesh::real::sigprocmask(SIG_SETMASK, &oldMask, nullptr);
+  }
+
+  forkCopyThread(&copy);
+
+  for (size_t i = 0; i < workerCount; i++) {
+    joinForkCopyWorker(workers[i]);
   }
+#else
+  forkCopyThread(&copy);
+#endif
 
-  // Sync the new file to ensure all copied data is persisted before remapping
-  fsync(newFd);
+  // Sync the new files to ensure all copied data is persisted before remapping
+  for (size_t i = 0; i < kArenaShardCount; i++) {
+    fsync(newFds[i]);
+  }
 
-  // Remap the arena to the new file descriptor.
-  // On some kernel versions/configurations, mmap with MAP_FIXED may fail with
-  // EACCES or EBADF when replacing a MAP_SHARED mapping. If that happens,
-  // retry after explicitly unmapping the old arena.
-  void *ptr = mmap(_arenaBegin, kArenaSize, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, newFd, 0);
-  hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+  // Remap the arena to the new file descriptors.
+  const bool ok = mapArena(newFds);
+  hard_assert_msg(ok, "map failed: %d", errno);
 
   {
     internal::unordered_set<void *> seenMiniheaps{};
@@ -139,20 +261,24 @@ void MeshableArena<PageSize>::afterForkChild() {
         }
 #endif
 
-        void *remapPtr =
-            mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, newFd, keepOff << kPageShift);
-        hard_assert_msg(remapPtr != MAP_FAILED, "mesh remap failed: %d", errno);
+        const bool remapped = mapShared(newFds, remove, keepOff << kPageShift, sz);
+        hard_assert_msg(remapped, "mesh remap failed: %d", errno);
 
         return false;
       });
     }
   }
 
-  _fd = newFd;
+  for (size_t i = 0; i < kArenaShardCount; i++) {
+    close(_fd[i]);
+    _fd[i] = newFds[i];
+  }
 
   internal::Heap().free(oldSpanDir);
 
-  close(oldFd);
+  // the arena is our own now
+  runtime<PageSize>().unlock();
+  runtime<PageSize>().heap().unlock();
 
   while (write(_forkPipe[1], "ok", strlen("ok")) == EAGAIN) {
   }
@@ -162,6 +288,22 @@ void MeshableArena<PageSize>::afterForkChild() {
   _forkPipe[1] = -1;
 }
 
+template <size_t PageSize>
+int MeshableArena<PageSize>::forkCopyThread(void *arg) {
+  ForkCopy *copy = reinterpret_cast<ForkCopy *>(arg);
+
+  for (size_t i = copy->next++; i < copy->rangeCount; i = copy->next++) {
+    size_t off = copy->ranges[i].first;
+    forEachShardRange(off, copy->ranges[i].second, [&](size_t shard, off_t fileOff, size_t len) {
+      ssize_t result = internal::copyFile(copy->dstFds[shard], copy->srcFds[shard], fileOff, len);
+      d_assert_msg(result == static_cast<ssize_t>(len), "copyFile(%zu, %zu): errno %d", off, len, errno);
+      off += len;
+    });
+  }
+
+  return 0;
+}
+
 template class MeshableArena<kPageSize4K>;
 template class MeshableArena<kPageSize16K>;
 }  // namespace mesh
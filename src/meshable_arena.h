@@ -17,6 +17,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
@@ -32,8 +33,6 @@
 #include <mach/mach.h>
 #include <mach/mach_vm.h>
 #include <mach/vm_map.h>
-#elif defined(__linux__)
-#include <sys/sendfile.h>
 #endif
 
 #if defined(__FreeBSD__)
@@ -44,6 +43,7 @@
 #include <sys/ioctl.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
 #include <new>
@@ -54,10 +54,14 @@
 
 #include "bitmap.h"
 
+#include "free_span_set.h"
+
 #include "mmap_heap.h"
 
 #include "mini_heap.h"
 
+#include "trace.h"
+
 #ifndef MADV_DONTDUMP
 #define MADV_DONTDUMP 0
 #endif
@@ -95,19 +99,6 @@ inline char *uintToStr(char *dst, uint32_t i) {
   return strcat(dst, digit);
 }
 
-template <typename Func>
-inline void forEachFree(const internal::vector<Span> freeSpans[kSpanClassCount], const Func func) {
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    if (freeSpans[i].empty())
-      continue;
-
-    for (size_t j = 0; j < freeSpans[i].size(); j++) {
-      auto span = freeSpans[i][j];
-      func(span);
-    }
-  }
-}
-
 #ifdef USE_MEMFD
 inline int sys_memfd_create(const char *name, unsigned int flags) {
   return syscall(__NR_memfd_create, name, flags);
@@ -200,6 +191,21 @@ public:
   void scavenge(bool force);
   // like a scavenge, but we only MADV_FREE
   void partialScavenge();
+  // advance the decay curve to now (a decayStamp()) and return the
+  // oldest dirty spans to the OS until no more pages are dirty than
+  // the curve allows.  Returns the number of pages released.
+  size_t decayDirty(uint64_t now, uint64_t windowMs);
+  // return at least pageCount of the oldest dirty pages to the OS, or
+  // all of them if there are fewer.  Returns the number released.
+  size_t releaseOldest(size_t pageCount);
+  // give spans that were meshed and have since been freed their
+  // identity mappings back, without releasing any dirty pages
+  void resetFreedMeshes();
+
+  // the time, in ms, that dirty spans are stamped with when freed
+  static inline uint64_t decayStamp() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(time::now().time_since_epoch()).count();
+  }
 
   // return the maximum number of pages we've had meshed (and thus our
   // savings) at any point in time.
@@ -207,10 +213,41 @@ public:
     return _meshedPageCountHWM;
   }
 
+  // pages whose physical memory is shared with another span
+  inline size_t meshedPageCount() const {
+    return _meshedPageCount;
+  }
+
+  // the most pages of the arena that have held memory (been neither
+  // clean nor meshed) at once
+  inline size_t mappedPageHighWaterMark() const {
+    return _mappedPageCountHWM;
+  }
+
   inline size_t RSSAtHighWaterMark() const {
     return _rssKbAtHWM;
   }
 
+  // cumulative cost of scavenge() and partialScavenge()
+  struct ScavengeStats {
+    size_t count{0};
+    size_t pageCount{0};  // dirty pages returned to the OS
+    uint64_t totalNs{0};
+    uint64_t maxNs{0};
+    size_t syscalls{0};  // madvise, fallocate, etc. issued to release pages
+  };
+
+  inline const ScavengeStats &scavengeStats() const {
+    return _scavengeStats;
+  }
+
+  // release dirty pages with MADV_FREE, letting the kernel reclaim them
+  // lazily.  The kernel only accepts MADV_FREE on private anonymous
+  // memory, so this is ignored when the arena is memfd-backed.
+  inline void setLazyRelease(bool lazy) {
+    _lazyRelease = lazy && !kMeshingEnabled;
+  }
+
   char *arenaBegin() const {
     return reinterpret_cast<char *>(_arenaBegin);
   }
@@ -218,15 +255,30 @@ public:
     return reinterpret_cast<char *>(_arenaBegin) + kArenaSize;
   }
 
+  // number of pages handed out of the arena so far
+  inline Offset endOffset() const {
+    return _end;
+  }
+
+  // free pages that still hold memory, and ones returned to the OS
+  inline size_t dirtyPageCount() const {
+    return _dirty.pageCount();
+  }
+  inline size_t cleanPageCount() const {
+    return _clean.pageCount();
+  }
+  inline size_t freeSpanCount() const {
+    return _dirty.size() + _clean.size();
+  }
+
   void doAfterForkChild();
 
-  void freePhys(void *ptr, size_t sz);
+  // returns the number of syscalls issued
+  size_t freePhys(void *ptr, size_t sz);
 
 private:
   void expandArena(size_t minPagesAdded);
   bool findPages(size_t pageCount, Span &result, internal::PageType &type);
-  bool ATTRIBUTE_NEVER_INLINE findPagesInner(internal::vector<Span> freeSpans[kSpanClassCount], size_t i,
-                                             size_t pageCount, Span &result);
   Span reservePages(size_t pageCount, size_t pageAlignment);
   internal::RelaxedBitmap allocatedBitmap(bool includeDirty = true) const;
 
@@ -255,7 +307,7 @@ private:
     // this happens when we are trying to get an aligned allocation
     // and returning excess back to the arena
     if (flags == internal::PageType::Clean) {
-      _clean[span.spanClass()].push_back(span);
+      _clean.insert(span);
       return;
     }
 
@@ -266,12 +318,11 @@ private:
         madvise(ptrFromOffset(span.offset), span.length << kPageShift, MADV_DONTDUMP);
       }
       d_assert(span.length > 0);
-      _dirty[span.spanClass()].push_back(span);
-      _dirtyPageCount += span.length;
+      _dirty.insert(span, decayStamp());
 
       const size_t maxDirtyPageThreshold = (kMaxDirtyPageThreshold * kPageSize4K) / PageSize;
 
-      if (_dirtyPageCount > maxDirtyPageThreshold) {
+      if (_dirty.pageCount() > maxDirtyPageThreshold) {
         // do a full scavenge with a probability 1/10
         if (_fastPrng.inRange(0, 9) == 9) {
           scavenge(true);
@@ -335,7 +386,13 @@ private:
     for (size_t i = 0; i < span.length; i++) {
       // this may already be 1 if it was a meshed virtual span that is
       // now being re-meshed to a new owning miniheap
-      _meshedBitmap.tryToSet(span.offset + i);
+      if (_meshedBitmap.tryToSet(span.offset + i)) {
+        _meshedPageCount++;
+      }
+    }
+
+    if (_meshedPageCount > _meshedPageCountHWM) {
+      _meshedPageCountHWM = _meshedPageCount;
     }
   }
 
@@ -344,18 +401,139 @@ private:
       d_assert(_meshedBitmap.isSet(span.offset + i));
       _meshedBitmap.unset(span.offset + i);
     }
+    d_assert(_meshedPageCount >= span.length);
+    _meshedPageCount -= span.length;
+  }
+
+  inline void recordScavenge(std::chrono::steady_clock::time_point start, size_t pageCount) {
+    const uint64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    MESH_TRACE(Scavenge, scavenge, pageCount, ns);
+    _scavengeStats.count++;
+    _scavengeStats.pageCount += pageCount;
+    _scavengeStats.totalNs += ns;
+    if (ns > _scavengeStats.maxNs) {
+      _scavengeStats.maxNs = ns;
+    }
+  }
+
+  // queue span's pages to be returned to the OS by flushRelease()
+  inline void releaseSpan(const Span &span) {
+    if (_releaseCount == kReleaseBatchSize) {
+      flushRelease();
+    }
+    _releaseBatch[_releaseCount].iov_base = ptrFromOffset(span.offset);
+    _releaseBatch[_releaseCount].iov_len = span.byteLength();
+    _releaseCount++;
   }
 
+  void flushRelease();
+  bool processMadvise(int advice);
+
   inline void resetSpanMapping(const Span &span) {
     auto ptr = ptrFromOffset(span.offset);
     auto sz = static_cast<size_t>(span.length) << kPageShift;
-    mmap(ptr, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, span.offset << kPageShift);
+    mapShared(_fd, ptr, span.offset << kPageShift, sz);
+  }
+
+  // calls func(shard, fileOff, len) for each piece of the arena byte
+  // range [off, off + sz) that is contiguous in a single shard's
+  // backing file.  Stride i of the arena lives in shard i % N, at file
+  // offset (i / N) * stride.
+  template <typename Func>
+  static inline void forEachShardRange(size_t off, size_t sz, const Func func) {
+    if (kArenaShardCount == 1) {
+      if (sz > 0) {
+        func(0, static_cast<off_t>(off), sz);
+      }
+      return;
+    }
+
+    while (sz > 0) {
+      const size_t stride = off / kArenaShardStride;
+      const size_t strideOff = off % kArenaShardStride;
+      const size_t shard = stride % kArenaShardCount;
+      const size_t fileOff = (stride / kArenaShardCount) * kArenaShardStride + strideOff;
+      const size_t len = std::min(sz, kArenaShardStride - strideOff);
+      func(shard, static_cast<off_t>(fileOff), len);
+      off += len;
+      sz -= len;
+    }
+  }
+
+  // calls func(first, count) for each run of consecutive set bits
+  template <typename Func>
+  static inline void forEachRun(const internal::RelaxedBitmap &bitmap, const Func func) {
+    size_t runStart = 0;
+    size_t runLength = 0;
+    for (auto const &i : bitmap) {
+      if (runLength > 0 && i == runStart + runLength) {
+        runLength++;
+        continue;
+      }
+      if (runLength > 0) {
+        func(runStart, runLength);
+      }
+      runStart = i;
+      runLength = 1;
+    }
+    if (runLength > 0) {
+      func(runStart, runLength);
+    }
+  }
+
+  // map sz bytes of the backing files, starting at arena byte offset
+  // off, over ptr.  Returns false if any of the mmap calls failed.
+  static inline bool mapShared(const int fds[kArenaShardCount], void *ptr, size_t off, size_t sz) {
+    char *dst = reinterpret_cast<char *>(ptr);
+    bool ok = true;
+    forEachShardRange(off, sz, [&](size_t shard, off_t fileOff, size_t len) {
+      void *result = mmap(dst, len, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, fds[shard], fileOff);
+      ok = ok && result != MAP_FAILED;
+      dst += len;
+    });
+    return ok;
+  }
+
+  // interleave the arena across the shards' files up to (at least)
+  // arena byte offset end.
+  void mapShardsTo(size_t end) {
+    end = (end + kArenaShardStride - 1) & ~(kArenaShardStride - 1);
+    if (end <= _shardMapEnd) {
+      return;
+    }
+
+    char *ptr = arenaBegin() + _shardMapEnd;
+    const bool ok = mapShared(_fd, ptr, _shardMapEnd, end - _shardMapEnd);
+    hard_assert(ok);
+    if (kAdviseDump) {
+      madvise(ptr, end - _shardMapEnd, MADV_DONTDUMP);
+    }
+    _shardMapEnd = end;
+  }
+
+  // map the whole arena over fds: interleaved across the shards up to
+  // _shardMapEnd, and reserved on the first shard beyond that.
+  bool mapArena(const int fds[kArenaShardCount]) {
+    void *result = mmap(_arenaBegin, kArenaSize, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, fds[0], 0);
+    return result != MAP_FAILED && mapShared(fds, _arenaBegin, 0, _shardMapEnd);
   }
 
   void prepareForFork();
   void afterForkParent();
   void afterForkChild();
 
+  // work shared between the threads copying the arena after fork
+  struct ForkCopy {
+    const int *srcFds;
+    const int *dstFds;
+    const std::pair<size_t, size_t> *ranges;  // arena byte offset and length
+    size_t rangeCount;
+    atomic_size_t next{0};
+  };
+
+  static int forkCopyThread(void *arg);
+
   void *_arenaBegin{nullptr};
   atomic<MiniHeapID> *_mhIndex{nullptr};
 
@@ -364,26 +542,42 @@ protected:
   MWC _fastPrng;
 
 private:
-  Offset _end{};  // in pages
+  Offset _end{};           // in pages
+  size_t _shardMapEnd{0};  // in bytes, interleaved across the shards
 
   // spans that had been meshed, have been freed, and need to be reset
   // to identity mappings in the page tables.
   internal::vector<Span> _toReset;
 
-  internal::vector<Span> _clean[kSpanClassCount];
-  internal::vector<Span> _dirty[kSpanClassCount];
+  // free spans, coalesced as they are freed
+  FreeSpanSet _clean{};
+  FreeSpanSet _dirty{};
 
-  size_t _dirtyPageCount{0};
+  // pages newly dirtied in each of the last kDirtyDecaySteps epochs of
+  // the decay window, oldest first; see decayDirty()
+  size_t _decayBacklog[kDirtyDecaySteps]{};
+  uint64_t _decayEpochStart{0};
+  size_t _decayLastDirty{0};
 
   internal::RelaxedBitmap _meshedBitmap{
       kArenaSize / PageSize,
       reinterpret_cast<char *>(OneWayMmapHeap().malloc(bitmap::representationSize(kArenaSize / PageSize))), false};
   size_t _meshedPageCount{0};
   size_t _meshedPageCountHWM{0};
+  size_t _mappedPageCountHWM{0};
   size_t _rssKbAtHWM{0};
   size_t _maxMeshCount{kDefaultMaxMeshCount};
 
-  int _fd;
+  ScavengeStats _scavengeStats{};
+
+  // spans queued by releaseSpan()
+  struct iovec _releaseBatch[kReleaseBatchSize];
+  size_t _releaseCount{0};
+  bool _lazyRelease{false};
+  bool _processMadviseOk{true};
+  int _pidFd{-1};
+
+  int _fd[kArenaShardCount];
   int _forkPipe[2]{-1, -1};  // used for signaling during fork
   char *_spanDir{nullptr};
 };
@@ -395,25 +589,32 @@ MeshableArena<PageSize>::MeshableArena() : SuperHeap(), _fastPrng(internal::seed
   d_assert(getArenaInstance<PageSize>() == nullptr);
   getArenaInstance<PageSize>() = this;
 
-  int fd = -1;
-  if (kMeshingEnabled) {
-    fd = openSpanFile(kArenaSize);
-    if (fd < 0) {
-      debug("mesh: opening arena file failed.\n");
-      abort();
+  for (size_t i = 0; i < kArenaShardCount; i++) {
+    int fd = -1;
+    if (kMeshingEnabled) {
+      fd = openSpanFile(kArenaShardSize);
+      if (fd < 0) {
+        debug("mesh: opening arena file failed.\n");
+        abort();
+      }
     }
+    _fd[i] = fd;
   }
-  _fd = fd;
 
 #ifdef __APPLE__
   if (kMeshingEnabled) {
     debug("mesh: using file-backed memory for arena (macOS) - enables F_PUNCHHOLE\n");
   }
-  _arenaBegin = SuperHeap::map(kArenaSize, kMapShared, fd);
+  _arenaBegin = SuperHeap::map(kArenaSize, kMapShared, _fd[0]);
 #else
-  _arenaBegin = SuperHeap::map(kArenaSize, kMapShared, fd);
+  _arenaBegin = SuperHeap::map(kArenaSize, kMapShared, _fd[0]);
 #endif
 
+  // the initial mapping is entirely backed by the first shard and only
+  // reserves the arena; with more than one shard expandArena() points
+  // each stride at its shard as the arena grows into it, as
+  // interleaving all of it up front would cost one mapping per stride.
+
   _mhIndex = reinterpret_cast<atomic<MiniHeapID> *>(SuperHeap::malloc(indexSize()));
 
   hard_assert(_arenaBegin != nullptr);
@@ -484,47 +685,37 @@ void MeshableArena<PageSize>::expandArena(size_t minPagesAdded) {
     abort();
   }
 
-  _clean[expansion.spanClass()].push_back(expansion);
-}
-
-template <size_t PageSize>
-bool MeshableArena<PageSize>::findPagesInner(internal::vector<Span> freeSpans[kSpanClassCount], const size_t i,
-                                             const size_t pageCount, Span &result) {
-  internal::vector<Span> &spanList = freeSpans[i];
-  if (spanList.empty())
-    return false;
+  if (kArenaShardCount > 1 && _fd[0] != -1) {
+    mapShardsTo(_end << kPageShift);
+  }
 
-  size_t oldLen = spanList.size();
+  MESH_TRACE(ExpandArena, expand_arena, pageCount, _end);
 
-  if (i == kSpanClassCount - 1 && spanList.back().length < pageCount) {
-    for (size_t j = 0; j < spanList.size() - 1; j++) {
-      if (spanList[j].length >= pageCount) {
-        std::swap(spanList[j], spanList.back());
-        break;
-      }
-    }
+  // merges with the free span at the old end of the arena, if any
+  _clean.insert(expansion);
+}
 
-    if (spanList.back().length < pageCount) {
+template <size_t PageSize>
+bool MeshableArena<PageSize>::findPages(const size_t pageCount, Span &result, internal::PageType &type) {
+  // prefer reusing dirty pages, which are already backed by memory
+  FreeSpanSet *freeSpans = &_dirty;
+  type = internal::PageType::Dirty;
+
+  Span span(0, 0);
+  if (!_dirty.removeBestFit(pageCount, span)) {
+    freeSpans = &_clean;
+    type = internal::PageType::Clean;
+    if (!_clean.removeBestFit(pageCount, span)) {
+      type = internal::PageType::Unknown;
       return false;
     }
   }
 
-  Span span = spanList.back();
-  spanList.pop_back();
-
-#ifndef NDEBUG
-  d_assert_msg(oldLen == spanList.size() + 1, "pageCount:%zu,%zu -- %zu/%zu", pageCount, i, oldLen, spanList.size());
-  for (size_t j = 0; j < spanList.size(); j++) {
-    d_assert(spanList[j] != span);
-  }
-#endif
-
-  d_assert(span.length >= i + 1);
   d_assert(span.length >= pageCount);
 
   Span rest = span.splitAfter(pageCount);
   if (!rest.empty()) {
-    freeSpans[rest.spanClass()].push_back(rest);
+    freeSpans->insert(rest);
   }
   d_assert(span.length == pageCount);
 
@@ -532,25 +723,6 @@ bool MeshableArena<PageSize>::findPagesInner(internal::vector<Span> freeSpans[kS
   return true;
 }
 
-template <size_t PageSize>
-bool MeshableArena<PageSize>::findPages(const size_t pageCount, Span &result, internal::PageType &type) {
-  for (size_t i = Span(0, pageCount).spanClass(); i < kSpanClassCount; i++) {
-    if (findPagesInner(_dirty, i, pageCount, result)) {
-      type = internal::PageType::Dirty;
-      return true;
-    }
-  }
-
-  for (size_t i = Span(0, pageCount).spanClass(); i < kSpanClassCount; i++) {
-    if (findPagesInner(_clean, i, pageCount, result)) {
-      type = internal::PageType::Clean;
-      return true;
-    }
-  }
-
-  return false;
-}
-
 template <size_t PageSize>
 Span MeshableArena<PageSize>::reservePages(const size_t pageCount, const size_t pageAlignment) {
   d_assert(pageCount >= 1);
@@ -606,8 +778,8 @@ internal::RelaxedBitmap MeshableArena<PageSize>::allocatedBitmap(bool includeDir
   };
 
   if (includeDirty)
-    forEachFree(_dirty, unmarkPages);
-  forEachFree(_clean, unmarkPages);
+    _dirty.forEach(unmarkPages);
+  _clean.forEach(unmarkPages);
 
   return bitmap;
 }
@@ -626,6 +798,13 @@ char *MeshableArena<PageSize>::pageAlloc(Span &result, size_t pageCount, size_t
   auto span = reservePages(pageCount, pageAlignment);
   d_assert(isAligned(span, pageAlignment));
 
+  // pages only start holding memory again when they come out of the
+  // clean set, which happens here
+  const size_t mappedPageCount = _end - _clean.pageCount() - _meshedPageCount;
+  if (mappedPageCount > _mappedPageCountHWM) {
+    _mappedPageCountHWM = mappedPageCount;
+  }
+
   d_assert(contains(ptrFromOffset(span.offset)));
 #ifndef NDEBUG
   if (_mhIndex[span.offset].load().hasValue()) {
@@ -662,108 +841,198 @@ void MeshableArena<PageSize>::free(void *ptr, size_t sz, internal::PageType type
 
 template <size_t PageSize>
 void MeshableArena<PageSize>::partialScavenge() {
-  forEachFree(_dirty, [&](const Span &span) {
-    auto ptr = ptrFromOffset(span.offset);
-    auto sz = span.byteLength();
-    madvise(ptr, sz, MADV_DONTNEED);
-    freePhys(ptr, sz);
-    _clean[span.spanClass()].push_back(span);
+  const auto start = std::chrono::steady_clock::now();
+  const size_t dirtyPageCount = _dirty.pageCount();
+
+  _dirty.forEach([&](const Span &span) {
+    releaseSpan(span);
+    _clean.insert(span);
   });
 
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _dirty[i] = internal::vector<Span>{};
-  }
+  _dirty.clear();
+  _decayLastDirty = 0;
+  flushRelease();
 
-  _dirtyPageCount = 0;
+  recordScavenge(start, dirtyPageCount);
 }
 
+// Like jemalloc's decay: the window is split into kDirtyDecaySteps
+// epochs, and the pages newly dirtied in each are remembered.  Pages
+// dirtied k epochs ago may stay dirty with weight 1 - smoothstep(k /
+// steps), so RSS trends down along a curve over the window instead of
+// dropping in one step when it expires.  The oldest spans go first.
 template <size_t PageSize>
-void MeshableArena<PageSize>::scavenge(bool force) {
-  const size_t minDirtyPageThreshold = (kMinDirtyPageThreshold * kPageSize4K) / PageSize;
+size_t MeshableArena<PageSize>::decayDirty(uint64_t now, uint64_t windowMs) {
+  constexpr uint64_t steps = kDirtyDecaySteps;
+  const uint64_t epochMs = std::max<uint64_t>(windowMs / steps, 1);
 
-  if (!force && _dirtyPageCount < minDirtyPageThreshold) {
-    return;
+  if (_decayEpochStart == 0 || now < _decayEpochStart) {
+    _decayEpochStart = now;
+    return 0;
+  }
+  const uint64_t elapsed = (now - _decayEpochStart) / epochMs;
+  if (elapsed == 0) {
+    return 0;
   }
+  _decayEpochStart += elapsed * epochMs;
 
-  auto bitmap = allocatedBitmap(false);
-  bitmap.invert();
+  const size_t shift = std::min(elapsed, steps);
+  std::copy(_decayBacklog + shift, _decayBacklog + steps, _decayBacklog);
+  std::fill(_decayBacklog + steps - shift, _decayBacklog + steps, 0);
 
-  auto markPages = [&](const Span &span) {
-    for (size_t k = 0; k < span.length; k++) {
-#ifndef NDEBUG
-      if (bitmap.isSet(span.offset + k)) {
-        debug("arena: bit %zu already set (%zu/%zu) %zu\n", k, span.offset, span.length, bitmap.bitCount());
-      }
-#endif
-      bitmap.tryToSet(span.offset + k);
-    }
-  };
+  const size_t dirtyPageCount = _dirty.pageCount();
+  _decayBacklog[steps - 1] = dirtyPageCount > _decayLastDirty ? dirtyPageCount - _decayLastDirty : 0;
 
-  std::for_each(_toReset.begin(), _toReset.end(), [&](Span span) {
+  // smoothstep h(x) = x^2 (3 - 2x), with x = k / steps
+  size_t limit = 0;
+  for (uint64_t k = 1; k <= steps; k++) {
+    limit += _decayBacklog[k - 1] * k * k * (3 * steps - 2 * k) / (steps * steps * steps);
+  }
+
+  const size_t pageCount = dirtyPageCount > limit ? releaseOldest(dirtyPageCount - limit) : 0;
+  _decayLastDirty = _dirty.pageCount();
+
+  return pageCount;
+}
+
+template <size_t PageSize>
+size_t MeshableArena<PageSize>::releaseOldest(size_t pageCount) {
+  if (_dirty.empty()) {
+    return 0;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  const size_t released = _dirty.removeOldest(pageCount, [&](const Span &span) {
+    releaseSpan(span);
+    _clean.insert(span);
+  });
+  flushRelease();
+
+  // released pages can't count as newly dirtied at the next decay tick
+  _decayLastDirty = std::min(_decayLastDirty, _dirty.pageCount());
+
+  recordScavenge(start, released);
+
+  return released;
+}
+
+template <size_t PageSize>
+void MeshableArena<PageSize>::resetFreedMeshes() {
+  for (auto const &span : _toReset) {
     untrackMeshed(span);
-    markPages(span);
     resetSpanMapping(span);
-  });
+    _clean.insert(span);
+  }
 
   _toReset = internal::vector<Span>{};
 
-  _meshedPageCount = _meshedBitmap.inUseCount();
-  if (_meshedPageCount > _meshedPageCountHWM) {
-    _meshedPageCountHWM = _meshedPageCount;
+  d_assert(_meshedPageCount == _meshedBitmap.inUseCount());
+}
+
+template <size_t PageSize>
+void MeshableArena<PageSize>::scavenge(bool force) {
+  const size_t minDirtyPageThreshold = (kMinDirtyPageThreshold * kPageSize4K) / PageSize;
+
+  if (!force && _dirty.pageCount() < minDirtyPageThreshold) {
+    return;
   }
 
-  forEachFree(_dirty, [&](const Span &span) {
-    auto ptr = ptrFromOffset(span.offset);
-    auto sz = span.byteLength();
-    madvise(ptr, sz, MADV_DONTNEED);
-    freePhys(ptr, sz);
-    markPages(span);
+  const auto start = std::chrono::steady_clock::now();
+  const size_t dirtyPageCount = _dirty.pageCount();
+
+  // only spans that were freed since the last pass need any work:
+  // freed meshed spans get their identity mapping back, and dirty
+  // spans are returned to the OS.  Both then merge into the clean set.
+  resetFreedMeshes();
+
+  _dirty.forEach([&](const Span &span) {
+    releaseSpan(span);
+    _clean.insert(span);
   });
 
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _dirty[i] = internal::vector<Span>{};
+  _dirty.clear();
+  _decayLastDirty = 0;
+  flushRelease();
+
+  recordScavenge(start, dirtyPageCount);
+}
+
+template <size_t PageSize>
+void MeshableArena<PageSize>::flushRelease() {
+  if (_releaseCount == 0) {
+    return;
   }
 
-  _dirtyPageCount = 0;
+#ifdef __linux__
+  // on the memfd-backed arena MADV_REMOVE both drops the pages and
+  // punches a hole in the backing file, so one call does the work of
+  // MADV_DONTNEED + freePhys().
+  const int advice = _lazyRelease ? MADV_FREE : kMeshingEnabled ? MADV_REMOVE : MADV_DONTNEED;
 
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _clean[i] = internal::vector<Span>{};
+  if (_releaseCount > 1 && processMadvise(advice)) {
+    _releaseCount = 0;
+    return;
   }
+#endif
+
+  for (size_t i = 0; i < _releaseCount; i++) {
+    void *ptr = _releaseBatch[i].iov_base;
+    const size_t sz = _releaseBatch[i].iov_len;
 
-  Span current(0, 0);
-  for (auto const &i : bitmap) {
-    if (i == current.offset + current.length) {
-      current.length++;
+#ifdef __linux__
+    _scavengeStats.syscalls++;
+    if (madvise(ptr, sz, advice) == 0) {
       continue;
     }
+#endif
+
+    madvise(ptr, sz, MADV_DONTNEED);
+    _scavengeStats.syscalls += 1 + freePhys(ptr, sz);
+  }
 
-    if (!current.empty()) {
-      _clean[current.spanClass()].push_back(current);
+  _releaseCount = 0;
+}
+
+// release every queued span with a single process_madvise(2) call.
+// Returns false if the caller should fall back to per-span madvise.
+template <size_t PageSize>
+bool MeshableArena<PageSize>::processMadvise(int advice) {
+#if defined(__linux__) && defined(SYS_process_madvise) && defined(SYS_pidfd_open)
+  if (!_processMadviseOk) {
+    return false;
+  }
+
+  if (_pidFd == -1) {
+    _pidFd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (_pidFd == -1) {
+      _processMadviseOk = false;
+      return false;
     }
+  }
 
-    current = Span(i, 1);
+  size_t total = 0;
+  for (size_t i = 0; i < _releaseCount; i++) {
+    total += _releaseBatch[i].iov_len;
   }
 
-  if (!current.empty()) {
-    _clean[current.spanClass()].push_back(current);
+  _scavengeStats.syscalls++;
+  const ssize_t result = syscall(SYS_process_madvise, _pidFd, _releaseBatch, _releaseCount, advice, 0);
+  if (result == static_cast<ssize_t>(total)) {
+    return true;
   }
-#ifndef NDEBUG
-  auto newBitmap = allocatedBitmap();
-  newBitmap.invert();
-
-  const size_t *bits1 = bitmap.bits();
-  const size_t *bits2 = newBitmap.bits();
-  for (size_t i = 0; i < bitmap.byteCount() / sizeof(size_t); i++) {
-    if (bits1[i] != bits2[i]) {
-      debug("bitmaps don't match %zu:\n", i);
-      hard_assert(false);
-    }
+
+  // before Linux 6.13 process_madvise only accepts hints like
+  // MADV_COLD, even on the calling process
+  if (result < 0 && (errno == EINVAL || errno == ENOSYS || errno == EPERM)) {
+    _processMadviseOk = false;
   }
 #endif
+  return false;
 }
 
 template <size_t PageSize>
-void MeshableArena<PageSize>::freePhys(void *ptr, size_t sz) {
+size_t MeshableArena<PageSize>::freePhys(void *ptr, size_t sz) {
   d_assert(contains(ptr));
   d_assert(sz > 0);
 
@@ -771,38 +1040,45 @@ void MeshableArena<PageSize>::freePhys(void *ptr, size_t sz) {
   d_assert(sz % CPUInfo::PageSize == 0);
 
   if (!kMeshingEnabled) {
-    return;
+    return 0;
   }
 
-  if (_fd == -1) {
-    return;
+  if (_fd[0] == -1) {
+    return 0;
   }
 
-  const off_t off = reinterpret_cast<char *>(ptr) - reinterpret_cast<char *>(_arenaBegin);
+  const size_t arenaOff = reinterpret_cast<char *>(ptr) - reinterpret_cast<char *>(_arenaBegin);
 
+  size_t syscalls = 0;
+  forEachShardRange(arenaOff, sz, [&](size_t shard, off_t off, size_t len) {
+    const int fd = _fd[shard];
+    syscalls++;
 #ifdef __FreeBSD__
 #if __FreeBSD_version >= 1400000
-  struct spacectl_range range = {off, static_cast<off_t>(sz)};
-  int result = fspacectl(_fd, SPACECTL_DEALLOC, &range, 0, NULL);
-  d_assert_msg(result == 0, "fspacectl(fd %d): %d errno %d (%s)\n", _fd, result, errno, strerror(errno));
+    struct spacectl_range range = {off, static_cast<off_t>(len)};
+    int result = fspacectl(fd, SPACECTL_DEALLOC, &range, 0, NULL);
+    d_assert_msg(result == 0, "fspacectl(fd %d): %d errno %d (%s)\n", fd, result, errno, strerror(errno));
 #else
 #warning "space deallocation unsupported on FreeBSD < 14"
 #endif
 #elif defined(__APPLE__)
-  fpunchhole_t punch;
-  memset(&punch, 0, sizeof(punch));
-  punch.fp_offset = off;
-  punch.fp_length = sz;
-
-  int result = fcntl(_fd, F_PUNCHHOLE, &punch);
-  if (result != 0) {
-    debug("F_PUNCHHOLE failed (fd %d, off %lld, sz %zu): errno %d (%s)\n", _fd, (long long)off, sz, errno,
-          strerror(errno));
-  }
+    fpunchhole_t punch;
+    memset(&punch, 0, sizeof(punch));
+    punch.fp_offset = off;
+    punch.fp_length = len;
+
+    int result = fcntl(fd, F_PUNCHHOLE, &punch);
+    if (result != 0) {
+      debug("F_PUNCHHOLE failed (fd %d, off %lld, sz %zu): errno %d (%s)\n", fd, (long long)off, len, errno,
+            strerror(errno));
+    }
 #else
-  int result = fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, sz);
-  d_assert_msg(result == 0, "fallocate(fd %d): %d errno %d (%s)\n", _fd, result, errno, strerror(errno));
+    int result = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+    d_assert_msg(result == 0, "fallocate(fd %d): %d errno %d (%s)\n", fd, result, errno, strerror(errno));
 #endif
+  });
+
+  return syscalls;
 }
 
 template <size_t PageSize>
@@ -828,13 +1104,10 @@ void MeshableArena<PageSize>::finalizeMesh(void *keep, void *remove, size_t sz)
   trackMeshed(removedSpan);
 
 #ifdef __APPLE__
-  hard_assert(_fd >= 0);
-  void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, keepOff << kPageShift);
-  hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
-#else
-  void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, keepOff << kPageShift);
-  hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
+  hard_assert(_fd[0] >= 0);
 #endif
+  const bool ok = mapShared(_fd, remove, keepOff << kPageShift, sz);
+  hard_assert_msg(ok, "mesh remap failed: %d", errno);
 }
 
 template <size_t PageSize>
@@ -843,7 +1116,10 @@ int MeshableArena<PageSize>::openShmSpanFile(size_t sz) {
   char buf[buf_len];
   memset(buf, 0, buf_len);
 
-  _spanDir = openSpanDir(getpid());
+  // every shard's file lives in the same per-process directory
+  if (_spanDir == nullptr) {
+    _spanDir = openSpanDir(getpid());
+  }
   d_assert(_spanDir != nullptr);
 
   char *next = strcat(buf, _spanDir);
@@ -48,6 +48,57 @@ inline bool bitmapsMeshable(const void *__restrict__ bitmap1, const void *__rest
 
 namespace method {
 
+// The probing loop of shiftedSplitting: left[j] is tested against
+// right[j], right[j + 1], ... (wrapping, at most 64 of them), and each
+// meshable pair is handed to meshFound and removed from both arrays.
+// bits(x) gives x's bitmap, so this runs over anything that has one;
+// testing/mesh_simulator.cc uses it on bitmaps loaded from heap dumps.
+// Returns the number of pairs probed.
+template <typename T, typename Bits, typename Found>
+inline size_t shiftedProbe(T *left, size_t leftSize, T *right, size_t rightSize, size_t nBytes, const Bits &bits,
+                           const Found &meshFound) noexcept {
+  constexpr size_t t = 64;
+
+  if (leftSize == 0 || rightSize == 0) {
+    return 0;
+  }
+
+  const size_t limit = rightSize < t ? rightSize : t;
+
+  size_t probes = 0;
+  size_t foundCount = 0;
+  for (size_t j = 0; j < leftSize; j++) {
+    const size_t idxLeft = j;
+    size_t idxRight = j;
+
+    for (size_t i = 0; i < limit; i++, idxRight++) {
+      if (unlikely(idxRight >= rightSize)) {
+        idxRight %= rightSize;
+      }
+      auto h1 = left[idxLeft];
+      auto h2 = right[idxRight];
+
+      if (h1 == nullptr || h2 == nullptr)
+        continue;
+
+      probes++;
+      const bool areMeshable = mesh::bitmapsMeshable(bits(h1), bits(h2), nBytes);
+
+      if (unlikely(areMeshable)) {
+        bool shouldContinue = meshFound(h1, h2);
+        left[idxLeft] = nullptr;
+        right[idxRight] = nullptr;
+        foundCount++;
+        if (unlikely(foundCount > kMaxMeshesPerIteration || !shouldContinue)) {
+          return probes;
+        }
+      }
+    }
+  }
+
+  return probes;
+}
+
 // split miniheaps into two lists in a random order
 template <size_t PageSize>
 void halfSplit(MWC &prng, MiniHeapListEntry<PageSize> *miniheaps, SplitArray<PageSize> &left, size_t &leftSize,
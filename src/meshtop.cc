@@ -0,0 +1,217 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// meshtop: show the heap statistics a process running with
+// MESH_STATS_SEGMENT=1 publishes (see stats_segment.h), refreshed
+// every few seconds.  It only reads the process's memfd through /proc,
+// so the process is never signalled or stopped.
+//
+//   usage: meshtop [-d SECONDS] [-n ITERATIONS] PID
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "stats_segment.h"
+
+using namespace mesh;
+
+static constexpr int kMaxReadAttempts = 1000;
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-d SECONDS] [-n ITERATIONS] PID\n", argv0);
+  exit(1);
+}
+
+// returns an fd for pid's stats segment, or -1
+static int openSegment(pid_t pid) {
+  char dirPath[64];
+  snprintf(dirPath, sizeof(dirPath), "/proc/%d/fd", pid);
+
+  DIR *dir = opendir(dirPath);
+  if (dir == nullptr) {
+    fprintf(stderr, "meshtop: %s: %s\n", dirPath, strerror(errno));
+    return -1;
+  }
+
+  // memfds show up as "/memfd:<name> (deleted)"
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "/memfd:%s", kStatsSegmentName);
+
+  int fd = -1;
+  struct dirent *entry;
+  while (fd < 0 && (entry = readdir(dir)) != nullptr) {
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len < 0) {
+      continue;
+    }
+    target[len] = '\0';
+    if (strncmp(target, prefix, strlen(prefix)) == 0) {
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+  }
+  closedir(dir);
+
+  if (fd < 0) {
+    fprintf(stderr, "meshtop: no stats segment in process %d; is it running with MESH_STATS_SEGMENT=1?\n", pid);
+  }
+  return fd;
+}
+
+// copy a consistent snapshot out of the shared segment
+static bool readSegment(const StatsSegment *shared, StatsSegment *out) {
+  for (int i = 0; i < kMaxReadAttempts; i++) {
+    const uint64_t before = shared->seq.load(std::memory_order_acquire);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(static_cast<void *>(out), shared, sizeof(*out));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (shared->seq.load(std::memory_order_relaxed) == before) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static double mb(uint64_t bytes) {
+  return bytes / 1024.0 / 1024.0;
+}
+
+static void print(const StatsSegment &s) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  const uint64_t nowNs = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+  const double ageSec = nowNs > s.timestampNs ? (nowNs - s.timestampNs) / 1e9 : 0.0;
+
+  printf("pid %u  page size %u  update %llu (%.1fs ago)\n", s.pid, s.pageSize,
+         static_cast<unsigned long long>(s.updateCount), ageSec);
+  printf("RSS %8.1f MB   mapped %8.1f MB   dirty %8.1f MB   metadata %6.1f MB\n", mb(s.rss), mb(s.mapped),
+         mb(s.dirty), mb(s.metadata));
+  printf("allocated %8.1f MB   active %8.1f MB   large %llu (%.1f MB)\n", mb(s.allocated), mb(s.active),
+         static_cast<unsigned long long>(s.largeCount), mb(s.largeBytes));
+  printf("meshed %8.1f MB saved (HWM %.1f MB)   meshes %llu\n", mb(s.meshedPages * s.pageSize),
+         mb(s.meshedPagesHWM * s.pageSize), static_cast<unsigned long long>(s.meshCount));
+  printf("mesh passes %llu   last %.3f ms   avg %.3f ms   max %.3f ms\n",
+         static_cast<unsigned long long>(s.meshPassCount), s.meshPassLastNs / 1e6,
+         s.meshPassCount ? s.meshPassTotalNs / 1e6 / s.meshPassCount : 0.0, s.meshPassMaxNs / 1e6);
+  printf("scavenges %llu (%.1f MB released)\n\n", static_cast<unsigned long long>(s.scavengeCount),
+         mb(s.scavengedPages * s.pageSize));
+
+  printf("%6s %10s %6s %7s %7s %7s %7s %8s %7s %9s\n", "size", "in use KB", "occ%", "spans", "empty", "partial",
+         "full", "attached", "meshed", "meshes");
+  const uint32_t binCount = s.binCount < kStatsSegmentMaxBins ? s.binCount : kStatsSegmentMaxBins;
+  for (uint32_t i = 0; i < binCount; i++) {
+    const StatsSegmentSizeClass &sc = s.sizeClasses[i];
+    if (sc.spans == 0 && sc.meshCount == 0) {
+      continue;
+    }
+    const uint64_t capacity = sc.spans * (sc.objectSize ? sc.spanSize / sc.objectSize : 0);
+    const double occupancy = capacity ? 100.0 * sc.inUseObjects / capacity : 0.0;
+    printf("%6llu %10.1f %6.1f %7llu %7llu %7llu %7llu %8llu %7llu %9llu\n",
+           static_cast<unsigned long long>(sc.objectSize), sc.inUseBytes / 1024.0, occupancy,
+           static_cast<unsigned long long>(sc.spans), static_cast<unsigned long long>(sc.emptySpans),
+           static_cast<unsigned long long>(sc.partialSpans), static_cast<unsigned long long>(sc.fullSpans),
+           static_cast<unsigned long long>(sc.attachedSpans), static_cast<unsigned long long>(sc.meshedSpans),
+           static_cast<unsigned long long>(sc.meshCount));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  double delay = 2.0;
+  long iterations = 0;  // forever
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:h")) != -1) {
+    switch (opt) {
+    case 'd':
+      delay = atof(optarg);
+      break;
+    case 'n':
+      iterations = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  const pid_t pid = atoi(argv[optind]);
+
+  int fd = openSegment(pid);
+  if (fd < 0) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(StatsSegment)) {
+    fprintf(stderr, "meshtop: stats segment is too small\n");
+    return 1;
+  }
+
+  void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    fprintf(stderr, "meshtop: mmap: %s\n", strerror(errno));
+    return 1;
+  }
+  const auto shared = reinterpret_cast<const StatsSegment *>(ptr);
+
+  if (memcmp(shared->magic, kStatsSegmentMagic, sizeof(shared->magic)) != 0 ||
+      shared->version != kStatsSegmentVersion) {
+    fprintf(stderr, "meshtop: unsupported stats segment\n");
+    return 1;
+  }
+  if (static_cast<pid_t>(shared->pid) != pid) {
+    // a forked child inherits its parent's segment, but only the
+    // parent keeps it up to date
+    fprintf(stderr, "meshtop: warning: segment belongs to process %u\n", shared->pid);
+  }
+
+  const bool interactive = isatty(STDOUT_FILENO);
+  alignas(StatsSegment) static char buf[sizeof(StatsSegment)];
+  auto snapshot = reinterpret_cast<StatsSegment *>(buf);
+
+  for (long i = 0; iterations == 0 || i < iterations; i++) {
+    if (i > 0) {
+      usleep(static_cast<useconds_t>(delay * 1000000));
+    }
+    if (kill(pid, 0) != 0 && errno == ESRCH) {
+      fprintf(stderr, "meshtop: process %d exited\n", pid);
+      return 0;
+    }
+    if (!readSegment(shared, snapshot)) {
+      fprintf(stderr, "meshtop: segment is being updated too often to read\n");
+      continue;
+    }
+
+    if (interactive) {
+      printf("\033[H\033[2J");
+    } else if (i > 0) {
+      printf("\n");
+    }
+    print(*snapshot);
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -35,6 +35,7 @@ private:
   static constexpr uint32_t ShuffleVectorOffsetShift = 8;
   static constexpr uint32_t MaxCountShift = 16;
   static constexpr uint32_t PendingOffset = 27;
+  static constexpr uint32_t SampledOffset = 28;
   static constexpr uint32_t MeshedOffset = 30;
 
   inline void ATTRIBUTE_ALWAYS_INLINE setMasked(uint32_t mask, uint32_t newVal) {
@@ -108,6 +109,14 @@ public:
     return (_flags.load(std::memory_order_acquire) >> ShuffleVectorOffsetShift) & 0xff;
   }
 
+  // for sized frees: true if this is a small-object span of sizeClass
+  // with nothing sampled, from a single load of the flags
+  inline bool ATTRIBUTE_ALWAYS_INLINE isUnsampledSmall(uint32_t sizeClass) const {
+    constexpr uint32_t mask = (static_cast<uint32_t>(1) << SampledOffset) | 0x3f;
+    const uint32_t flags = _flags.load(std::memory_order_acquire);
+    return (flags & mask) == sizeClass && ((flags >> MaxCountShift) & 0x7ff) > 1;
+  }
+
   inline void setSvOffset(uint8_t off) {
     d_assert(off < 255);
     uint32_t mask = ~(static_cast<uint32_t>(0xff) << ShuffleVectorOffsetShift);
@@ -127,6 +136,14 @@ public:
     return is(MeshedOffset);
   }
 
+  inline void setSampled() {
+    set(SampledOffset);
+  }
+
+  inline bool ATTRIBUTE_ALWAYS_INLINE isSampled() const {
+    return is(SampledOffset);
+  }
+
   inline void setPending() {
     set(PendingOffset);
   }
@@ -382,6 +399,20 @@ public:
     return _nextMeshed.hasValue();
   }
 
+  // set once the heap profiler samples an object in this span, so that
+  // frees only consult the profiler for spans that may need it
+  inline void setSampled() {
+    _flags.setSampled();
+  }
+
+  inline bool ATTRIBUTE_ALWAYS_INLINE isSampled() const {
+    return _flags.isSampled();
+  }
+
+  inline bool ATTRIBUTE_ALWAYS_INLINE isUnsampledSmall(uint32_t sizeClass) const {
+    return _flags.isUnsampledSmall(sizeClass);
+  }
+
   inline bool isMeshingCandidate() const {
     return !isAttached() && objectSize() < PageSize;
   }
@@ -513,6 +544,22 @@ public:
     return off;
   }
 
+  // getUnmeshedOff for callers that know the size class, e.g. from
+  // the size passed to a sized free
+  inline uint16_t ATTRIBUTE_ALWAYS_INLINE getUnmeshedOff(const void *arenaBegin, void *ptr,
+                                                         uint32_t sizeClass) const {
+    const auto ptrval = reinterpret_cast<uintptr_t>(ptr);
+
+    uintptr_t span = reinterpret_cast<uintptr_t>(arenaBegin) + (static_cast<size_t>(_span.offset) << kPageShift);
+    d_assert(span != 0);
+    d_assert(sizeClass == static_cast<uint32_t>(this->sizeClass()));
+
+    const size_t off = int_recip::computeIndex(ptrval - span, sizeClass);
+    d_assert(off < maxCount());
+
+    return off;
+  }
+
   inline uint16_t ATTRIBUTE_ALWAYS_INLINE getOff(const void *arenaBegin, void *ptr) const {
     const auto span = spanStart(reinterpret_cast<uintptr_t>(arenaBegin), ptr);
     d_assert(span != 0);
@@ -14,6 +14,7 @@
 // UNIX
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -21,13 +22,16 @@
 #include <map>
 #endif
 
+#include <algorithm>
+
 #include "internal.h"
 #include "one_way_mmap_heap.h"
 
 namespace mesh {
 
 // MmapHeap extends OneWayMmapHeap to track allocated address space
-// and will free memory with calls to munmap.
+// and will free memory with calls to munmap.  GlobalHeap maps huge
+// allocations with it, outside the arena; callers serialize access.
 class MmapHeap : public OneWayMmapHeap {
 private:
   DISALLOW_COPY_AND_ASSIGN(MmapHeap);
@@ -36,25 +40,91 @@ private:
 public:
   enum { Alignment = MmapWrapper::Alignment };
 
+  // transparent huge pages are 2MB with 4KB base pages
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
   MmapHeap() : SuperHeap() {
   }
 
-  inline void *malloc(size_t sz) {
-    auto ptr = map(sz, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+  // maps at least sz bytes, aligned to alignment (a power of two) or
+  // the page size if that is larger.  Unlike OneWayMmapHeap::map this
+  // returns nullptr rather than aborting if the kernel says no.
+  inline void *malloc(size_t sz, size_t alignment = 0) {
+    const size_t pageSize = getPageSize();
+    alignment = std::max(alignment, pageSize);
+    if (_hugePages) {
+      alignment = std::max(alignment, kHugePageSize);
+    }
+
+    const size_t length = roundUpToPage(sz);
+    const size_t extra = alignment - pageSize;
+    if (unlikely(length < sz || length + extra < length)) {
+      return nullptr;
+    }
+
+    void *mapping = mmap(nullptr, length + extra, HL_MMAP_PROTECTION_MASK, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unlikely(mapping == MAP_FAILED)) {
+      return nullptr;
+    }
+
+    // trim the mapping down to the aligned part
+    const auto begin = reinterpret_cast<uintptr_t>(mapping);
+    const auto aligned = (begin + alignment - 1) & ~(alignment - 1);
+    if (aligned > begin) {
+      munmap(mapping, aligned - begin);
+    }
+    if (begin + extra > aligned) {
+      munmap(reinterpret_cast<void *>(aligned + length), begin + extra - aligned);
+    }
+
+    void *ptr = reinterpret_cast<void *>(aligned);
+    adviseHugePages(ptr, length);
 
     d_assert(_vmaMap.find(ptr) == _vmaMap.end());
-    _vmaMap[ptr] = sz;
-    d_assert(_vmaMap.find(ptr) != _vmaMap.end());
-    d_assert(_vmaMap[ptr] == sz);
+    _vmaMap[ptr] = length;
 
     return ptr;
   }
 
-  inline size_t getSize(void *ptr) const {
+  // resizes the mapping at ptr, moving it if it can't grow in place.
+  // On failure returns nullptr and leaves ptr mapped.
+  inline void *realloc(void *ptr, size_t sz) {
     auto entry = _vmaMap.find(ptr);
+    d_assert(entry != _vmaMap.end());
+    const size_t oldLength = entry->second;
+    const size_t length = roundUpToPage(sz);
+    if (unlikely(length < sz)) {
+      return nullptr;
+    }
+    if (length == oldLength) {
+      return ptr;
+    }
+
+#if defined(__linux__)
+    void *newPtr = mremap(ptr, oldLength, length, MREMAP_MAYMOVE);
+    if (unlikely(newPtr == MAP_FAILED)) {
+      return nullptr;
+    }
+    _vmaMap.erase(entry);
+    if (length > oldLength) {
+      adviseHugePages(newPtr, length);
+    }
+    _vmaMap[newPtr] = length;
+#else
+    void *newPtr = malloc(length);
+    if (unlikely(newPtr == nullptr)) {
+      return nullptr;
+    }
+    memcpy(newPtr, ptr, std::min(oldLength, length));
+    free(ptr);
+#endif
+
+    return newPtr;
+  }
+
+  inline size_t getSize(const void *ptr) const {
+    auto entry = _vmaMap.find(const_cast<void *>(ptr));
     if (unlikely(entry == _vmaMap.end())) {
-      debug("mmap: invalid getSize: %p", ptr);
-      abort();
       return 0;
     }
     return entry->second;
@@ -96,8 +166,32 @@ public:
     return sz;
   }
 
+  size_t count() const {
+    return _vmaMap.size();
+  }
+
+  // ask for transparent huge pages (MADV_HUGEPAGE) on new mappings,
+  // which are then also aligned to kHugePageSize
+  void setHugePages(bool hugePages) {
+    _hugePages = hugePages;
+  }
+
 protected:
+  static inline size_t roundUpToPage(size_t sz) {
+    const size_t pageSize = getPageSize();
+    return (sz + pageSize - 1) & ~(pageSize - 1);
+  }
+
+  inline void adviseHugePages(void *ptr, size_t length) const {
+#ifdef MADV_HUGEPAGE
+    if (_hugePages) {
+      madvise(ptr, length, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
   internal::unordered_map<void *, size_t> _vmaMap{};
+  bool _hugePages{false};
 };
 }  // namespace mesh
 
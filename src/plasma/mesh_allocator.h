@@ -0,0 +1,127 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// A standard allocator and a std::pmr::memory_resource that allocate
+// from the calling thread's Mesh heap through the fast paths in
+// plasma/mesh_inline.h, so that containers can use Mesh whether or not
+// it is the program's malloc:
+//
+//   std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+//                      mesh::allocator<std::pair<const K, V>>> map;
+//   std::pmr::vector<int> v(mesh::memoryResource());
+//
+// Both know the size on deallocate and pass it down, and single-object
+// allocations (list and hash table nodes) use a size class computed at
+// compile time.  Over-aligned requests go through mesh_memalign.  As
+// with plasma/mesh_inline.h, Mesh must be linked statically
+// (//src:mesh-inline).
+
+#pragma once
+#ifndef PLASMA__MESH_ALLOCATOR_H
+#define PLASMA__MESH_ALLOCATOR_H
+
+#include <stddef.h>
+
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+#include "plasma/mesh_inline.h"
+
+extern "C" {
+void *mesh_memalign(size_t alignment, size_t size);
+}
+
+namespace mesh {
+
+template <typename T>
+class allocator {
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using difference_type = ptrdiff_t;
+  using propagate_on_container_move_assignment = std::true_type;
+  using is_always_equal = std::true_type;
+
+  allocator() noexcept = default;
+
+  template <typename U>
+  allocator(const allocator<U> &) noexcept {
+  }
+
+  T *allocate(size_t n) {
+    if (unlikely(n > std::numeric_limits<size_t>::max() / sizeof(T))) {
+      throw std::bad_array_new_length();
+    }
+
+    void *ptr;
+    if constexpr (alignof(T) > kMinObjectSize) {
+      ptr = mesh_memalign(alignof(T), n * sizeof(T));
+    } else if (n == 1) {
+      ptr = fast::malloc<sizeof(T)>();
+    } else {
+      ptr = fast::malloc(n * sizeof(T));
+    }
+
+    if (unlikely(ptr == nullptr)) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  }
+
+  void deallocate(T *ptr, size_t n) noexcept {
+    if constexpr (alignof(T) > kMinObjectSize) {
+      // an aligned allocation may come from a larger size class than
+      // n * sizeof(T) would
+      fast::free(ptr);
+    } else {
+      fast::sizedFree(ptr, n * sizeof(T));
+    }
+  }
+};
+
+template <typename T, typename U>
+inline bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+  return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+  return false;
+}
+
+class MemoryResource : public std::pmr::memory_resource {
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    void *ptr = alignment > kMinObjectSize ? mesh_memalign(alignment, bytes) : fast::malloc(bytes);
+    if (unlikely(ptr == nullptr)) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+
+  void do_deallocate(void *ptr, size_t bytes, size_t alignment) override {
+    if (alignment > kMinObjectSize) {
+      fast::free(ptr);
+    } else {
+      fast::sizedFree(ptr, bytes);
+    }
+  }
+
+  // every MemoryResource allocates from the same heaps
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return dynamic_cast<const MemoryResource *>(&other) != nullptr;
+  }
+};
+
+inline MemoryResource *memoryResource() noexcept {
+  static MemoryResource resource;
+  return &resource;
+}
+
+}  // namespace mesh
+
+#endif  // PLASMA__MESH_ALLOCATOR_H
@@ -0,0 +1,150 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Inlineable allocation fast paths for C++ programs statically linked
+// with Mesh (//src:mesh-inline, which links //src:mesh_static_linux or
+// _macos).  malloc and operator new reach the thread-local heap through
+// several out-of-line calls; these read the initial-exec TLS heap
+// pointer and pop from the shuffle vector in the caller, and with a
+// size known at compile time the size class lookup folds away too:
+//
+//   auto *node = static_cast<Node *>(mesh::fast::malloc<sizeof(Node)>());
+//   ...
+//   mesh::fast::sizedFree(node, sizeof(Node));
+//
+// Anything off the fast path (no heap for this thread yet, recording,
+// large sizes) goes through mesh_malloc and mesh_free as usual.  This
+// needs Mesh's internal headers and defines, and only works when Mesh
+// is linked into the same binary: a shared libmesh has its own copy of
+// the TLS heap pointer.
+
+#pragma once
+#ifndef PLASMA__MESH_INLINE_H
+#define PLASMA__MESH_INLINE_H
+
+#include <stddef.h>
+
+#include <new>
+#include <utility>
+
+#include "alloc_recorder.h"
+#include "common.h"
+#include "thread_local_heap.h"
+
+extern "C" {
+void *mesh_malloc(size_t sz);
+void mesh_free(void *ptr);
+void mesh_sized_free(void *ptr, size_t sz);
+}
+
+namespace mesh {
+namespace fast {
+
+namespace detail {
+template <size_t PageSize>
+inline ThreadLocalHeap<PageSize> *ATTRIBUTE_ALWAYS_INLINE heap() {
+  auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
+    return nullptr;
+  }
+  return localHeap;
+}
+
+template <size_t PageSize>
+inline void *ATTRIBUTE_ALWAYS_INLINE malloc(size_t sz) {
+  auto *localHeap = heap<PageSize>();
+  if (unlikely(localHeap == nullptr)) {
+    return mesh_malloc(sz);
+  }
+  return localHeap->malloc(sz);
+}
+
+template <size_t PageSize, size_t Size>
+inline void *ATTRIBUTE_ALWAYS_INLINE malloc() {
+  constexpr int32_t sizeClass = SizeMap::ConstantSizeClass(Size);
+  if constexpr (sizeClass < 0) {
+    return malloc<PageSize>(Size);
+  } else {
+    auto *localHeap = heap<PageSize>();
+    if (unlikely(localHeap == nullptr)) {
+      return mesh_malloc(Size);
+    }
+    return localHeap->mallocSizeClass(Size, sizeClass);
+  }
+}
+
+template <size_t PageSize>
+inline void ATTRIBUTE_ALWAYS_INLINE free(void *ptr) {
+  auto *localHeap = heap<PageSize>();
+  if (unlikely(localHeap == nullptr)) {
+    mesh_free(ptr);
+    return;
+  }
+  localHeap->free(ptr);
+}
+
+template <size_t PageSize>
+inline void ATTRIBUTE_ALWAYS_INLINE sizedFree(void *ptr, size_t sz) {
+  auto *localHeap = heap<PageSize>();
+  if (unlikely(localHeap == nullptr)) {
+    mesh_sized_free(ptr, sz);
+    return;
+  }
+  localHeap->sizedFree(ptr, sz);
+}
+}  // namespace detail
+
+// getPageSize() is a constant on x86_64 and Apple Silicon, so there
+// the page size dispatch compiles away as well.
+
+inline void *ATTRIBUTE_ALWAYS_INLINE ATTRIBUTE_MALLOC malloc(size_t sz) {
+  return getPageSize() == kPageSize4K ? detail::malloc<kPageSize4K>(sz) : detail::malloc<kPageSize16K>(sz);
+}
+
+template <size_t Size>
+inline void *ATTRIBUTE_ALWAYS_INLINE ATTRIBUTE_MALLOC malloc() {
+  return getPageSize() == kPageSize4K ? detail::malloc<kPageSize4K, Size>() : detail::malloc<kPageSize16K, Size>();
+}
+
+inline void ATTRIBUTE_ALWAYS_INLINE free(void *ptr) {
+  if (getPageSize() == kPageSize4K) {
+    detail::free<kPageSize4K>(ptr);
+  } else {
+    detail::free<kPageSize16K>(ptr);
+  }
+}
+
+inline void ATTRIBUTE_ALWAYS_INLINE sizedFree(void *ptr, size_t sz) {
+  if (getPageSize() == kPageSize4K) {
+    detail::sizedFree<kPageSize4K>(ptr, sz);
+  } else {
+    detail::sizedFree<kPageSize16K>(ptr, sz);
+  }
+}
+
+// new and sized delete for a single object
+template <typename T, typename... Args>
+inline T *create(Args &&...args) {
+  static_assert(alignof(T) <= kMinObjectSize, "size classes are only 16-byte aligned");
+  void *ptr = malloc<sizeof(T)>();
+  if (unlikely(ptr == nullptr)) {
+    throw std::bad_alloc();
+  }
+  return new (ptr) T(std::forward<Args>(args)...);
+}
+
+template <typename T>
+inline void destroy(T *object) {
+  if (object == nullptr) {
+    return;
+  }
+  object->~T();
+  sizedFree(object, sizeof(T));
+}
+
+}  // namespace fast
+}  // namespace mesh
+
+#endif  // PLASMA__MESH_INLINE_H
@@ -26,12 +26,6 @@ const unsigned char SizeMap::class_array_[kClassArraySize] = {
 #include "size_classes.def"
 };
 
-ATTRIBUTE_ALIGNED(CACHELINE_SIZE)
-const int32_t SizeMap::class_to_size_[kClassSizesMax] = {
-    16,  16,  32,  48,  64,  80,  96,  112,  128,  160,  192,  224,   256,
-    320, 384, 448, 512, 640, 768, 896, 1024, 2048, 4096, 8192, 16384,
-};
-
 STLAllocator<char, internal::Heap> internal::allocator{};
 
 size_t internal::measurePssKiB() {
@@ -57,38 +51,64 @@ size_t internal::measurePssKiB() {
   return atoi(&start[6]);
 }
 
-int internal::copyFile(int dstFd, int srcFd, off_t off, size_t sz) {
-  d_assert(off >= 0);
-
-#if defined(__APPLE__)
-  // Use pread/pwrite for page-level copies. fcopyfile copies the ENTIRE
-  // file (not a byte range), which is catastrophically slow when called
-  // per-page on a 2GB arena file.
+// copy sz bytes at offset off through a bounce buffer
+static ssize_t copyFileBuffered(int dstFd, int srcFd, off_t off, size_t sz) {
   char buf[16384];
   size_t remaining = sz;
-  off_t curOff = off;
-  int result = 0;
   while (remaining > 0) {
     size_t chunk = remaining < sizeof(buf) ? remaining : sizeof(buf);
-    ssize_t nread = pread(srcFd, buf, chunk, curOff);
-    if (nread <= 0) { result = -1; break; }
-    ssize_t nwritten = pwrite(dstFd, buf, nread, curOff);
-    if (nwritten != nread) { result = -1; break; }
+    ssize_t nread = pread(srcFd, buf, chunk, off);
+    if (nread <= 0)
+      return -1;
+    ssize_t nwritten = pwrite(dstFd, buf, nread, off);
+    if (nwritten != nread)
+      return -1;
     remaining -= nread;
-    curOff += nread;
+    off += nread;
   }
-  if (remaining == 0) result = (int)sz;
-#elif defined(__FreeBSD__)
-  // unlike Linux and Solaris, sendfile works only with sockets here
-  // thus copy_file_range is the only viable solution
-  int result = copy_file_range(srcFd, &off, dstFd, NULL, sz, 0);
+  return sz;
+}
+
+ssize_t internal::copyFile(int dstFd, int srcFd, off_t off, size_t sz) {
+  d_assert(off >= 0);
+
+#if defined(__APPLE__)
+  // fcopyfile copies the ENTIRE file (not a byte range), which is
+  // catastrophically slow when called per-span on a 2GB arena file.
+  return copyFileBuffered(dstFd, srcFd, off, sz);
 #else
-  errno = 0;
-  // sendfile will work with non-socket output (i.e. regular file) on Linux 2.6.33+
-  int result = sendfile(dstFd, srcFd, &off, sz);
+  // copy_file_range takes an explicit offset for both files (sendfile
+  // would write at dstFd's current file position), and may copy less
+  // than asked for, so loop until the whole range is done.
+  off_t srcOff = off;
+  off_t dstOff = off;
+  size_t remaining = sz;
+  while (remaining > 0) {
+    ssize_t copied = copy_file_range(srcFd, &srcOff, dstFd, &dstOff, remaining, 0);
+    if (copied < 0 && remaining == sz && (errno == ENOSYS || errno == EXDEV || errno == EINVAL)) {
+      return copyFileBuffered(dstFd, srcFd, off, sz);
+    } else if (copied <= 0) {
+      return -1;
+    }
+    remaining -= copied;
+  }
+  return sz;
 #endif
+}
 
-  return result;
+bool internal::writeAll(int fd, const void *buf, size_t len) {
+  const char *data = reinterpret_cast<const char *>(buf);
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
 }
 
 // Explicit instantiation of Runtime
@@ -66,6 +66,23 @@ public:
     _heap.setMeshPeriodMs(period);
   }
 
+  void setDirtyDecayMs(std::chrono::milliseconds window) {
+    _heap.setDirtyDecayMs(window);
+  }
+
+  void setLazyRelease(bool lazy) {
+    _heap.setLazyRelease(lazy);
+  }
+
+  // also makes the calling thread pick a new sample point right away;
+  // other threads notice within HeapProfiler::kDisabledCheckBytes
+  void setHeapProfileInterval(size_t interval);
+
+  // malloc_trim: the calling thread's cached miniheaps are given back
+  // too, but other threads' caches can't safely be touched.  Returns
+  // the number of bytes released.
+  size_t trim(std::chrono::milliseconds budget);
+
 #ifdef __linux__
   int epollWait(int __epfd, struct epoll_event *__events, int __maxevents, int __timeout);
   int epollPwait(int __epfd, struct epoll_event *__events, int __maxevents, int __timeout, const __sigset_t *__ss);
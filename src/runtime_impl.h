@@ -16,6 +16,7 @@
 #include <sys/types.h>
 
 #ifdef __linux__
+#include <poll.h>
 #include <sys/signalfd.h>
 #endif
 
@@ -116,6 +117,8 @@ void Runtime<PageSize>::createSignalFd() {
   sigset_t mask;
   sigemptyset(&mask);
   sigaddset(&mask, SIGDUMP);
+  sigaddset(&mask, SIGHEAPPROF);
+  sigaddset(&mask, SIGTRACE);
 
   /* Block signals so that they aren't handled
      according to their default dispositions */
@@ -157,7 +160,36 @@ void *Runtime<PageSize>::bgThread(void *arg) {
   // debug("libmesh: background thread started\n");
 
 #ifdef __linux__
+  auto lastPublish = std::chrono::steady_clock::now();
+
   while (true) {
+    // wake up a few times per decay window to purge old dirty pages,
+    // or block until a signal arrives if decay is disabled
+    const auto window = rt.heap().dirtyDecayMs();
+    int timeout = window == kZeroMs ? -1 : std::max<int64_t>(window.count() / kDirtyDecaySteps, 1);
+    if (rt.heap().hasStatsSegment()) {
+      const int statsTimeout = kStatsSegmentPeriodMs.count();
+      timeout = timeout < 0 ? statsTimeout : std::min(timeout, statsTimeout);
+    }
+
+    struct pollfd pfd = {rt._signalFd, POLLIN, 0};
+    int n = poll(&pfd, 1, timeout);
+    if (n < 0 && errno != EINTR) {
+      return nullptr;
+    }
+
+    rt.heap().decayDirty();
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now - lastPublish >= kStatsSegmentPeriodMs) {
+      rt.heap().publishStats();
+      lastPublish = now;
+    }
+
+    if (n <= 0 || !(pfd.revents & POLLIN)) {
+      continue;
+    }
+
     struct signalfd_siginfo siginfo;
 
     ssize_t s = read(rt._signalFd, &siginfo, sizeof(struct signalfd_siginfo));
@@ -172,12 +204,11 @@ void *Runtime<PageSize>::bgThread(void *arg) {
     }
 
     if (static_cast<int>(siginfo.ssi_signo) == SIGDUMP) {
-      // debug("libmesh: background thread received SIGDUMP, starting dump\n");
-      debug(">>>>>>>>>>\n");
-      rt.heap().dumpStrings();
-      // debug("<<<<<<<<<<\n");
-
-      // debug("<<<<<<<<<<\n");
+      rt.heap().dumpHeapToDefaultPath();
+    } else if (static_cast<int>(siginfo.ssi_signo) == SIGHEAPPROF) {
+      rt.heap().profiler().dumpToDefaultPath();
+    } else if (static_cast<int>(siginfo.ssi_signo) == SIGTRACE) {
+      trace::dumpToDefaultPath();
     } else {
       auto _ __attribute__((unused)) =
           write(STDERR_FILENO, "Read unexpected signal\n", strlen("Read unexpected signal\n"));
@@ -187,6 +218,26 @@ void *Runtime<PageSize>::bgThread(void *arg) {
   return nullptr;
 }
 
+template <size_t PageSize>
+void Runtime<PageSize>::setHeapProfileInterval(size_t interval) {
+  _heap.profiler().setInterval(interval);
+
+  auto heap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
+  if (heap != nullptr) {
+    heap->resetSampling();
+  }
+}
+
+template <size_t PageSize>
+size_t Runtime<PageSize>::trim(std::chrono::milliseconds budget) {
+  auto heap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
+  if (heap != nullptr) {
+    heap->releaseAll();
+  }
+
+  return _heap.trim(budget);
+}
+
 template <size_t PageSize>
 void Runtime<PageSize>::lock() {
   _mutex.lock();
@@ -322,9 +373,18 @@ void Runtime<PageSize>::segfaultHandler(int sig, siginfo_t *siginfo, void *conte
     isMeshingFault = true;
   }
 
-  if (isMeshingFault && runtime<PageSize>().heap().okToProceed(siginfo->si_addr)) {
-    // debug("TODO: trapped access violation from meshing, log stat\n");
-    return;
+  if (isMeshingFault) {
+    // okToProceed blocks until the mesh that write-protected the page
+    // is done
+    const auto start = std::chrono::steady_clock::now();
+    const bool ok = runtime<PageSize>().heap().okToProceed(siginfo->si_addr);
+    if (ok) {
+      const uint64_t ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+      MESH_TRACE(SegfaultWait, segfault_wait, reinterpret_cast<uintptr_t>(siginfo->si_addr), ns);
+      runtime<PageSize>().heap().recordMeshFault(ns);
+      return;
+    }
   }
 
   struct sigaction *action = nullptr;
@@ -218,6 +218,17 @@ public:
     }
   }
 
+  // free when the caller already knows mh's size class
+  inline void ATTRIBUTE_ALWAYS_INLINE sizedFree(MiniHeapT *mh, void *ptr, uint32_t sizeClass) {
+    const size_t off = mh->getUnmeshedOff(reinterpret_cast<const void *>(_arenaBegin), ptr, sizeClass);
+
+    if (likely(_off > 0)) {
+      push(sv::Entry{mh->svOffset(), static_cast<uint16_t>(off)});
+    } else {
+      freeFullSlowpath(mh, off);
+    }
+  }
+
   void ATTRIBUTE_NEVER_INLINE freeFullSlowpath(MiniHeapT *mh, size_t off) {
     mh->freeOff(off);
   }
@@ -71,6 +71,31 @@ inline float ATTRIBUTE_ALWAYS_INLINE getReciprocal(uint32_t sizeClass) {
 
 }  // namespace float_recip
 
+// Integer reciprocals, ceil(2^32 / object_size), for the sized free
+// path.  (offset * m) >> 32 is exactly offset / object_size for every
+// offset inside a span: the rounding error m * size - 2^32 is 0 for
+// power-of-two sizes and below 1024 for the others, so the result is
+// exact for offsets below 2^22.
+namespace int_recip {
+
+inline constexpr uint64_t computeMagic(uint32_t objectSize) {
+  return ((1ULL << 32) + objectSize - 1) / objectSize;
+}
+
+inline constexpr uint64_t kMagic[kClassSizesMax] = {
+    computeMagic(16),   computeMagic(16),   computeMagic(32),   computeMagic(48),   computeMagic(64),
+    computeMagic(80),   computeMagic(96),   computeMagic(112),  computeMagic(128),  computeMagic(160),
+    computeMagic(192),  computeMagic(224),  computeMagic(256),  computeMagic(320),  computeMagic(384),
+    computeMagic(448),  computeMagic(512),  computeMagic(640),  computeMagic(768),  computeMagic(896),
+    computeMagic(1024), computeMagic(2048), computeMagic(4096), computeMagic(8192), computeMagic(16384),
+};
+
+inline size_t ATTRIBUTE_ALWAYS_INLINE computeIndex(size_t byteOffset, uint32_t sizeClass) {
+  return static_cast<size_t>((byteOffset * kMagic[sizeClass]) >> 32);
+}
+
+}  // namespace int_recip
+
 }  // namespace mesh
 
 #endif  // MESH_SIZE_CLASS_RECIPROCALS_H
@@ -0,0 +1,84 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_STATS_SEGMENT_H
+#define MESH_STATS_SEGMENT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace mesh {
+
+// With MESH_STATS_SEGMENT=1, the background thread periodically
+// publishes heap statistics into a memfd named kStatsSegmentName.
+// Monitors (see meshtop.cc) find it through /proc/<pid>/fd and map it
+// read-only, so reading stats never signals or stops the process.
+//
+// Updates are guarded by a sequence lock: seq is odd while the writer
+// is copying in a new snapshot, so readers copy the whole segment and
+// retry if seq was odd or changed underneath them.
+
+static constexpr char kStatsSegmentName[] = "mesh-stats";
+static constexpr char kStatsSegmentMagic[8] = {'M', 'E', 'S', 'H', 'S', 'T', 'A', 'T'};
+static constexpr uint32_t kStatsSegmentVersion = 1;
+static constexpr size_t kStatsSegmentMaxBins = 32;
+
+struct StatsSegmentSizeClass {
+  uint64_t objectSize;
+  uint64_t spanSize;
+  uint64_t inUseObjects;
+  uint64_t inUseBytes;
+  uint64_t spans;
+  uint64_t emptySpans;
+  uint64_t partialSpans;
+  uint64_t fullSpans;
+  uint64_t attachedSpans;
+  uint64_t meshedSpans;
+  uint64_t meshCount;
+};
+
+struct StatsSegment {
+  char magic[8];
+  uint32_t version;
+  uint32_t pageSize;
+  uint32_t pid;
+  uint32_t binCount;
+  std::atomic<uint64_t> seq;
+  uint64_t updateCount;
+  uint64_t timestampNs;  // CLOCK_REALTIME of the last update
+
+  // whole heap, in bytes
+  uint64_t rss;
+  uint64_t mapped;
+  uint64_t dirty;
+  uint64_t allocated;
+  uint64_t active;
+  uint64_t metadata;
+  uint64_t largeCount;
+  uint64_t largeBytes;
+
+  // meshing: meshedPages share physical memory with another span, so
+  // meshedPages * pageSize is the current RSS savings
+  uint64_t meshedPages;
+  uint64_t meshedPagesHWM;
+  uint64_t meshCount;
+  uint64_t meshPassCount;
+  uint64_t meshPassLastNs;
+  uint64_t meshPassTotalNs;
+  uint64_t meshPassMaxNs;
+
+  uint64_t scavengeCount;
+  uint64_t scavengedPages;
+
+  StatsSegmentSizeClass sizeClasses[kStatsSegmentMaxBins];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "seq must be usable across processes");
+
+}  // namespace mesh
+
+#endif  // MESH_STATS_SEGMENT_H
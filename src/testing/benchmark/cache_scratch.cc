@@ -0,0 +1,50 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// cache-scratch from the Hoard benchmarks, which tests for passive
+// false sharing: the main thread allocates one small object per
+// thread, so they likely share a cache line, and hands them out.  Each
+// thread frees its object and then repeatedly allocates a small object,
+// writes it many times and frees it.  An allocator that gives a thread
+// back memory from a cache line another thread is writing slows every
+// write down.  Ops are mallocs plus frees.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "stress.h"
+
+static constexpr size_t kIterations = 100000;
+static constexpr size_t kRepetitions = 100;
+static constexpr size_t kObjectSize = 8;
+
+static uint64_t cacheScratch(int threads, const stress::Options &options) {
+  const size_t iterations = kIterations * options.scale / threads;
+
+  std::vector<char *> initial(threads);
+  for (int i = 0; i < threads; i++) {
+    initial[i] = static_cast<char *>(malloc(kObjectSize));
+  }
+
+  stress::runThreads(threads, [&](int id) {
+    free(initial[id]);
+    for (size_t n = 0; n < iterations; n++) {
+      volatile char *object = static_cast<char *>(malloc(kObjectSize));
+      for (size_t r = 0; r < kRepetitions; r++) {
+        for (size_t i = 0; i < kObjectSize; i++) {
+          object[i] = static_cast<char>(object[i] + 1);
+        }
+      }
+      free(const_cast<char *>(object));
+    }
+  });
+
+  return threads + 2 * iterations * threads;
+}
+
+int main(int argc, char *argv[]) {
+  return stress::main(argc, argv, "cache-scratch", cacheScratch);
+}
@@ -0,0 +1,69 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Measures fork() latency as a function of heap size.  The child gets
+// its own copy of the arena before fork returns in the parent, so this
+// is dominated by MeshableArena::afterForkChild.  The second argument
+// selects a contiguous heap (0), or one where every other 64KB object
+// has been freed (1), so the live heap is made up of many short runs.
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "common.h"
+
+extern "C" {
+void *mesh_malloc(size_t sz);
+void mesh_free(void *ptr);
+}
+
+static void BM_Fork(benchmark::State &state) {
+  constexpr size_t kObjectSize = 64 * 1024;
+  const size_t heapSize = static_cast<size_t>(state.range(0)) << 20;
+
+  const bool fragmented = state.range(1) != 0;
+
+  std::vector<void *> objects((fragmented ? 2 : 1) * heapSize / kObjectSize);
+  for (auto &ptr : objects) {
+    ptr = mesh_malloc(kObjectSize);
+    memset(ptr, 'x', kObjectSize);
+  }
+  if (fragmented) {
+    for (size_t i = 0; i < objects.size(); i += 2) {
+      mesh_free(objects[i]);
+      objects[i] = nullptr;
+    }
+  }
+
+  for (auto _ : state) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      _exit(0);
+    }
+    hard_assert(pid > 0);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    hard_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  for (auto ptr : objects) {
+    mesh_free(ptr);
+  }
+
+  state.counters["heap_mb"] = state.range(0);
+}
+BENCHMARK(BM_Fork)
+    ->RangeMultiplier(4)
+    ->Ranges({{16, 1024}, {0, 1}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -2,11 +2,13 @@
 
 #include <benchmark/benchmark.h>
 #include <stdlib.h>
+#include <new>
 #include <vector>
 
 extern "C" {
 void *mesh_malloc(size_t sz);
 void mesh_free(void *ptr);
+void mesh_sized_free(void *ptr, size_t sz);
 }
 
 static void BM_MallocFree(benchmark::State &state) {
@@ -18,5 +20,57 @@ static void BM_MallocFree(benchmark::State &state) {
   }
 }
 
+static void BM_MallocSizedFree(benchmark::State &state) {
+  const size_t size = state.range(0);
+  for (auto _ : state) {
+    void *ptr = mesh_malloc(size);
+    benchmark::DoNotOptimize(ptr);
+    mesh_sized_free(ptr, size);
+  }
+}
+
+// frees a batch in allocation order rather than straight after each
+// malloc, so frees don't always hit the object just allocated
+template <bool Sized>
+static void BM_NewDeleteBatch(benchmark::State &state) {
+  const size_t size = state.range(0);
+  std::vector<void *> ptrs(1024);
+  for (auto _ : state) {
+    for (auto &ptr : ptrs) {
+      ptr = ::operator new(size);
+    }
+    benchmark::DoNotOptimize(ptrs.data());
+    for (void *ptr : ptrs) {
+      if (Sized) {
+        ::operator delete(ptr, size);
+      } else {
+        ::operator delete(ptr);
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * ptrs.size());
+}
+
+// a few live mid-size (16KB-256KB) objects per thread, replaced in
+// turn, so frees and mallocs alternate across page counts
+static void BM_MidSizeChurn(benchmark::State &state) {
+  const size_t size = state.range(0);
+  void *live[4] = {};
+  size_t i = 0;
+  for (auto _ : state) {
+    void *&slot = live[i++ % 4];
+    mesh_free(slot);
+    slot = mesh_malloc(size + (i % 3) * 4096);
+    benchmark::DoNotOptimize(slot);
+  }
+  for (void *ptr : live) {
+    mesh_free(ptr);
+  }
+}
+
 // Register the benchmark with different sizes
 BENCHMARK(BM_MallocFree)->Range(16, 4096);
+BENCHMARK(BM_MallocSizedFree)->Range(16, 4096);
+BENCHMARK_TEMPLATE(BM_NewDeleteBatch, false)->Range(16, 4096);
+BENCHMARK_TEMPLATE(BM_NewDeleteBatch, true)->Range(16, 4096);
+BENCHMARK(BM_MidSizeChurn)->RangeMultiplier(4)->Range(20 << 10, 200 << 10)->ThreadRange(1, 4);
@@ -0,0 +1,370 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Measures what meshing costs the application's threads.  It builds a
+// fragmented heap (objects of one size, most of them freed at random),
+// then runs, for --seconds:
+//
+//  - writer threads, which write to random surviving objects.  A write
+//    to a span that is being meshed faults, and the segfault handler
+//    waits for the mesh to finish.
+//  - allocator threads, which keep re-fragmenting the heap (allocate a
+//    batch, keep a quarter of it for a while), so that every mesh pass
+//    has work to do.  They stall on the size class locks a pass holds.
+//  - a mesher thread, which runs mesh.compact every --period-ms.
+//
+// It reports a histogram of mesh pass times (how long every heap lock
+// is held), the faults taken on meshing spans and the time spent
+// waiting in the handler, and each thread's operation latency
+// percentiles, where stalls show up in the tail.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "plasma/mesh.h"
+
+using std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+  size_t heapMb{64};
+  size_t objectSize{256};
+  int writers{2};
+  int allocators{2};
+  int periodMs{100};
+  int seconds{5};
+};
+
+// log-linear buckets: 4 per power of two, so percentiles are within 25%
+class Histogram {
+public:
+  static constexpr size_t kSubBits = 2;
+  static constexpr size_t kBuckets = 64 << kSubBits;
+
+  void add(uint64_t ns) {
+    _buckets[bucketFor(ns)]++;
+    _count++;
+    _max = std::max(_max, ns);
+  }
+
+  void merge(const Histogram &other) {
+    for (size_t i = 0; i < kBuckets; i++) {
+      _buckets[i] += other._buckets[i];
+    }
+    _count += other._count;
+    _max = std::max(_max, other._max);
+  }
+
+  uint64_t count() const {
+    return _count;
+  }
+
+  uint64_t max() const {
+    return _max;
+  }
+
+  // upper bound of the bucket holding the given percentile
+  uint64_t percentile(double p) const {
+    const uint64_t rank = static_cast<uint64_t>(p / 100.0 * _count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+      seen += _buckets[i];
+      if (seen > rank) {
+        return std::min(upperBound(i), _max);
+      }
+    }
+    return _max;
+  }
+
+  // one line per power of two that has samples
+  void print(const char *unit, double divisor) const {
+    uint64_t powers[64] = {};
+    for (size_t i = 0; i < kBuckets; i++) {
+      powers[i >> kSubBits] += _buckets[i];
+    }
+    for (size_t i = 0; i < 64; i++) {
+      if (powers[i] == 0) {
+        continue;
+      }
+      // group i holds [2^(i+1), 2^(i+2)), except group 0 is [0, 4)
+      const double lo = i == 0 ? 0 : ldexp(1.0, i + 1) / divisor;
+      const double hi = ldexp(1.0, i + 2) / divisor;
+      const int bar = static_cast<int>(50.0 * powers[i] / _count + 0.5);
+      printf("  %10.3f - %10.3f %s %8llu %.*s\n", lo, hi, unit, static_cast<unsigned long long>(powers[i]), bar,
+             "##################################################");
+    }
+  }
+
+private:
+  static size_t bucketFor(uint64_t ns) {
+    if (ns < (1 << kSubBits)) {
+      return ns;
+    }
+    const size_t log = 63 - __builtin_clzll(ns);
+    const size_t sub = (ns >> (log - kSubBits)) & ((1 << kSubBits) - 1);
+    return ((log - kSubBits + 1) << kSubBits) | sub;
+  }
+
+  static uint64_t upperBound(size_t bucket) {
+    if (bucket < (1 << kSubBits)) {
+      return bucket;
+    }
+    const size_t log = (bucket >> kSubBits) + kSubBits - 1;
+    const size_t sub = bucket & ((1 << kSubBits) - 1);
+    return (1ULL << log) + ((sub + 1) << (log - kSubBits)) - 1;
+  }
+
+  uint64_t _buckets[kBuckets]{};
+  uint64_t _count{0};
+  uint64_t _max{0};
+};
+
+std::atomic<bool> Done{false};
+
+uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+size_t mallctlSize(const char *name) {
+  size_t value = 0;
+  size_t len = sizeof(value);
+  if (mesh_mallctl(name, &value, &len, nullptr, 0) != 0) {
+    return 0;
+  }
+  return value;
+}
+
+// xorshift64*
+uint64_t nextRandom(uint64_t &state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+void writer(int id, const std::vector<char *> &objects, size_t objectSize, Histogram &latency) {
+  uint64_t rng = id + 1;
+  while (!Done.load(std::memory_order_relaxed)) {
+    char *object = objects[nextRandom(rng) % objects.size()];
+    const uint64_t start = nowNs();
+    memset(object, static_cast<int>(start), std::min<size_t>(objectSize, 64));
+    latency.add(nowNs() - start);
+  }
+}
+
+void allocator(int id, size_t objectSize, Histogram &latency) {
+  constexpr size_t kBatch = 4096;
+  constexpr size_t kGenerations = 8;
+
+  uint64_t rng = 1000 + id;
+  std::vector<std::vector<char *>> generations(kGenerations);
+  std::vector<char *> batch(kBatch);
+
+  for (size_t gen = 0; !Done.load(std::memory_order_relaxed); gen = (gen + 1) % kGenerations) {
+    for (char *object : generations[gen]) {
+      const uint64_t start = nowNs();
+      free(object);
+      latency.add(nowNs() - start);
+    }
+    generations[gen].clear();
+
+    for (auto &object : batch) {
+      const uint64_t start = nowNs();
+      object = static_cast<char *>(malloc(objectSize));
+      *object = 1;
+      latency.add(nowNs() - start);
+    }
+    // keep a random quarter, leaving the batch's spans sparse
+    for (char *object : batch) {
+      if (nextRandom(rng) % 4 == 0) {
+        generations[gen].push_back(object);
+      } else {
+        const uint64_t start = nowNs();
+        free(object);
+        latency.add(nowNs() - start);
+      }
+    }
+  }
+
+  for (auto &generation : generations) {
+    for (char *object : generation) {
+      free(object);
+    }
+  }
+}
+
+void mesher(int periodMs, Histogram &passes, Histogram &compacts) {
+  while (!Done.load(std::memory_order_relaxed)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(periodMs));
+
+    const size_t passesBefore = mallctlSize("stats.mesh_passes");
+    const uint64_t start = nowNs();
+    size_t unused = 0;
+    size_t len = sizeof(unused);
+    mesh_mallctl("mesh.compact", &unused, &len, nullptr, 0);
+    compacts.add(nowNs() - start);
+
+    // a pass that found nothing to mesh isn't counted or timed
+    if (mallctlSize("stats.mesh_passes") != passesBefore) {
+      passes.add(mallctlSize("stats.mesh_pass_last_ns"));
+    }
+  }
+}
+
+void printPercentiles(const char *name, int id, const Histogram &h) {
+  printf("  %-9s %2d %10llu %9.2f %9.2f %9.2f %9.2f %10.2f\n", name, id, static_cast<unsigned long long>(h.count()),
+         h.percentile(50) / 1000.0, h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+         h.percentile(99.99) / 1000.0, h.max() / 1000.0);
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--heap-mb=64] [--object-size=256] [--writers=2] [--allocators=2] [--period-ms=100] "
+          "[--seconds=5]\n",
+          argv0);
+  exit(2);
+}
+
+Options parseOptions(int argc, char *argv[]) {
+  static const struct option kLongOptions[] = {
+      {"heap-mb", required_argument, nullptr, 'h'},   {"object-size", required_argument, nullptr, 'o'},
+      {"writers", required_argument, nullptr, 'w'},   {"allocators", required_argument, nullptr, 'a'},
+      {"period-ms", required_argument, nullptr, 'p'}, {"seconds", required_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  Options options;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h:o:w:a:p:s:", kLongOptions, nullptr)) != -1) {
+    switch (opt) {
+    case 'h':
+      options.heapMb = atol(optarg);
+      break;
+    case 'o':
+      options.objectSize = atol(optarg);
+      break;
+    case 'w':
+      options.writers = atoi(optarg);
+      break;
+    case 'a':
+      options.allocators = atoi(optarg);
+      break;
+    case 'p':
+      options.periodMs = atoi(optarg);
+      break;
+    case 's':
+      options.seconds = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc || options.heapMb == 0 || options.objectSize == 0 || options.writers < 0 ||
+      options.allocators < 0 || options.periodMs <= 0 || options.seconds <= 0) {
+    usage(argv[0]);
+  }
+  return options;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const Options options = parseOptions(argc, argv);
+
+  // fill the heap, then free three quarters of it at random
+  const size_t count = options.heapMb * 1024 * 1024 / options.objectSize;
+  std::vector<char *> all(count);
+  for (auto &object : all) {
+    object = static_cast<char *>(malloc(options.objectSize));
+    memset(object, 'x', options.objectSize);
+  }
+  uint64_t rng = 42;
+  std::vector<char *> survivors;
+  survivors.reserve(count / 4 + 1);
+  for (char *object : all) {
+    if (nextRandom(rng) % 4 == 0) {
+      survivors.push_back(object);
+    } else {
+      free(object);
+    }
+  }
+  std::vector<char *>().swap(all);
+  printf("heap: %zu objects of %zu bytes, %zu survive\n", count, options.objectSize, survivors.size());
+
+  const size_t meshesBefore = mallctlSize("stats.mesh_count");
+  const size_t faultsBefore = mallctlSize("stats.mesh_faults");
+  const size_t faultWaitBefore = mallctlSize("stats.mesh_fault_wait_ns");
+
+  std::vector<Histogram> writerLatency(options.writers);
+  std::vector<Histogram> allocatorLatency(options.allocators);
+  Histogram passes;
+  Histogram compacts;
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < options.writers; i++) {
+    threads.emplace_back(writer, i, std::cref(survivors), options.objectSize, std::ref(writerLatency[i]));
+  }
+  for (int i = 0; i < options.allocators; i++) {
+    threads.emplace_back(allocator, i, options.objectSize, std::ref(allocatorLatency[i]));
+  }
+  threads.emplace_back(mesher, options.periodMs, std::ref(passes), std::ref(compacts));
+
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  Done.store(true);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  const size_t faults = mallctlSize("stats.mesh_faults") - faultsBefore;
+  const size_t faultWaitNs = mallctlSize("stats.mesh_fault_wait_ns") - faultWaitBefore;
+
+  printf("\nmesh passes: %llu (%zu spans meshed), p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+         static_cast<unsigned long long>(passes.count()), mallctlSize("stats.mesh_count") - meshesBefore,
+         passes.percentile(50) / 1e6, passes.percentile(99) / 1e6, passes.max() / 1e6);
+  passes.print("ms", 1e6);
+  printf("mesh.compact calls (mesh + scavenge): %llu, p50 %.3f ms, max %.3f ms\n",
+         static_cast<unsigned long long>(compacts.count()), compacts.percentile(50) / 1e6, compacts.max() / 1e6);
+
+  printf("\nfaults on meshing spans: %zu, waited %.3f ms total (%.3f us each), max %.3f ms\n", faults,
+         faultWaitNs / 1e6, faults ? faultWaitNs / 1e3 / faults : 0.0,
+         mallctlSize("stats.mesh_fault_max_wait_ns") / 1e6);
+
+  printf("\nper-thread operation latency (us):\n");
+  printf("  %-9s %2s %10s %9s %9s %9s %9s %10s\n", "thread", "", "ops", "p50", "p99", "p99.9", "p99.99", "max");
+  Histogram writersAll;
+  for (int i = 0; i < options.writers; i++) {
+    printPercentiles("writer", i, writerLatency[i]);
+    writersAll.merge(writerLatency[i]);
+  }
+  Histogram allocatorsAll;
+  for (int i = 0; i < options.allocators; i++) {
+    printPercentiles("allocator", i, allocatorLatency[i]);
+    allocatorsAll.merge(allocatorLatency[i]);
+  }
+  if (options.writers > 0) {
+    printf("\nwriter latency:\n");
+    writersAll.print("us", 1e3);
+  }
+  if (options.allocators > 0) {
+    printf("\nallocator latency:\n");
+    allocatorsAll.print("us", 1e3);
+  }
+
+  for (char *object : survivors) {
+    free(object);
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Measures page-fault throughput on arena memory with many threads
+// faulting concurrently.  Each pass touches every page of a
+// thread-private buffer, then drops the pages and punches a hole in
+// the backing file so the next pass faults them in again.  Compare a
+// default build against --config=sharded-arena to see the effect of
+// spreading the arena across several memfds.
+
+#include <sys/mman.h>
+
+#include <benchmark/benchmark.h>
+
+#include "internal.h"
+#include "runtime.h"
+
+using namespace mesh;
+
+extern "C" {
+void *mesh_malloc(size_t sz);
+void mesh_free(void *ptr);
+}
+
+template <size_t PageSize>
+static void BM_PageFaultImpl(benchmark::State &state) {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  const size_t sz = state.range(0);
+
+  char *buf = reinterpret_cast<char *>(mesh_malloc(sz));
+  hard_assert(gheap.contains(buf));
+  hard_assert(reinterpret_cast<uintptr_t>(buf) % PageSize == 0);
+
+  size_t pageCount = 0;
+  for (auto _ : state) {
+    for (size_t off = 0; off < sz; off += PageSize) {
+      buf[off] = 'x';
+    }
+    benchmark::ClobberMemory();
+
+    madvise(buf, sz, MADV_DONTNEED);
+    gheap.freePhys(buf, sz);
+    pageCount += sz / PageSize;
+  }
+
+  mesh_free(buf);
+
+  state.SetItemsProcessed(pageCount);
+  state.SetBytesProcessed(pageCount * PageSize);
+}
+
+static void BM_PageFault(benchmark::State &state) {
+  if (getPageSize() == kPageSize4K) {
+    BM_PageFaultImpl<kPageSize4K>(state);
+  } else {
+    BM_PageFaultImpl<kPageSize16K>(state);
+  }
+}
+BENCHMARK(BM_PageFault)->Arg(4 << 20)->Arg(32 << 20)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK_MAIN();
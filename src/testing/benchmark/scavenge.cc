@@ -0,0 +1,68 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Measures the cost of returning dirty pages to the OS.  Each pass
+// frees every other span of a run of large allocations (so the freed
+// spans can't coalesce), then times a forced scavenge.  The
+// "syscalls" counter reports how many madvise/fallocate/process_madvise
+// calls each scavenge needed.
+
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "internal.h"
+#include "runtime.h"
+
+using namespace mesh;
+
+template <size_t PageSize>
+static void BM_ScavengeImpl(benchmark::State &state) {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  gheap.setMeshPeriodMs(kZeroMs);
+
+  const size_t spanCount = state.range(0);
+  const size_t spanSize = 8 * PageSize;
+
+  internal::vector<char *> spans(2 * spanCount);
+  const size_t syscallsBefore = gheap.scavengeStats().syscalls;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (auto &ptr : spans) {
+      ptr = reinterpret_cast<char *>(gheap.malloc(spanSize));
+      memset(ptr, 'x', spanSize);
+    }
+    for (size_t i = 0; i < spans.size(); i += 2) {
+      gheap.free(spans[i]);
+    }
+    state.ResumeTiming();
+
+    gheap.scavenge(true);
+
+    state.PauseTiming();
+    for (size_t i = 1; i < spans.size(); i += 2) {
+      gheap.free(spans[i]);
+    }
+    gheap.scavenge(true);
+    state.ResumeTiming();
+  }
+
+  // includes the untimed cleanup scavenge
+  const size_t syscalls = gheap.scavengeStats().syscalls - syscallsBefore;
+  state.counters["syscalls"] = benchmark::Counter(syscalls, benchmark::Counter::kAvgIterations);
+  state.SetItemsProcessed(state.iterations() * spanCount);
+}
+
+static void BM_Scavenge(benchmark::State &state) {
+  if (getPageSize() == kPageSize4K) {
+    BM_ScavengeImpl<kPageSize4K>(state);
+  } else {
+    BM_ScavengeImpl<kPageSize16K>(state);
+  }
+}
+BENCHMARK(BM_Scavenge)->Arg(16)->Arg(256)->Arg(1024)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,62 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// A workload in the style of MicroQuill's shbench (whose source can't
+// be redistributed): each thread keeps a table of objects of widely
+// varying sizes, biased towards small ones, and repeatedly frees and
+// replaces alternating entries before releasing the whole table in
+// reverse order, so objects of different lifetimes end up
+// interleaved.  Ops are mallocs plus frees.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "stress.h"
+
+static constexpr size_t kIterations = 100;
+static constexpr size_t kSlots = 20000;
+static constexpr size_t kReplacePasses = 4;
+
+static size_t shbenchSize(stress::Rng &rng) {
+  // like shbench, sizes are skewed towards the small end of 1..1000
+  const uint64_t r = rng.next();
+  return 1 + (r >> 8) % ((r & 3) ? 64 : 1000);
+}
+
+static uint64_t shbench(int threads, const stress::Options &options) {
+  const size_t iterations = kIterations * options.scale;
+  std::atomic<uint64_t> ops{0};
+
+  stress::runThreads(threads, [&](int id) {
+    stress::Rng rng(id);
+    std::vector<void *> slots(kSlots);
+    uint64_t myOps = 0;
+
+    for (size_t n = 0; n < iterations; n++) {
+      for (size_t i = 0; i < kSlots; i++) {
+        slots[i] = malloc(shbenchSize(rng));
+      }
+      for (size_t pass = 0; pass < kReplacePasses; pass++) {
+        for (size_t i = pass % 2; i < kSlots; i += 2) {
+          free(slots[i]);
+          slots[i] = malloc(shbenchSize(rng));
+        }
+      }
+      for (size_t i = kSlots; i > 0; i--) {
+        free(slots[i - 1]);
+      }
+      myOps += 2 * kSlots + kReplacePasses * kSlots;
+    }
+
+    ops += myOps;
+  });
+
+  return ops;
+}
+
+int main(int argc, char *argv[]) {
+  return stress::main(argc, argv, "shbench", shbench);
+}
@@ -0,0 +1,76 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Measures posix_spawn rate while other threads allocate and free in a
+// tight loop.  Besides spawns per second, "allocs" reports how many
+// malloc/free pairs the allocating threads completed per second, which
+// drops if spawning stalls the heap.  Run with MESH_SPAWN_LOCK=1 to
+// compare against holding every heap lock across the spawn.
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "common.h"
+
+extern "C" {
+void *mesh_malloc(size_t sz);
+void mesh_free(void *ptr);
+}
+
+static void BM_SpawnWithAllocators(benchmark::State &state) {
+  const size_t workerCount = state.range(0);
+
+  std::atomic<bool> stop{false};
+  std::atomic<size_t> allocCount{0};
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < workerCount; i++) {
+    workers.emplace_back([&stop, &allocCount]() {
+      size_t count = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (size_t sz = 16; sz <= 4096; sz *= 2) {
+          void *ptr = mesh_malloc(sz);
+          memset(ptr, 0, 16);
+          mesh_free(ptr);
+          count++;
+        }
+      }
+      allocCount += count;
+    });
+  }
+
+  char arg0[] = "true";
+  char *const argv[] = {arg0, nullptr};
+  const auto start = std::chrono::steady_clock::now();
+
+  for (auto _ : state) {
+    pid_t pid = 0;
+    int ret = posix_spawnp(&pid, "true", nullptr, nullptr, argv, environ);
+    hard_assert(ret == 0);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+  }
+
+  stop = true;
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  state.counters["allocs"] = benchmark::Counter(allocCount / seconds);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SpawnWithAllocators)->Arg(0)->Arg(1)->Arg(4)->Arg(8)->UseRealTime();
+
+BENCHMARK_MAIN();
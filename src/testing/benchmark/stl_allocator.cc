@@ -0,0 +1,127 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Container churn with mesh::allocator and mesh::MemoryResource
+// (plasma/mesh_allocator.h) against std::allocator, which reaches the
+// same heaps through operator new, and the default pmr resource.
+// libstdc++ grows vectors with memmove only for std::allocator; with
+// any other allocator it moves elements one by one, so for long
+// vectors compare mesh::allocator with the pmr rows.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "plasma/mesh_allocator.h"
+
+namespace {
+
+constexpr size_t kKeys = 16384;
+
+// xorshift64, so the key sequence doesn't depend on the allocator
+inline uint64_t nextKey(uint64_t &state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+template <template <typename> class Alloc>
+using Map = std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                               Alloc<std::pair<const uint64_t, uint64_t>>>;
+
+// fill a map, then replace a random half of it each iteration, so that
+// every iteration frees and allocates kKeys / 2 nodes
+template <typename MapT>
+void unorderedMapChurn(benchmark::State &state, MapT &map) {
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+  std::vector<uint64_t> keys;
+  keys.reserve(kKeys);
+  for (size_t i = 0; i < kKeys; i++) {
+    keys.push_back(nextKey(seed));
+    map.emplace(keys.back(), i);
+  }
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < kKeys / 2; i++) {
+      uint64_t &key = keys[nextKey(seed) % kKeys];
+      map.erase(key);
+      key = nextKey(seed);
+      map.emplace(key, i);
+    }
+    benchmark::DoNotOptimize(map.size());
+  }
+  state.SetItemsProcessed(state.iterations() * kKeys / 2);
+}
+
+template <template <typename> class Alloc>
+void BM_UnorderedMapChurn(benchmark::State &state) {
+  Map<Alloc> map;
+  unorderedMapChurn(state, map);
+}
+
+void BM_UnorderedMapChurnPmrDefault(benchmark::State &state) {
+  std::pmr::unordered_map<uint64_t, uint64_t> map(std::pmr::get_default_resource());
+  unorderedMapChurn(state, map);
+}
+
+void BM_UnorderedMapChurnPmrMesh(benchmark::State &state) {
+  std::pmr::unordered_map<uint64_t, uint64_t> map(mesh::memoryResource());
+  unorderedMapChurn(state, map);
+}
+
+// build short-lived vectors by push_back, so each goes through a run
+// of growing reallocations, then free them
+template <typename VectorT, typename... Args>
+void vectorChurn(benchmark::State &state, Args... args) {
+  const size_t length = state.range(0);
+  std::vector<VectorT> live;
+  live.reserve(64);
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < 64; i++) {
+      live.emplace_back(args...);
+      VectorT &v = live.back();
+      for (size_t j = 0; j < length; j++) {
+        v.push_back(static_cast<int>(j));
+      }
+    }
+    benchmark::DoNotOptimize(live.data());
+    live.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * 64);
+}
+
+template <template <typename> class Alloc>
+void BM_VectorChurn(benchmark::State &state) {
+  vectorChurn<std::vector<int, Alloc<int>>>(state);
+}
+
+void BM_VectorChurnPmrDefault(benchmark::State &state) {
+  vectorChurn<std::pmr::vector<int>>(state, std::pmr::get_default_resource());
+}
+
+void BM_VectorChurnPmrMesh(benchmark::State &state) {
+  vectorChurn<std::pmr::vector<int>>(state, static_cast<std::pmr::memory_resource *>(mesh::memoryResource()));
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_UnorderedMapChurn, std::allocator);
+BENCHMARK_TEMPLATE(BM_UnorderedMapChurn, mesh::allocator);
+BENCHMARK(BM_UnorderedMapChurnPmrDefault);
+BENCHMARK(BM_UnorderedMapChurnPmrMesh);
+
+BENCHMARK_TEMPLATE(BM_VectorChurn, std::allocator)->Range(8, 4096);
+BENCHMARK_TEMPLATE(BM_VectorChurn, mesh::allocator)->Range(8, 4096);
+BENCHMARK(BM_VectorChurnPmrDefault)->Range(8, 4096);
+BENCHMARK(BM_VectorChurnPmrMesh)->Range(8, 4096);
+
+BENCHMARK_MAIN();
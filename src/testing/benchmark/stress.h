@@ -0,0 +1,275 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Shared driver for the multithreaded stress workloads (xmalloc,
+// threadtest, shbench, cache-scratch, string-frag).  Each workload is
+// a function that runs with a given number of threads and returns how
+// many allocator operations it did; the driver runs it at 1, 2, 4, ...
+// up to --threads, sampling RSS in the background, and writes one JSON
+// document with throughput, RSS over time, peak RSS and Mesh's mesh
+// and scavenge counters for every thread count:
+//
+//   {"benchmark": "xmalloc", "results": [{"threads": 1, "seconds": ...,
+//     "ops": ..., "ops_per_sec": ..., "base_rss_kb": ..., "peak_rss_kb": ...,
+//     "rss_kb": [[ms, kb], ...], "mesh_count": ..., "mesh_passes": ...,
+//     "scavenge_count": ...}, ...]}
+
+#pragma once
+#ifndef MESH_TESTING_BENCHMARK_STRESS_H
+#define MESH_TESTING_BENCHMARK_STRESS_H
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "measure_rss.h"
+#include "plasma/mesh.h"
+
+namespace stress {
+
+struct Options {
+  int maxThreads{0};  // default: hardware threads
+  // multiplies each workload's amount of work
+  double scale{1.0};
+  int sampleMs{10};
+  const char *output{nullptr};  // default: stdout
+};
+
+// returns the number of allocator operations done
+using Workload = std::function<uint64_t(int threads, const Options &options)>;
+
+// xorshift64*, so that runs are reproducible and the RNG never allocates
+class Rng {
+public:
+  explicit Rng(uint64_t seed) : _state(seed * 0x9e3779b97f4a7c15ULL + 1) {
+  }
+
+  uint64_t next() {
+    _state ^= _state >> 12;
+    _state ^= _state << 25;
+    _state ^= _state >> 27;
+    return _state * 0x2545f4914f6cdd1dULL;
+  }
+
+  // uniform in [lo, hi]
+  size_t inRange(size_t lo, size_t hi) {
+    return lo + next() % (hi - lo + 1);
+  }
+
+private:
+  uint64_t _state;
+};
+
+// runs fn(threadIndex) on `threads` threads, released together
+inline void runThreads(int threads, const std::function<void(int)> &fn) {
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  workers.reserve(threads);
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back([&go, &fn, i]() {
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      fn(i);
+    });
+  }
+  go.store(true, std::memory_order_release);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+inline size_t mallctlSize(const char *name) {
+  size_t value = 0;
+  size_t len = sizeof(value);
+  if (mesh_mallctl(name, &value, &len, nullptr, 0) != 0) {
+    return 0;
+  }
+  return value;
+}
+
+// samples RSS every sampleMs until stopped
+class RssSampler {
+public:
+  explicit RssSampler(int sampleMs) : _start(std::chrono::steady_clock::now()) {
+    sample();
+    _thread = std::thread([this, sampleMs]() {
+      std::unique_lock<std::mutex> lock(_lock);
+      while (!_cv.wait_for(lock, std::chrono::milliseconds(sampleMs), [this]() { return _done; })) {
+        lock.unlock();
+        sample();
+        lock.lock();
+      }
+    });
+  }
+
+  ~RssSampler() {
+    stop();
+  }
+
+  void stop() {
+    if (!_thread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _done = true;
+    }
+    _cv.notify_one();
+    _thread.join();
+    sample();
+  }
+
+  // (ms since start, kB); only valid after stop()
+  const std::vector<std::pair<long, int>> &samples() const {
+    return _samples;
+  }
+
+  int peakKb() const {
+    int peak = 0;
+    for (const auto &sample : _samples) {
+      peak = sample.second > peak ? sample.second : peak;
+    }
+    return peak;
+  }
+
+private:
+  void sample() {
+    const int rss = get_rss_kb();
+    const auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _start).count();
+    _samples.emplace_back(ms, rss);
+  }
+
+  const std::chrono::steady_clock::time_point _start;
+  std::thread _thread{};
+  std::mutex _lock{};
+  std::condition_variable _cv{};
+  bool _done{false};
+  std::vector<std::pair<long, int>> _samples{};
+};
+
+inline void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [--threads=N] [--scale=X] [--sample-ms=MS] [--output=FILE]\n", argv0);
+  fprintf(stderr, "  --threads    run at 1, 2, 4, ... N threads (default: all CPUs)\n");
+  fprintf(stderr, "  --scale      multiply the amount of work (default: 1)\n");
+  fprintf(stderr, "  --sample-ms  RSS sampling period (default: 10)\n");
+  fprintf(stderr, "  --output     write the JSON here instead of stdout\n");
+  exit(2);
+}
+
+inline Options parseOptions(int argc, char *argv[]) {
+  static const struct option kLongOptions[] = {
+      {"threads", required_argument, nullptr, 't'},
+      {"scale", required_argument, nullptr, 's'},
+      {"sample-ms", required_argument, nullptr, 'm'},
+      {"output", required_argument, nullptr, 'o'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  Options options;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "t:s:m:o:", kLongOptions, nullptr)) != -1) {
+    switch (opt) {
+    case 't':
+      options.maxThreads = atoi(optarg);
+      break;
+    case 's':
+      options.scale = atof(optarg);
+      break;
+    case 'm':
+      options.sampleMs = atoi(optarg);
+      break;
+    case 'o':
+      options.output = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc || options.scale <= 0 || options.sampleMs <= 0 || options.maxThreads < 0) {
+    usage(argv[0]);
+  }
+  if (options.maxThreads == 0) {
+    options.maxThreads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  return options;
+}
+
+inline int main(int argc, char *argv[], const char *name, const Workload &workload) {
+  const Options options = parseOptions(argc, argv);
+
+  FILE *out = stdout;
+  if (options.output != nullptr) {
+    out = fopen(options.output, "w");
+    if (out == nullptr) {
+      perror(options.output);
+      return 1;
+    }
+  }
+
+  std::vector<int> threadCounts;
+  for (int threads = 1; threads < options.maxThreads; threads *= 2) {
+    threadCounts.push_back(threads);
+  }
+  threadCounts.push_back(options.maxThreads);
+
+  fprintf(out, "{\"benchmark\": \"%s\", \"scale\": %g, \"results\": [", name, options.scale);
+  for (size_t i = 0; i < threadCounts.size(); i++) {
+    const int threads = threadCounts[i];
+
+    // start each run from a heap with nothing cached
+    size_t unused = 0;
+    size_t len = sizeof(unused);
+    mesh_mallctl("mesh.scavenge", &unused, &len, nullptr, 0);
+
+    const size_t meshCount = mallctlSize("stats.mesh_count");
+    const size_t meshPasses = mallctlSize("stats.mesh_passes");
+    const size_t scavengeCount = mallctlSize("stats.scavenge_count");
+    const int baseRssKb = get_rss_kb();
+
+    RssSampler sampler(options.sampleMs);
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t ops = workload(threads, options);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    sampler.stop();
+
+    fprintf(stderr, "%s: %d threads: %.3f s, %.2f Mops/s, peak rss %.1f MB\n", name, threads, seconds,
+            ops / seconds / 1e6, sampler.peakKb() / 1024.0);
+
+    fprintf(out, "%s\n  {\"threads\": %d, \"seconds\": %.6f, \"ops\": %llu, \"ops_per_sec\": %.0f", i ? "," : "",
+            threads, seconds, static_cast<unsigned long long>(ops), ops / seconds);
+    fprintf(out, ", \"base_rss_kb\": %d, \"peak_rss_kb\": %d, \"rss_kb\": [", baseRssKb, sampler.peakKb());
+    const auto &samples = sampler.samples();
+    for (size_t j = 0; j < samples.size(); j++) {
+      fprintf(out, "%s[%ld, %d]", j ? ", " : "", samples[j].first, samples[j].second);
+    }
+    fprintf(out, "], \"mesh_count\": %zu, \"mesh_passes\": %zu, \"scavenge_count\": %zu}",
+            mallctlSize("stats.mesh_count") - meshCount, mallctlSize("stats.mesh_passes") - meshPasses,
+            mallctlSize("stats.scavenge_count") - scavengeCount);
+  }
+  fprintf(out, "\n]}\n");
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
+
+}  // namespace stress
+
+#endif  // MESH_TESTING_BENCHMARK_STRESS_H
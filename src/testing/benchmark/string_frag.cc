@@ -0,0 +1,59 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// A string-heavy workload that fragments the heap the way caches and
+// parsers do: each thread fills a table with strings of random length,
+// built up by appending (so they grow through several size classes),
+// then drops a random 7/8 of them and refills the gaps.  The survivors
+// pin down most spans at low occupancy, which is what meshing
+// reclaims, so the RSS samples matter more than throughput here.  Ops
+// count strings built and destroyed.
+
+#include <string>
+#include <vector>
+
+#include "stress.h"
+
+static constexpr size_t kRounds = 40;
+static constexpr size_t kSlots = 50000;
+static constexpr size_t kMaxChunks = 16;
+
+static uint64_t stringFrag(int threads, const stress::Options &options) {
+  const size_t rounds = kRounds * options.scale;
+  std::atomic<uint64_t> ops{0};
+
+  stress::runThreads(threads, [&](int id) {
+    stress::Rng rng(id);
+    std::vector<std::string> slots(kSlots);
+    uint64_t myOps = 0;
+
+    for (size_t n = 0; n < rounds; n++) {
+      for (auto &slot : slots) {
+        if (!slot.empty()) {
+          continue;
+        }
+        const size_t chunks = rng.inRange(1, kMaxChunks);
+        for (size_t c = 0; c < chunks; c++) {
+          slot.append(rng.inRange(1, 32), static_cast<char>('a' + c));
+        }
+        myOps++;
+      }
+      for (auto &slot : slots) {
+        if (rng.next() % 8 != 0) {
+          std::string().swap(slot);
+          myOps++;
+        }
+      }
+    }
+
+    ops += myOps;
+  });
+
+  return ops;
+}
+
+int main(int argc, char *argv[]) {
+  return stress::main(argc, argv, "string-frag", stringFrag);
+}
@@ -0,0 +1,44 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// threadtest from the Hoard benchmarks: a fixed number of small
+// objects is split between the threads, and each thread repeatedly
+// allocates its share and frees it all again.  Nothing is shared, so
+// this measures how well thread-local allocation scales.  Ops are
+// mallocs plus frees.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "stress.h"
+
+static constexpr size_t kIterations = 50;
+static constexpr size_t kObjects = 100000;
+static constexpr size_t kObjectSize = 8;
+
+static uint64_t threadtest(int threads, const stress::Options &options) {
+  const size_t iterations = kIterations * options.scale;
+  const size_t perThread = kObjects / threads;
+
+  stress::runThreads(threads, [&](int) {
+    std::vector<void *> objects(perThread);
+    for (size_t n = 0; n < iterations; n++) {
+      for (size_t i = 0; i < perThread; i++) {
+        objects[i] = malloc(kObjectSize);
+        *reinterpret_cast<volatile char *>(objects[i]) = 1;
+      }
+      for (size_t i = 0; i < perThread; i++) {
+        free(objects[i]);
+      }
+    }
+  });
+
+  return 2 * iterations * perThread * threads;
+}
+
+int main(int argc, char *argv[]) {
+  return stress::main(argc, argv, "threadtest", threadtest);
+}
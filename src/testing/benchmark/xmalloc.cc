@@ -0,0 +1,82 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// xmalloc-style producer/consumer workload, after Lever and Boreham's
+// xmalloc-test: every thread allocates batches of small objects and
+// queues them, and frees whichever batch is at the head of the shared
+// queue, so most objects are freed by a thread other than the one that
+// allocated them.  Ops are mallocs plus frees.
+
+#include <stdlib.h>
+
+#include <deque>
+#include <mutex>
+
+#include "stress.h"
+
+static constexpr size_t kBatchSize = 4096;
+static constexpr size_t kBatchesPerThread = 200;
+
+struct Batch {
+  void *objects[kBatchSize];
+};
+
+static uint64_t xmalloc(int threads, const stress::Options &options) {
+  const size_t batches = kBatchesPerThread * options.scale;
+
+  std::mutex lock;
+  std::deque<Batch *> queue;
+  std::atomic<uint64_t> ops{0};
+
+  auto freeBatch = [](Batch *batch) {
+    for (size_t i = 0; i < kBatchSize; i++) {
+      free(batch->objects[i]);
+    }
+    delete batch;
+  };
+
+  stress::runThreads(threads, [&](int id) {
+    stress::Rng rng(id);
+    uint64_t myOps = 0;
+
+    for (size_t n = 0; n < batches; n++) {
+      Batch *batch = new Batch;
+      for (size_t i = 0; i < kBatchSize; i++) {
+        // mostly small, with the occasional larger object
+        const size_t size = (rng.next() % 32 == 0) ? rng.inRange(256, 2048) : rng.inRange(8, 128);
+        batch->objects[i] = malloc(size);
+        *reinterpret_cast<volatile char *>(batch->objects[i]) = 1;
+      }
+
+      Batch *victim = nullptr;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(batch);
+        // keep a few batches in flight so that consumers lag producers
+        if (queue.size() > static_cast<size_t>(threads)) {
+          victim = queue.front();
+          queue.pop_front();
+        }
+      }
+      if (victim != nullptr) {
+        freeBatch(victim);
+        myOps += kBatchSize;
+      }
+      myOps += kBatchSize;
+    }
+
+    ops += myOps;
+  });
+
+  for (Batch *batch : queue) {
+    freeBatch(batch);
+    ops += kBatchSize;
+  }
+  return ops;
+}
+
+int main(int argc, char *argv[]) {
+  return stress::main(argc, argv, "xmalloc", xmalloc);
+}
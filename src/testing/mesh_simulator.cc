@@ -0,0 +1,417 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Runs Mesh's span matching offline, over the spans in heap dumps (see
+// heap_dump.h) or over synthetic random bitmaps, so that changes to the
+// mesher can be measured on real heaps before they ship.  The theory/
+// experiments do the same in Python, which is too slow for heaps of
+// millions of spans.
+//
+// Each matcher starts from the same spans and runs --passes mesh passes
+// over every size class; a pass meshes pairs the matcher finds and ORs
+// their bitmaps together, as GlobalHeap::meshLocked would:
+//
+//   shifted  the production shiftedSplitting: split the candidates in
+//            two, shuffle, and probe each left span against the next 64
+//            right spans, with the same per-pass limits as GlobalHeap
+//   greedy   first fit: each span against every later one
+//   random   shuffle and try adjacent pairs, one probe each
+//
+// All three use the production bitmapsMeshable kernel, and the report
+// has pages saved, the number of probes and the time spent.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "heap_dump.h"
+#include "internal.h"
+#include "meshing.h"
+
+using namespace mesh;
+
+namespace {
+
+struct Span {
+  size_t offset;  // of the bitmap in Heap::bits
+  uint32_t objectCount;
+  uint32_t inUseCount;
+  uint32_t spanLength;
+  uint32_t meshCount;
+  bool alive;
+};
+
+struct SizeClass {
+  uint64_t objectSize;
+  std::vector<Span> spans;
+};
+
+struct Heap {
+  size_t pageSize{0};
+  size_t words{0};  // bitmap words per span, as in MiniHeap
+  size_t spanCount{0};
+  size_t pageCount{0};
+  std::map<int, SizeClass> sizeClasses{};
+  std::vector<uint64_t> bits{};
+
+  // add a span that could be meshed
+  void add(int sizeClass, uint64_t objectSize, const HeapDumpRecord &record, const uint64_t *bitmap) {
+    SizeClass &sc = sizeClasses[sizeClass];
+    sc.objectSize = objectSize;
+    sc.spans.push_back(Span{bits.size(), record.objectCount, record.inUseCount, record.spanLength,
+                            std::max<uint32_t>(record.meshCount, 1), true});
+    bits.resize(bits.size() + words, 0);
+    memcpy(&bits[sc.spans.back().offset], bitmap, std::min<size_t>(record.bitmapWords, words) * sizeof(uint64_t));
+  }
+};
+
+struct Options {
+  const char *matcher{"all"};
+  int passes{1};
+  uint64_t seed{1};
+  bool verbose{false};
+  size_t syntheticSpans{0};
+  uint32_t objects{256};
+  double occupancy{0.3};
+};
+
+struct Result {
+  size_t candidates{0};
+  size_t meshes{0};
+  size_t pagesSaved{0};
+  size_t probes{0};
+  double seconds{0};
+};
+
+// spans GlobalHeap would put on a size class's partial list and
+// consider for meshing
+bool isCandidate(const Span &span) {
+  return span.alive && span.inUseCount > 0 && isBelowPartialThreshold(span.inUseCount, span.objectCount);
+}
+
+class Simulator {
+public:
+  Simulator(const Heap &heap, uint64_t seed) : _heap(heap), _prng(seed, seed + 1) {
+  }
+
+  const uint64_t *bits(const Span *span) const {
+    return &_bits[span->offset];
+  }
+
+  bool meshable(const Span *a, const Span *b) {
+    _result.probes++;
+    return bitmapsMeshable(bits(a), bits(b), _heap.words * sizeof(uint64_t));
+  }
+
+  // like meshSizeClassLocked: merge into the span meshed with more
+  // others already, and give up on pairs that would mesh too many
+  bool mesh(Span *dst, Span *src) {
+    if (dst->meshCount + src->meshCount > kMaxMeshes) {
+      return false;
+    }
+    if (dst->meshCount < src->meshCount) {
+      std::swap(dst, src);
+    }
+    for (size_t i = 0; i < _heap.words; i++) {
+      _bits[dst->offset + i] |= _bits[src->offset + i];
+    }
+    dst->inUseCount += src->inUseCount;
+    dst->meshCount += src->meshCount;
+    src->alive = false;
+    _result.meshes++;
+    _result.pagesSaved += src->spanLength;
+    return true;
+  }
+
+  void shifted(std::vector<Span *> &candidates) {
+    // halfSplit: alternate between the two halves in list order, up
+    // to kMaxSplitListSize each, then shuffle each half
+    std::vector<Span *> left;
+    std::vector<Span *> right;
+    for (Span *span : candidates) {
+      if (left.size() >= kMaxSplitListSize || right.size() >= kMaxSplitListSize) {
+        break;
+      }
+      if (left.size() <= right.size()) {
+        left.push_back(span);
+      } else {
+        right.push_back(span);
+      }
+    }
+    internal::mwcShuffle(left.begin(), left.end(), _prng);
+    internal::mwcShuffle(right.begin(), right.end(), _prng);
+
+    std::vector<std::pair<Span *, Span *>> mergeSets;
+    _result.probes += method::shiftedProbe(
+        left.data(), left.size(), right.data(), right.size(), _heap.words * sizeof(uint64_t),
+        [this](const Span *span) { return bits(span); },
+        [&mergeSets](Span *a, Span *b) {
+          mergeSets.emplace_back(a, b);
+          return mergeSets.size() < kMaxMergeSets;
+        });
+
+    for (auto &mergeSet : mergeSets) {
+      mesh(mergeSet.first, mergeSet.second);
+    }
+  }
+
+  void greedy(std::vector<Span *> &candidates) {
+    for (size_t i = 0; i < candidates.size(); i++) {
+      for (size_t j = i + 1; j < candidates.size() && candidates[i] != nullptr; j++) {
+        if (candidates[j] != nullptr && meshable(candidates[i], candidates[j]) && mesh(candidates[i], candidates[j])) {
+          candidates[i] = nullptr;
+          candidates[j] = nullptr;
+        }
+      }
+    }
+  }
+
+  void random(std::vector<Span *> &candidates) {
+    internal::mwcShuffle(candidates.begin(), candidates.end(), _prng);
+    for (size_t i = 0; i + 1 < candidates.size(); i += 2) {
+      if (meshable(candidates[i], candidates[i + 1])) {
+        mesh(candidates[i], candidates[i + 1]);
+      }
+    }
+  }
+
+  Result run(const std::string &matcher, int passes, bool verbose) {
+    const auto start = std::chrono::steady_clock::now();
+    for (auto &entry : _sizeClasses) {
+      SizeClass &sc = entry.second;
+      const Result before = _result;
+      for (int pass = 0; pass < passes; pass++) {
+        std::vector<Span *> candidates;
+        for (Span &span : sc.spans) {
+          if (isCandidate(span)) {
+            candidates.push_back(&span);
+          }
+        }
+        if (pass == 0) {
+          _result.candidates += candidates.size();
+        }
+        const size_t meshes = _result.meshes;
+        if (matcher == "shifted") {
+          shifted(candidates);
+        } else if (matcher == "greedy") {
+          greedy(candidates);
+        } else {
+          random(candidates);
+        }
+        if (_result.meshes == meshes) {
+          break;
+        }
+      }
+      if (verbose) {
+        printf("  %-8s class %3d (%6zu bytes): %8zu meshes, %8zu pages saved, %12zu probes\n", matcher.c_str(),
+               entry.first, static_cast<size_t>(sc.objectSize), _result.meshes - before.meshes,
+               _result.pagesSaved - before.pagesSaved, _result.probes - before.probes);
+      }
+    }
+    _result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return _result;
+  }
+
+  // each run works on its own copy of the spans
+  void reset() {
+    _sizeClasses = _heap.sizeClasses;
+    _bits = _heap.bits;
+    _result = Result{};
+    // bitmapsMeshable wants 16-byte aligned bitmaps
+    hard_assert(reinterpret_cast<uintptr_t>(_bits.data()) % 16 == 0);
+  }
+
+private:
+  const Heap &_heap;
+  std::map<int, SizeClass> _sizeClasses{};
+  std::vector<uint64_t> _bits{};
+  MWC _prng;
+  Result _result{};
+};
+
+void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [options] DUMP...\n", argv0);
+  fprintf(stderr, "       %s [options] --synthetic=SPANS [--objects=N] [--occupancy=F]\n", argv0);
+  fprintf(stderr, "  --matcher    shifted, greedy, random or all (default: all); greedy is quadratic\n");
+  fprintf(stderr, "  --passes     mesh passes per size class (default: 1)\n");
+  fprintf(stderr, "  --seed       seed for the shuffles and synthetic bitmaps (default: 1)\n");
+  fprintf(stderr, "  --synthetic  simulate SPANS random spans instead of heap dumps\n");
+  fprintf(stderr, "  --objects    objects per synthetic span (default: 256)\n");
+  fprintf(stderr, "  --occupancy  fraction of each synthetic span in use (default: 0.3)\n");
+  fprintf(stderr, "  --verbose    print results for every size class\n");
+  exit(2);
+}
+
+bool loadDump(const char *path, Heap &heap) {
+  FILE *f = fopen(path, "r");
+  if (f == nullptr) {
+    perror(path);
+    return false;
+  }
+
+  HeapDumpHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, kHeapDumpMagic, sizeof(kHeapDumpMagic)) != 0 ||
+      header.version != kHeapDumpVersion) {
+    fprintf(stderr, "%s: not a mesh heap dump\n", path);
+    fclose(f);
+    return false;
+  }
+  if (heap.pageSize != 0 && heap.pageSize != header.pageSize) {
+    fprintf(stderr, "%s: dumps have different page sizes\n", path);
+    fclose(f);
+    return false;
+  }
+  heap.pageSize = header.pageSize;
+  heap.words = heap.pageSize / kMinObjectSize / 64;
+
+  HeapDumpRecord record;
+  uint64_t bitmap[256];
+  while (fread(&record, sizeof(record), 1, f) == 1) {
+    if (record.bitmapWords > sizeof(bitmap) / sizeof(bitmap[0]) ||
+        fread(bitmap, sizeof(uint64_t), record.bitmapWords, f) != record.bitmapWords) {
+      fprintf(stderr, "%s: truncated after %zu spans\n", path, heap.spanCount);
+      break;
+    }
+    heap.spanCount++;
+    heap.pageCount += record.spanLength;
+    if (record.sizeClass < 0 || (record.flags & (heapdump::Attached | heapdump::Large)) != 0 ||
+        record.objectSize >= heap.pageSize || record.bitmapWords > heap.words) {
+      continue;
+    }
+    heap.add(record.sizeClass, record.objectSize, record, bitmap);
+  }
+  fclose(f);
+  return true;
+}
+
+// spans of objects objects each with a fixed fraction of them, in
+// random places, in use
+void makeSynthetic(const Options &options, Heap &heap) {
+  heap.pageSize = getPageSize();
+  heap.words = heap.pageSize / kMinObjectSize / 64;
+
+  MWC prng(options.seed + 2, options.seed + 3);
+  const uint32_t inUse = std::max<uint32_t>(1, static_cast<uint32_t>(options.occupancy * options.objects + 0.5));
+  std::vector<uint32_t> slots(options.objects);
+  uint64_t bitmap[256];
+
+  for (size_t i = 0; i < options.syntheticSpans; i++) {
+    for (uint32_t j = 0; j < options.objects; j++) {
+      slots[j] = j;
+    }
+    internal::mwcShuffle(slots.begin(), slots.end(), prng);
+    memset(bitmap, 0, sizeof(bitmap));
+    for (uint32_t j = 0; j < inUse; j++) {
+      bitmap[slots[j] / 64] |= 1ULL << (slots[j] % 64);
+    }
+
+    HeapDumpRecord record{};
+    record.objectCount = options.objects;
+    record.inUseCount = inUse;
+    record.spanLength = 1;
+    record.meshCount = 1;
+    record.bitmapWords = heap.words;
+    heap.spanCount++;
+    heap.pageCount++;
+    heap.add(0, heap.pageSize / options.objects, record, bitmap);
+  }
+}
+
+Options parseOptions(int argc, char *argv[]) {
+  static const struct option kLongOptions[] = {
+      {"matcher", required_argument, nullptr, 'm'},  {"passes", required_argument, nullptr, 'p'},
+      {"seed", required_argument, nullptr, 's'},     {"synthetic", required_argument, nullptr, 'n'},
+      {"objects", required_argument, nullptr, 'o'},  {"occupancy", required_argument, nullptr, 'f'},
+      {"verbose", no_argument, nullptr, 'v'},        {nullptr, 0, nullptr, 0},
+  };
+
+  Options options;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "m:p:s:n:o:f:v", kLongOptions, nullptr)) != -1) {
+    switch (opt) {
+    case 'm':
+      options.matcher = optarg;
+      break;
+    case 'p':
+      options.passes = atoi(optarg);
+      break;
+    case 's':
+      options.seed = strtoull(optarg, nullptr, 10);
+      break;
+    case 'n':
+      options.syntheticSpans = strtoull(optarg, nullptr, 10);
+      break;
+    case 'o':
+      options.objects = atoi(optarg);
+      break;
+    case 'f':
+      options.occupancy = atof(optarg);
+      break;
+    case 'v':
+      options.verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  const std::string matcher{options.matcher};
+  if (matcher != "all" && matcher != "shifted" && matcher != "greedy" && matcher != "random") {
+    usage(argv[0]);
+  }
+  if (options.passes <= 0 || options.seed == 0 || options.objects < 2 ||
+      options.objects > getPageSize() / kMinObjectSize || options.occupancy <= 0 || options.occupancy >= 1) {
+    usage(argv[0]);
+  }
+  if ((options.syntheticSpans == 0) == (optind == argc)) {
+    usage(argv[0]);
+  }
+  return options;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const Options options = parseOptions(argc, argv);
+
+  Heap heap;
+  if (options.syntheticSpans > 0) {
+    makeSynthetic(options, heap);
+  } else {
+    for (int i = optind; i < argc; i++) {
+      if (!loadDump(argv[i], heap)) {
+        return 1;
+      }
+    }
+  }
+
+  printf("heap:  %zu spans, %zu pages (%.1f MB), %zu size classes with meshable spans\n", heap.spanCount,
+         heap.pageCount, heap.pageCount * heap.pageSize / 1048576.0, heap.sizeClasses.size());
+  printf("%-8s %10s %10s %12s %10s %14s %10s\n", "matcher", "candidates", "meshes", "pages saved", "MB saved", "probes",
+         "ms");
+
+  const std::string matcher{options.matcher};
+  Simulator simulator(heap, options.seed);
+  for (const char *name : {"shifted", "greedy", "random"}) {
+    if (matcher != "all" && matcher != name) {
+      continue;
+    }
+    simulator.reset();
+    const Result result = simulator.run(name, options.passes, options.verbose);
+    printf("%-8s %10zu %10zu %12zu %10.1f %14zu %10.1f\n", name, result.candidates, result.meshes, result.pagesSaved,
+           result.pagesSaved * heap.pageSize / 1048576.0, result.probes, result.seconds * 1000);
+  }
+
+  return 0;
+}
@@ -0,0 +1,229 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// Replays a recording made with MESH_RECORD=1 (see alloc_recorder.h)
+// against Mesh and reports throughput, peak RSS and how much meshing
+// happened.  By default every call runs on one thread, in recorded
+// order.  With -t each recorded thread gets its own replay thread, and
+// the calls still run one at a time in recorded order, so that frees
+// of other threads' objects and thread-local heaps behave as they did
+// in the recorded program; the handoffs between threads are included
+// in the time.
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "alloc_recorder.h"
+#include "measure_rss.h"
+#include "plasma/mesh.h"
+
+using namespace mesh::recorder;
+
+// how often (in calls) RSS is sampled for the peak
+static constexpr size_t kRssSampleInterval = 16384;
+
+static std::vector<Record> Records;
+static std::vector<void *> Objects;
+static std::atomic<size_t> Turn{0};
+static std::atomic<int> PeakRssKb{0};
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-t] RECORDING\n", argv0);
+  fprintf(stderr, "  -t  replay each recorded thread on its own thread\n");
+  exit(2);
+}
+
+static size_t mallctlSize(const char *name) {
+  size_t value = 0;
+  size_t len = sizeof(value);
+  if (mesh_mallctl(name, &value, &len, nullptr, 0) != 0) {
+    return 0;
+  }
+  return value;
+}
+
+static void sampleRss() {
+  const int rss = get_rss_kb();
+  int peak = PeakRssKb.load(std::memory_order_relaxed);
+  while (rss > peak && !PeakRssKb.compare_exchange_weak(peak, rss, std::memory_order_relaxed)) {
+  }
+}
+
+// objects are filled so that their pages count towards RSS, as they
+// would in the recorded program
+static void execute(size_t i) {
+  const Record &record = Records[i];
+  void *&object = Objects[record.id];
+
+  switch (record.op) {
+  case Malloc:
+    object = malloc(record.size);
+    break;
+  case Calloc:
+    object = calloc(1, record.size);
+    break;
+  case Memalign:
+    object = memalign(record.alignment, record.size);
+    break;
+  case Free:
+    free(object);
+    object = nullptr;
+    return;
+  case Realloc:
+    object = realloc(object, record.size);
+    break;
+  }
+
+  if (object != nullptr) {
+    memset(object, 0xab, record.size);
+  }
+  if (i % kRssSampleInterval == 0) {
+    sampleRss();
+  }
+}
+
+static void replayThread(const std::vector<size_t> &mine) {
+  for (size_t i : mine) {
+    for (size_t spins = 0; Turn.load(std::memory_order_acquire) != i; spins++) {
+      if (spins > 64) {
+        sched_yield();
+      }
+    }
+    execute(i);
+    Turn.store(i + 1, std::memory_order_release);
+  }
+}
+
+// decode the whole recording up front, turning the implicit object ids
+// into explicit ones, so decoding isn't part of the replay time
+static bool load(const char *path, size_t &threadCount) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "%s: empty recording\n", path);
+    close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  Reader reader(data, st.st_size);
+  if (!reader.valid()) {
+    fprintf(stderr, "%s: not a mesh recording\n", path);
+    munmap(data, st.st_size);
+    return false;
+  }
+
+  IdPool<std::vector<uint32_t>> ids;
+  threadCount = 0;
+  Record record;
+  while (reader.next(record)) {
+    if (record.op == Malloc || record.op == Calloc || record.op == Memalign) {
+      record.id = ids.allocate();
+    } else if (record.id >= ids.limit()) {
+      fprintf(stderr, "%s: record %zu refers to unknown object %u\n", path, Records.size(), record.id);
+      munmap(data, st.st_size);
+      return false;
+    } else if (record.op == Free) {
+      ids.release(record.id);
+    }
+    threadCount = std::max<size_t>(threadCount, record.thread + 1);
+    Records.push_back(record);
+  }
+  munmap(data, st.st_size);
+
+  // a recording cut short (e.g. by a crash) is still worth replaying
+  if (!reader.valid()) {
+    fprintf(stderr, "%s: truncated after %zu records\n", path, Records.size());
+  }
+
+  Objects.resize(ids.limit(), nullptr);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  bool threaded = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t")) != -1) {
+    switch (opt) {
+    case 't':
+      threaded = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  size_t threadCount = 0;
+  if (!load(argv[optind], threadCount)) {
+    return 1;
+  }
+
+  const int baseRssKb = get_rss_kb();
+  PeakRssKb.store(baseRssKb);
+  const size_t meshesBefore = mallctlSize("stats.mesh_count");
+  const size_t passesBefore = mallctlSize("stats.mesh_passes");
+
+  const auto start = std::chrono::steady_clock::now();
+  if (threaded) {
+    std::vector<std::vector<size_t>> perThread(threadCount);
+    for (size_t i = 0; i < Records.size(); i++) {
+      perThread[Records[i].thread].push_back(i);
+    }
+    std::vector<std::thread> threads;
+    for (const auto &mine : perThread) {
+      threads.emplace_back(replayThread, std::cref(mine));
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  } else {
+    for (size_t i = 0; i < Records.size(); i++) {
+      execute(i);
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+  sampleRss();
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  const int finalRssKb = get_rss_kb();
+
+  printf("records:      %zu\n", Records.size());
+  printf("threads:      %zu%s\n", threadCount, threaded ? "" : " (replayed on one)");
+  printf("objects:      %zu ids\n", Objects.size());
+  printf("time:         %.3f s\n", seconds);
+  printf("throughput:   %.2f Mops/s\n", seconds > 0 ? Records.size() / seconds / 1e6 : 0.0);
+  printf("base rss:     %.1f MB\n", baseRssKb / 1024.0);
+  printf("peak rss:     %.1f MB (+%.1f MB)\n", PeakRssKb.load() / 1024.0, (PeakRssKb.load() - baseRssKb) / 1024.0);
+  printf("final rss:    %.1f MB\n", finalRssKb / 1024.0);
+  printf("meshes:       %zu in %zu passes\n", mallctlSize("stats.mesh_count") - meshesBefore,
+         mallctlSize("stats.mesh_passes") - passesBefore);
+
+  return 0;
+}
@@ -52,6 +52,42 @@ TEST(Alignment, NaturalAlignment) {
   }
 }
 
+// small aligned requests come from the smallest size class that is a
+// multiple of the alignment, not from a page-aligned allocation
+template <size_t PageSize>
+void TestSmallAlignedSizeClass() {
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+
+  void *ptr = heap->memalign(64, 48);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % 64, 0UL);
+  ASSERT_EQ(heap->getSize(ptr), 64UL);
+  heap->free(ptr);
+
+  ptr = heap->memalign(256, 100);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % 256, 0UL);
+  ASSERT_EQ(heap->getSize(ptr), 256UL);
+  heap->free(ptr);
+
+  ptr = heap->memalign(PageSize, 100);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % PageSize, 0UL);
+  ASSERT_EQ(heap->getSize(ptr), PageSize);
+  heap->free(ptr);
+
+  ASSERT_EQ(SizeMap::AlignedSizeClass(SizeMap::SizeClass(48), 64), static_cast<uint32_t>(SizeMap::SizeClass(64)));
+  ASSERT_EQ(SizeMap::AlignedSizeClass(SizeMap::SizeClass(320), 128), static_cast<uint32_t>(SizeMap::SizeClass(384)));
+
+  heap->releaseAll();
+  mesh::runtime<PageSize>().heap().flushAllBins();
+}
+
+TEST(Alignment, SmallAlignedSizeClass) {
+  if (getPageSize() == 4096) {
+    TestSmallAlignedSizeClass<4096>();
+  } else {
+    TestSmallAlignedSizeClass<16384>();
+  }
+}
+
 template <size_t PageSize>
 void TestNonOverlapping() {
   auto heap = ThreadLocalHeap<PageSize>::GetHeap();
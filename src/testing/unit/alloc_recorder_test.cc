@@ -0,0 +1,146 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "alloc_recorder.h"
+
+using namespace mesh;
+using namespace mesh::recorder;
+
+static std::string readFile(const char *path) {
+  std::string contents;
+  FILE *f = fopen(path, "r");
+  EXPECT_NE(f, nullptr);
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    contents.append(buf, len);
+  }
+  fclose(f);
+  return contents;
+}
+
+TEST(AllocRecorderTest, Varint) {
+  uint8_t buf[16];
+  ASSERT_EQ(putVarint(buf, 0), 1UL);
+  ASSERT_EQ(putVarint(buf, 127), 1UL);
+  ASSERT_EQ(putVarint(buf, 128), 2UL);
+  ASSERT_EQ(buf[0], 0x80);
+  ASSERT_EQ(buf[1], 0x01);
+  ASSERT_EQ(putVarint(buf, UINT64_MAX), 10UL);
+}
+
+TEST(AllocRecorderTest, RoundTrip) {
+  char path[] = "/tmp/mesh-record-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  // the recorder only looks at addresses, so these never need to be
+  // real allocations
+  char objects[4][64];
+  void *unknown = &objects[3];
+
+  ASSERT_EQ(start(path), 0);
+  ASSERT_TRUE(recording());
+  {
+    Guard guard;
+    recordMalloc(Malloc, &objects[0], 24);
+    recordMalloc(Calloc, &objects[1], 1000);
+    recordFree(&objects[0]);
+    // allocated before recording started: ignored
+    recordFree(unknown);
+    recordMalloc(Memalign, &objects[0], 64, 4096);
+    recordRealloc(&objects[1], &objects[2], 100000);
+  }
+  std::thread other([&]() {
+    Guard guard;
+    recordFree(&objects[2]);
+  });
+  other.join();
+  ASSERT_EQ(stop(), 0);
+  ASSERT_FALSE(recording());
+
+  const std::string contents = readFile(path);
+  unlink(path);
+
+  Reader reader(contents.data(), contents.size());
+  ASSERT_TRUE(reader.valid());
+
+  Record record;
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_EQ(record.op, Malloc);
+  ASSERT_EQ(record.size, 24UL);
+  ASSERT_EQ(record.thread, 0U);
+
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_EQ(record.op, Calloc);
+  ASSERT_EQ(record.size, 1000UL);
+
+  // ids are handed out in order: the first object was 0
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_EQ(record.op, Free);
+  ASSERT_EQ(record.id, 0U);
+
+  // and its id is reused by the next allocation, so the calloced
+  // object is still 1
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_EQ(record.op, Memalign);
+  ASSERT_EQ(record.alignment, 4096UL);
+  ASSERT_EQ(record.size, 64UL);
+
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_EQ(record.op, Realloc);
+  ASSERT_EQ(record.id, 1U);
+  ASSERT_EQ(record.size, 100000UL);
+
+  ASSERT_TRUE(reader.next(record));
+  ASSERT_EQ(record.op, Free);
+  ASSERT_EQ(record.id, 1U);
+  ASSERT_EQ(record.thread, 1U);
+
+  ASSERT_FALSE(reader.next(record));
+  ASSERT_TRUE(reader.valid());
+}
+
+TEST(AllocRecorderTest, IdPool) {
+  IdPool<std::vector<uint32_t>> ids;
+  ASSERT_EQ(ids.allocate(), 0U);
+  ASSERT_EQ(ids.allocate(), 1U);
+  ASSERT_EQ(ids.allocate(), 2U);
+  ids.release(0);
+  ids.release(2);
+  ASSERT_EQ(ids.allocate(), 2U);
+  ASSERT_EQ(ids.allocate(), 0U);
+  ASSERT_EQ(ids.allocate(), 3U);
+  ASSERT_EQ(ids.limit(), 4U);
+}
+
+TEST(AllocRecorderTest, RejectsGarbage) {
+  const char garbage[] = "not a recording at all";
+  Reader reader(garbage, sizeof(garbage));
+  ASSERT_FALSE(reader.valid());
+  Record record;
+  ASSERT_FALSE(reader.next(record));
+
+  // a record cut off partway through its varint
+  uint8_t truncated[kHeaderSize + 2] = {};
+  memcpy(truncated, kMagic, sizeof(kMagic));
+  memcpy(truncated + sizeof(kMagic), &kVersion, sizeof(kVersion));
+  truncated[kHeaderSize] = Malloc | kThreadSwitch;
+  truncated[kHeaderSize + 1] = 0;
+  Reader cut(truncated, sizeof(truncated));
+  ASSERT_TRUE(cut.valid());
+  ASSERT_FALSE(cut.next(record));
+  ASSERT_FALSE(cut.valid());
+}
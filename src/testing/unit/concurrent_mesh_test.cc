@@ -76,8 +76,10 @@ static void meshTestConcurrentWriteImpl(bool invert) {
   const auto tid = gettid();
   GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
 
-  // disable automatic meshing for this test
+  // disable automatic meshing for this test, and dirty page decay on
+  // the background thread, which would race with meshLocked below
   gheap.setMeshPeriodMs(kZeroMs);
+  gheap.setDirtyDecayMs(kZeroMs);
 
   ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
 
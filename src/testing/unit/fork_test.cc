@@ -27,6 +27,7 @@
 
 #include "internal.h"
 #include "runtime.h"
+#include "thread_local_heap.h"
 
 using namespace std;
 using namespace mesh;
@@ -586,3 +587,97 @@ public:
 TEST(ForkTest, PosixSpawnWithConcurrentAllocations) {
   PosixSpawnStressTest::runTest();
 }
+
+// Test: a child with a large heap copies it to its own arena files
+// after fork, on several threads where there are CPUs for them, while
+// another thread in the parent keeps allocating.  Until that copy is
+// done the child's arena is still backed by the parent's files, so
+// nothing the child does then may allocate from it: the parent could
+// hand out the same object again.
+template <size_t PageSize>
+static void forkCopyLargeHeapImpl() {
+  constexpr size_t kBlockSize = 1024 * 1024;
+  constexpr size_t kBlockCount = 96;
+  static_assert(kBlockCount * kBlockSize >= kForkCopyParallelThreshold, "heap too small for a parallel copy");
+  constexpr size_t kObjectSize = 64;
+  constexpr size_t kObjectCount = 256;
+
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+  vector<char *> blocks;
+  for (size_t i = 0; i < kBlockCount; i++) {
+    char *block = reinterpret_cast<char *>(heap->malloc(kBlockSize));
+    ASSERT_NE(block, nullptr);
+    memset(block, static_cast<int>(i), kBlockSize);
+    blocks.push_back(block);
+  }
+
+  atomic<bool> stop{false};
+  atomic<bool> corrupted{false};
+  thread allocator([&]() {
+    auto localHeap = ThreadLocalHeap<PageSize>::GetHeap();
+    vector<unsigned char *> objects;
+    objects.reserve(kObjectCount);
+    for (unsigned char pattern = 1; !stop.load(memory_order_acquire); pattern++) {
+      for (size_t i = 0; i < kObjectCount; i++) {
+        auto object = reinterpret_cast<unsigned char *>(localHeap->malloc(kObjectSize));
+        memset(object, pattern, kObjectSize);
+        objects.push_back(object);
+      }
+      for (auto object : objects) {
+        for (size_t i = 0; i < kObjectSize; i++) {
+          if (object[i] != pattern) {
+            corrupted.store(true, memory_order_release);
+          }
+        }
+        localHeap->free(object);
+      }
+      objects.clear();
+    }
+    localHeap->releaseAll();
+  });
+
+  for (size_t iteration = 0; iteration < 3; iteration++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      for (size_t i = 0; i < blocks.size(); i++) {
+        const auto expected = static_cast<char>(i);
+        if (blocks[i][0] != expected || blocks[i][kBlockSize / 2] != expected ||
+            blocks[i][kBlockSize - 1] != expected) {
+          _exit(1);
+        }
+      }
+
+      auto childHeap = ThreadLocalHeap<PageSize>::GetHeap();
+      void *object = childHeap->malloc(kObjectSize);
+      memset(object, 0xAA, kObjectSize);
+      childHeap->free(object);
+      _exit(0);
+    }
+
+    ASSERT_GT(pid, 0) << "fork() failed";
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status)) << "Child did not exit normally";
+    ASSERT_EQ(WEXITSTATUS(status), 0) << "Child saw a corrupted heap";
+  }
+
+  stop.store(true, memory_order_release);
+  allocator.join();
+  EXPECT_FALSE(corrupted.load(memory_order_acquire)) << "parent objects were overwritten";
+
+  for (size_t i = 0; i < blocks.size(); i++) {
+    EXPECT_EQ(blocks[i][kBlockSize - 1], static_cast<char>(i));
+    heap->free(blocks[i]);
+  }
+
+  heap->releaseAll();
+  runtime<PageSize>().heap().flushAllBins();
+}
+
+TEST(ForkTest, ForkCopiesLargeHeapWhileParentAllocates) {
+  if (getPageSize() == kPageSize4K) {
+    forkCopyLargeHeapImpl<kPageSize4K>();
+  } else {
+    forkCopyLargeHeapImpl<kPageSize16K>();
+  }
+}
@@ -0,0 +1,99 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "free_span_set.h"
+
+using namespace mesh;
+
+static std::vector<std::pair<Offset, Length>> spansOf(const FreeSpanSet &set) {
+  std::vector<std::pair<Offset, Length>> spans;
+  set.forEach([&](const Span &span) { spans.emplace_back(span.offset, span.length); });
+  return spans;
+}
+
+TEST(FreeSpanSetTest, CoalescesNeighbours) {
+  FreeSpanSet set{};
+
+  set.insert(Span(10, 2));
+  set.insert(Span(20, 5));
+  ASSERT_EQ(2UL, set.size());
+  ASSERT_EQ(7UL, set.pageCount());
+
+  // fills the gap between the two existing spans
+  const Span merged = set.insert(Span(12, 8));
+  ASSERT_EQ(10U, merged.offset);
+  ASSERT_EQ(15U, merged.length);
+  ASSERT_EQ(1UL, set.size());
+  ASSERT_EQ(15UL, set.pageCount());
+
+  // not adjacent: stays separate
+  set.insert(Span(26, 1));
+  auto spans = spansOf(set);
+  ASSERT_EQ(2UL, spans.size());
+  ASSERT_EQ(std::make_pair(Offset{10}, Length{15}), spans[0]);
+  ASSERT_EQ(std::make_pair(Offset{26}, Length{1}), spans[1]);
+}
+
+TEST(FreeSpanSetTest, BestFit) {
+  FreeSpanSet set{};
+
+  set.insert(Span(0, 8));
+  set.insert(Span(100, 3));
+  set.insert(Span(200, 3));
+  set.insert(Span(300, 1000));
+
+  Span result(0, 0);
+  ASSERT_TRUE(set.removeBestFit(2, result));
+  // smallest span that fits, lowest address among ties
+  ASSERT_EQ(100U, result.offset);
+  ASSERT_EQ(3U, result.length);
+
+  ASSERT_TRUE(set.removeBestFit(4, result));
+  ASSERT_EQ(0U, result.offset);
+  ASSERT_EQ(8U, result.length);
+
+  ASSERT_TRUE(set.removeBestFit(999, result));
+  ASSERT_EQ(300U, result.offset);
+
+  ASSERT_FALSE(set.removeBestFit(4, result));
+  ASSERT_EQ(3UL, set.pageCount());
+  ASSERT_EQ(1UL, set.size());
+
+  set.clear();
+  ASSERT_TRUE(set.empty());
+  ASSERT_EQ(0UL, set.pageCount());
+}
+
+TEST(FreeSpanSetTest, RemoveOldest) {
+  FreeSpanSet set{};
+
+  set.insert(Span(0, 4), 10);
+  set.insert(Span(10, 4), 20);
+  // merging keeps the oldest stamp
+  set.insert(Span(4, 2), 50);
+  set.insert(Span(30, 1), 5);
+
+  std::vector<std::pair<Offset, Length>> removed;
+  const size_t pageCount =
+      set.removeOldest(2, [&](const Span &span) { removed.emplace_back(span.offset, span.length); });
+
+  // whole spans are removed, oldest first, until enough pages are gone
+  ASSERT_EQ(7UL, pageCount);
+  ASSERT_EQ(2UL, removed.size());
+  ASSERT_EQ(std::make_pair(Offset{30}, Length{1}), removed[0]);
+  ASSERT_EQ(std::make_pair(Offset{0}, Length{6}), removed[1]);
+
+  ASSERT_EQ(1UL, set.size());
+  ASSERT_EQ(4UL, set.pageCount());
+
+  // best-fit removal keeps the age index in sync
+  Span result(0, 0);
+  ASSERT_TRUE(set.removeBestFit(4, result));
+  ASSERT_EQ(0UL, set.removeOldest(100, [](const Span &) {}));
+}
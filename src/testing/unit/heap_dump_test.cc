@@ -0,0 +1,113 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "heap_dump.h"
+#include "internal.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+template <size_t PageSize>
+static void heapDumpTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+
+  constexpr size_t kObjectSize = 256;
+  constexpr size_t kObjectCount = 4;
+  void *ptrs[kObjectCount];
+  for (size_t i = 0; i < kObjectCount; i++) {
+    ptrs[i] = heap->malloc(kObjectSize);
+  }
+  const auto small = gheap.miniheapFor(ptrs[0]);
+  ASSERT_NE(small, nullptr);
+
+  void *large = gheap.malloc(16 * PageSize);
+  ASSERT_NE(large, nullptr);
+
+  char path[] = "/tmp/mesh-heap-dump-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(gheap.dumpHeap(fd), 0);
+
+  const off_t size = lseek(fd, 0, SEEK_END);
+  std::vector<char> dump(size);
+  ASSERT_EQ(pread(fd, dump.data(), size, 0), size);
+  close(fd);
+  unlink(path);
+
+  HeapDumpHeader header;
+  ASSERT_GE(dump.size(), sizeof(header));
+  memcpy(&header, dump.data(), sizeof(header));
+  ASSERT_EQ(memcmp(header.magic, kHeapDumpMagic, sizeof(header.magic)), 0);
+  ASSERT_EQ(header.version, kHeapDumpVersion);
+  ASSERT_EQ(header.pageSize, PageSize);
+  ASSERT_EQ(header.arenaBegin, reinterpret_cast<uintptr_t>(gheap.arenaBegin()));
+
+  bool foundSmall = false;
+  bool foundLarge = false;
+  size_t off = sizeof(header);
+  while (off < dump.size()) {
+    HeapDumpRecord record;
+    ASSERT_LE(off + sizeof(record), dump.size());
+    memcpy(&record, dump.data() + off, sizeof(record));
+    off += sizeof(record);
+
+    std::vector<uint64_t> words(record.bitmapWords);
+    ASSERT_LE(off + words.size() * sizeof(uint64_t), dump.size());
+    memcpy(words.data(), dump.data() + off, words.size() * sizeof(uint64_t));
+    off += words.size() * sizeof(uint64_t);
+    ASSERT_EQ(record.bitmapWords, (record.objectCount + 63) / 64);
+
+    if (record.spanOffset == small->span().offset) {
+      foundSmall = true;
+      ASSERT_EQ(record.objectSize, kObjectSize);
+      ASSERT_EQ(record.objectCount, small->maxCount());
+      ASSERT_GE(record.inUseCount, kObjectCount);
+      ASSERT_TRUE(record.flags & heapdump::Attached);
+      ASSERT_FALSE(record.flags & heapdump::Large);
+      ASSERT_EQ(record.meshCount, 1);
+      for (size_t i = 0; i < kObjectCount; i++) {
+        const size_t objOff =
+            (reinterpret_cast<uintptr_t>(ptrs[i]) - small->getSpanStart(gheap.arenaBegin())) / kObjectSize;
+        ASSERT_TRUE(words[objOff / 64] & (1ULL << (objOff % 64)));
+      }
+    } else if (record.spanOffset == gheap.miniheapFor(large)->span().offset) {
+      foundLarge = true;
+      ASSERT_EQ(record.sizeClass, -1);
+      ASSERT_EQ(record.spanLength, 16U);
+      ASSERT_EQ(record.objectCount, 1U);
+      ASSERT_TRUE(record.flags & heapdump::Large);
+      ASSERT_EQ(words[0], 1ULL);
+    }
+  }
+  ASSERT_EQ(off, dump.size());
+  ASSERT_TRUE(foundSmall);
+  ASSERT_TRUE(foundLarge);
+
+  gheap.free(large);
+  for (size_t i = 0; i < kObjectCount; i++) {
+    heap->free(ptrs[i]);
+  }
+
+  // leave no empty miniheaps behind for tests that count them
+  heap->releaseAll();
+  gheap.flushAllBins();
+}
+
+TEST(HeapDumpTest, RecordsMiniheaps) {
+  if (getPageSize() == kPageSize4K) {
+    heapDumpTestImpl<kPageSize4K>();
+  } else {
+    heapDumpTestImpl<kPageSize16K>();
+  }
+}
@@ -0,0 +1,116 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+template <size_t PageSize>
+static void heapProfileTestImpl() {
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+  HeapProfiler &profiler = runtime<PageSize>().heap().profiler();
+
+  const size_t before = profiler.liveSampleCount();
+
+  // an interval of 1 byte samples (nearly) every allocation
+  profiler.setInterval(1);
+  // the next sample point was chosen before profiling was turned on
+  heap->free(heap->malloc(HeapProfiler::kDisabledCheckBytes));
+
+  constexpr size_t kObjectCount = 16;
+  void *ptrs[kObjectCount];
+  for (size_t i = 0; i < kObjectCount; i++) {
+    ptrs[i] = heap->malloc(64);
+  }
+  profiler.setInterval(0);
+
+  const size_t sampled = profiler.liveSampleCount() - before;
+  ASSERT_GE(sampled, kObjectCount / 2);
+
+  char path[] = "/tmp/mesh-heap-profile-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(profiler.dump(fd), 0);
+
+  char buf[64] = {};
+  ASSERT_GT(pread(fd, buf, sizeof(buf) - 1, 0), 0);
+  close(fd);
+  unlink(path);
+
+  const std::string header(buf);
+  ASSERT_EQ(header.find("heap profile: "), 0UL);
+  ASSERT_NE(header.find("@ heap_v2/0"), std::string::npos);
+
+  // freeing sampled objects stops tracking them
+  for (size_t i = 0; i < kObjectCount; i++) {
+    heap->free(ptrs[i]);
+  }
+  ASSERT_EQ(profiler.liveSampleCount(), before);
+
+  // leave no empty miniheaps behind for tests that count them
+  heap->releaseAll();
+  runtime<PageSize>().heap().flushAllBins();
+}
+
+TEST(HeapProfilerTest, SamplesUntilFree) {
+  if (getPageSize() == kPageSize4K) {
+    heapProfileTestImpl<kPageSize4K>();
+  } else {
+    heapProfileTestImpl<kPageSize16K>();
+  }
+}
+
+template <size_t PageSize>
+static void heapProfileGlobalFreeTestImpl() {
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  HeapProfiler &profiler = gheap.profiler();
+
+  const size_t before = profiler.liveSampleCount();
+
+  profiler.setInterval(1);
+  heap->free(heap->malloc(HeapProfiler::kDisabledCheckBytes));
+
+  constexpr size_t kObjectCount = 16;
+  void *ptrs[kObjectCount];
+  for (size_t i = 0; i < kObjectCount; i++) {
+    ptrs[i] = heap->malloc(64);
+  }
+  profiler.setInterval(0);
+  ASSERT_GT(profiler.liveSampleCount(), before);
+
+  // a thread without a local heap frees through the global heap, as
+  // libmesh's free does; that stops tracking the objects too
+  bool hadHeap = true;
+  std::thread freer([&]() {
+    hadHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent() != nullptr;
+    for (auto ptr : ptrs) {
+      gheap.free(ptr);
+    }
+  });
+  freer.join();
+  ASSERT_FALSE(hadHeap);
+  ASSERT_EQ(profiler.liveSampleCount(), before);
+
+  heap->releaseAll();
+  gheap.flushAllBins();
+}
+
+TEST(HeapProfilerTest, GlobalFreeEndsSample) {
+  if (getPageSize() == kPageSize4K) {
+    heapProfileGlobalFreeTestImpl<kPageSize4K>();
+  } else {
+    heapProfileGlobalFreeTestImpl<kPageSize16K>();
+  }
+}
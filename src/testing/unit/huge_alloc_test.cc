@@ -0,0 +1,89 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "gtest/gtest.h"
+
+#include "common.h"
+#include "internal.h"
+#include "runtime.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+template <size_t PageSize>
+static size_t hugeStat(GlobalHeap<PageSize> &gheap, const char *name) {
+  size_t value = 0;
+  size_t len = sizeof(value);
+  EXPECT_EQ(gheap.mallctl(name, &value, &len, nullptr, 0), 0);
+  return value;
+}
+
+template <size_t PageSize>
+static void hugeAllocTestImpl() {
+  constexpr size_t kMB = 1024 * 1024;
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+
+  const size_t oldThreshold = gheap.hugeThreshold();
+  gheap.setHugeThreshold(2 * kMB);
+  const size_t count = hugeStat(gheap, "stats.huge_count");
+
+  // below the threshold allocations still come from the arena
+  void *large = heap->malloc(kMB);
+  ASSERT_TRUE(gheap.contains(large));
+  heap->free(large);
+
+  char *ptr = reinterpret_cast<char *>(heap->malloc(4 * kMB + 1));
+  ASSERT_NE(ptr, nullptr);
+  ASSERT_FALSE(gheap.contains(ptr));
+  ASSERT_EQ(heap->getSize(ptr), 4 * kMB + PageSize);
+  ASSERT_EQ(hugeStat(gheap, "stats.huge_count"), count + 1);
+  ASSERT_EQ(hugeStat(gheap, "stats.huge_bytes"), 4 * kMB + PageSize);
+  memset(ptr, 0x5a, 4 * kMB + 1);
+
+  // grows with mremap and keeps its contents
+  ptr = reinterpret_cast<char *>(heap->realloc(ptr, 16 * kMB));
+  ASSERT_NE(ptr, nullptr);
+  ASSERT_EQ(heap->getSize(ptr), 16 * kMB);
+  ASSERT_EQ(ptr[0], 0x5a);
+  ASSERT_EQ(ptr[4 * kMB], 0x5a);
+  ASSERT_EQ(hugeStat(gheap, "stats.huge_bytes"), 16 * kMB);
+
+  // shrinking below the threshold moves it back into the arena
+  ptr = reinterpret_cast<char *>(heap->realloc(ptr, kMB));
+  ASSERT_TRUE(gheap.contains(ptr));
+  ASSERT_EQ(ptr[kMB - 1], 0x5a);
+  ASSERT_EQ(hugeStat(gheap, "stats.huge_count"), count);
+  heap->free(ptr);
+
+  // alignments above the page size hold too
+  void *aligned = heap->memalign(kMB, 3 * kMB);
+  ASSERT_FALSE(gheap.contains(aligned));
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(aligned) % kMB, 0UL);
+  heap->free(aligned);
+  ASSERT_EQ(hugeStat(gheap, "stats.huge_count"), count);
+  ASSERT_EQ(hugeStat(gheap, "stats.huge_bytes"), 0UL);
+
+  // the peaks outlive the mappings they were reached with
+  HeapStats stats;
+  gheap.collectStats(stats);
+  ASSERT_GE(stats.hugeCountMax, count + 1);
+  ASSERT_GE(stats.hugeBytesMax, 16 * kMB);
+  ASSERT_GE(stats.arenaMappedMax, stats.mapped - stats.hugeBytes);
+  ASSERT_LE(stats.arenaMappedMax, stats.arenaExtent);
+
+  gheap.setHugeThreshold(oldThreshold);
+}
+
+TEST(HugeAllocTest, MapsOutsideArena) {
+  if (getPageSize() == kPageSize4K) {
+    hugeAllocTestImpl<kPageSize4K>();
+  } else {
+    hugeAllocTestImpl<kPageSize16K>();
+  }
+}
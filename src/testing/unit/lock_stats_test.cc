@@ -0,0 +1,116 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "instrumented_mutex.h"
+#include "internal.h"
+#include "runtime.h"
+
+using namespace mesh;
+
+TEST(LockStatsTest, CountsOnlyWhileEnabled) {
+  InstrumentedMutex mutex;
+
+  mutex.lock();
+  mutex.unlock();
+  ASSERT_EQ(mutex.stats().acquisitions, 0UL);
+
+  lockstats::Enabled.store(true);
+  for (size_t i = 0; i < 10; i++) {
+    mutex.lock();
+    mutex.unlock();
+  }
+  ASSERT_TRUE(mutex.try_lock());
+  mutex.unlock();
+
+  // taken while enabled and released after disabling still counts the hold
+  mutex.lock();
+  lockstats::Enabled.store(false);
+  usleep(1000);
+  mutex.unlock();
+
+  const LockStats stats = mutex.stats();
+  ASSERT_EQ(stats.acquisitions, 12UL);
+  ASSERT_EQ(stats.contended, 0UL);
+  ASSERT_GE(stats.maxHoldNs, 1000000UL);
+}
+
+TEST(LockStatsTest, Contention) {
+  InstrumentedMutex mutex;
+  std::atomic<bool> holding{false};
+
+  lockstats::Enabled.store(true);
+  std::thread holder([&]() {
+    mutex.lock();
+    holding.store(true);
+    usleep(20 * 1000);
+    mutex.unlock();
+  });
+
+  while (!holding.load()) {
+  }
+  mutex.lock();
+  mutex.unlock();
+  holder.join();
+  lockstats::Enabled.store(false);
+
+  const LockStats stats = mutex.stats();
+  ASSERT_EQ(stats.acquisitions, 2UL);
+  ASSERT_EQ(stats.contended, 1UL);
+  ASSERT_GT(stats.waitNs, 0UL);
+  ASSERT_GE(stats.maxHoldNs, 20UL * 1000 * 1000);
+}
+
+template <size_t PageSize>
+static void lockStatsMallctlTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+
+  bool enabled = true;
+  bool old = true;
+  size_t len = sizeof(old);
+  ASSERT_EQ(gheap.mallctl("mesh.lock_stats", &old, &len, &enabled, sizeof(enabled)), 0);
+  ASSERT_FALSE(old);
+  ASSERT_TRUE(lockstats::enabled());
+
+  uint64_t before = 0;
+  len = sizeof(before);
+  ASSERT_EQ(gheap.mallctl("mesh.locks.large.acquisitions", &before, &len, nullptr, 0), 0);
+
+  void *ptr = gheap.malloc(16 * PageSize);
+  gheap.free(ptr);
+
+  uint64_t after = 0;
+  len = sizeof(after);
+  ASSERT_EQ(gheap.mallctl("mesh.locks.large.acquisitions", &after, &len, nullptr, 0), 0);
+  ASSERT_GE(after, before + 2);
+
+  len = sizeof(after);
+  ASSERT_EQ(gheap.mallctl("mesh.locks.arena.acquisitions", &after, &len, nullptr, 0), 0);
+  ASSERT_GT(after, 0UL);
+  len = sizeof(after);
+  ASSERT_EQ(gheap.mallctl("mesh.locks.bin.3.max_hold_ns", &after, &len, nullptr, 0), 0);
+  len = sizeof(after);
+  ASSERT_EQ(gheap.mallctl("mesh.locks.bin.99.acquisitions", &after, &len, nullptr, 0), -1);
+  len = sizeof(after);
+  ASSERT_EQ(gheap.mallctl("mesh.locks.arena.bogus", &after, &len, nullptr, 0), -1);
+
+  enabled = false;
+  ASSERT_EQ(gheap.mallctl("mesh.lock_stats", nullptr, nullptr, &enabled, sizeof(enabled)), 0);
+  ASSERT_FALSE(lockstats::enabled());
+}
+
+TEST(LockStatsTest, Mallctl) {
+  if (getPageSize() == kPageSize4K) {
+    lockStatsMallctlTestImpl<kPageSize4K>();
+  } else {
+    lockStatsMallctlTestImpl<kPageSize16K>();
+  }
+}
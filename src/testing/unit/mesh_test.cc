@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <utility>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "internal.h"
@@ -151,3 +154,27 @@ TEST(MeshTest, TryMesh) {
 TEST(MeshTest, TryMeshInverse) {
   meshTest(true);
 }
+
+TEST(MeshTest, ShiftedProbe) {
+  // left[j] is probed against right[j], right[j + 1], ..., wrapping
+  // around; only the second left bitmap is disjoint from the first
+  // right one, which it reaches after wrapping
+  alignas(16) uint64_t bitmaps[4][2] = {{0x3, 0}, {0xc, 0}, {0x1, 0}, {0x6, 0}};
+  const uint64_t *left[2] = {bitmaps[0], bitmaps[1]};
+  const uint64_t *right[2] = {bitmaps[2], bitmaps[3]};
+
+  std::vector<std::pair<const uint64_t *, const uint64_t *>> found;
+  const size_t probes = method::shiftedProbe(
+      left, 2, right, 2, sizeof(bitmaps[0]), [](const uint64_t *bits) { return bits; },
+      [&found](const uint64_t *a, const uint64_t *b) {
+        found.emplace_back(a, b);
+        return true;
+      });
+
+  ASSERT_EQ(probes, 4UL);
+  ASSERT_EQ(found.size(), 1UL);
+  ASSERT_EQ(found[0].first, bitmaps[1]);
+  ASSERT_EQ(found[0].second, bitmaps[2]);
+  ASSERT_EQ(left[1], nullptr);
+  ASSERT_EQ(right[0], nullptr);
+}
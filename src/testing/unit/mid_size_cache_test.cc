@@ -0,0 +1,78 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <string.h>
+
+#include "gtest/gtest.h"
+
+#include "common.h"
+#include "internal.h"
+#include "runtime.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+template <size_t PageSize>
+static void midSizeCacheTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+  heap->releaseAll();
+  gheap.flushAllBins();
+  const size_t miniheaps = gheap.getAllocatedMiniheapCount();
+  HeapStats before;
+  gheap.collectStats(before);
+
+  // a freed mid-size span comes straight back for the next request
+  // with the same page count, still tracked by its miniheap
+  void *ptr = heap->malloc(64 * 1024);
+  ASSERT_NE(ptr, nullptr);
+  memset(ptr, 0xab, 64 * 1024);
+  heap->free(ptr);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), miniheaps + 1);
+
+  // while cached it isn't counted as allocated
+  HeapStats cached;
+  gheap.collectStats(cached);
+  ASSERT_EQ(cached.largeCount, before.largeCount);
+  ASSERT_EQ(cached.allocated, before.allocated);
+  ASSERT_EQ(cached.cachedBytes, before.cachedBytes + 64 * 1024);
+  void *again = heap->malloc(64 * 1024 - 100);
+  ASSERT_EQ(again, ptr);
+  ASSERT_EQ(gheap.miniheapFor(again)->inUseCount(), 1U);
+  ASSERT_EQ(heap->getSize(again), 64UL * 1024);
+
+  // a different page count doesn't use it
+  void *other = heap->malloc(128 * 1024);
+  ASSERT_NE(other, again);
+  heap->free(other);
+  heap->free(again);
+
+  // only kMidSizeCacheDepth spans per page count are kept, and nothing
+  // above kMaxFastLargeSize
+  void *ptrs[kMidSizeCacheDepth + 2];
+  for (auto &p : ptrs) {
+    p = heap->malloc(32 * 1024);
+  }
+  void *huge = heap->malloc(kMaxFastLargeSize + 1);
+  for (auto &p : ptrs) {
+    heap->free(p);
+  }
+  heap->free(huge);
+  // the 64KB, 128KB and kMidSizeCacheDepth 32KB spans
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), miniheaps + 2 + kMidSizeCacheDepth);
+
+  // releaseAll (and thread exit) hands them back
+  heap->releaseAll();
+  gheap.flushAllBins();
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), miniheaps);
+}
+
+TEST(MidSizeCacheTest, ReusesFreedSpans) {
+  if (getPageSize() == kPageSize4K) {
+    midSizeCacheTestImpl<kPageSize4K>();
+  } else {
+    midSizeCacheTestImpl<kPageSize16K>();
+  }
+}
@@ -0,0 +1,224 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "runtime.h"
+
+using namespace mesh;
+
+template <size_t PageSize>
+static void scavengeStatsTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+
+  // disable automatic meshing for this test
+  gheap.setMeshPeriodMs(kZeroMs);
+
+  // start with no dirty pages
+  gheap.scavenge(true);
+  const auto before = gheap.scavengeStats();
+
+  constexpr size_t kPageCount = 64;
+  char *ptr = reinterpret_cast<char *>(gheap.malloc(kPageCount * PageSize));
+  ASSERT_NE(ptr, nullptr);
+  memset(ptr, 'x', kPageCount * PageSize);
+  gheap.free(ptr);
+
+  gheap.scavenge(true);
+  const auto after = gheap.scavengeStats();
+
+  ASSERT_EQ(after.count, before.count + 1);
+  ASSERT_GE(after.pageCount, before.pageCount + kPageCount);
+  ASSERT_GE(after.totalNs, before.totalNs);
+  ASSERT_GE(after.maxNs, before.maxNs);
+
+  // the released span is clean now; scavenging again has nothing to do
+  gheap.scavenge(true);
+  ASSERT_EQ(gheap.scavengeStats().pageCount, after.pageCount);
+}
+
+TEST(ScavengeTest, Stats) {
+  if (getPageSize() == kPageSize4K) {
+    scavengeStatsTestImpl<kPageSize4K>();
+  } else {
+    scavengeStatsTestImpl<kPageSize16K>();
+  }
+}
+
+template <size_t PageSize>
+static void dirtyDecayTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+
+  gheap.setMeshPeriodMs(kZeroMs);
+  gheap.scavenge(true);
+
+  constexpr size_t kPageCount = 64;
+  char *ptr = reinterpret_cast<char *>(gheap.malloc(kPageCount * PageSize));
+  ASSERT_NE(ptr, nullptr);
+  memset(ptr, 'x', kPageCount * PageSize);
+  gheap.free(ptr);
+
+  // freshly freed pages are at the top of the decay curve and stay dirty
+  gheap.setDirtyDecayMs(std::chrono::milliseconds{60 * 1000});
+  ASSERT_EQ(gheap.decayDirty(), 0UL);
+
+  // with a zero window decay is disabled entirely
+  gheap.setDirtyDecayMs(kZeroMs);
+  ASSERT_EQ(gheap.decayDirty(), 0UL);
+
+  // the coarse clock ticks every few ms, so wait until the span decays
+  gheap.setDirtyDecayMs(std::chrono::milliseconds{1});
+  size_t released = 0;
+  for (size_t i = 0; i < 100 && released == 0; i++) {
+    usleep(10 * 1000);
+    released = gheap.decayDirty();
+  }
+  ASSERT_GE(released, kPageCount);
+
+  gheap.setDirtyDecayMs(kDirtyDecayMs);
+}
+
+TEST(ScavengeTest, DirtyDecay) {
+  if (getPageSize() == kPageSize4K) {
+    dirtyDecayTestImpl<kPageSize4K>();
+  } else {
+    dirtyDecayTestImpl<kPageSize16K>();
+  }
+}
+
+template <size_t PageSize>
+static void trimTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+
+  gheap.setMeshPeriodMs(kZeroMs);
+  gheap.scavenge(true);
+
+  constexpr size_t kPageCount = 64;
+  char *ptr = reinterpret_cast<char *>(gheap.malloc(kPageCount * PageSize));
+  ASSERT_NE(ptr, nullptr);
+  memset(ptr, 'x', kPageCount * PageSize);
+  gheap.free(ptr);
+
+  HeapStats stats;
+  gheap.collectStats(stats);
+  ASSERT_GE(stats.dirty, kPageCount * PageSize);
+
+  ASSERT_GE(gheap.trim(kTrimBudgetMs), kPageCount * PageSize);
+
+  gheap.collectStats(stats);
+  ASSERT_EQ(stats.dirty, 0UL);
+}
+
+TEST(ScavengeTest, Trim) {
+  if (getPageSize() == kPageSize4K) {
+    trimTestImpl<kPageSize4K>();
+  } else {
+    trimTestImpl<kPageSize16K>();
+  }
+}
+
+template <size_t PageSize>
+static void trimBudgetTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+
+  gheap.setMeshPeriodMs(kZeroMs);
+  gheap.scavenge(true);
+
+  // four dirty spans of half a batch each, kept apart by live ones
+  constexpr size_t kSpanPages = kTrimReleaseBatch / 2;
+  char *spans[8];
+  for (auto &span : spans) {
+    span = reinterpret_cast<char *>(gheap.malloc(kSpanPages * PageSize));
+    ASSERT_NE(span, nullptr);
+    memset(span, 'x', kSpanPages * PageSize);
+  }
+  for (size_t i = 0; i < 8; i += 2) {
+    gheap.free(spans[i]);
+  }
+  ASSERT_EQ(gheap.dirtyPageCount(), 4 * kSpanPages);
+
+  // with no budget left only the first batch, oldest first, goes
+  gheap.trim(kZeroMs);
+  ASSERT_EQ(gheap.dirtyPageCount(), 2 * kSpanPages);
+
+  gheap.trim(kTrimBudgetMs);
+  ASSERT_EQ(gheap.dirtyPageCount(), 0UL);
+
+  for (size_t i = 1; i < 8; i += 2) {
+    gheap.free(spans[i]);
+  }
+  gheap.scavenge(true);
+}
+
+TEST(ScavengeTest, TrimBudget) {
+  if (getPageSize() == kPageSize4K) {
+    trimBudgetTestImpl<kPageSize4K>();
+  } else {
+    trimBudgetTestImpl<kPageSize16K>();
+  }
+}
+
+template <size_t PageSize>
+static void dirtyDecayCurveTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+
+  gheap.setMeshPeriodMs(kZeroMs);
+  // drive the curve by hand, with the background thread's decay off
+  gheap.setDirtyDecayMs(kZeroMs);
+  gheap.scavenge(true);
+
+  constexpr size_t kSpanCount = 16;
+  constexpr size_t kSpanPages = 4;
+  void *spans[2 * kSpanCount];
+  for (size_t i = 0; i < 2 * kSpanCount; i++) {
+    spans[i] = gheap.malloc(kSpanPages * PageSize);
+    ASSERT_NE(spans[i], nullptr);
+    memset(spans[i], 'x', kSpanPages * PageSize);
+  }
+  // free every other span, so that none of them coalesce
+  for (size_t i = 0; i < 2 * kSpanCount; i += 2) {
+    gheap.free(spans[i]);
+  }
+  const size_t dirtyPageCount = kSpanCount * kSpanPages;
+
+  constexpr uint64_t kWindowMs = 1000;
+  constexpr uint64_t kEpochMs = kWindowMs / kDirtyDecaySteps;
+
+  // a time before the current epoch restarts the curve there, so that
+  // epochs start at 1 + k * kEpochMs whatever earlier tests did
+  ASSERT_EQ(gheap.MeshableArena<PageSize>::decayDirty(1, kWindowMs), 0UL);
+  uint64_t now = 1 + 1000 * kWindowMs;
+
+  ASSERT_EQ(gheap.MeshableArena<PageSize>::decayDirty(now, kWindowMs), 0UL);
+  ASSERT_EQ(gheap.MeshableArena<PageSize>::decayDirty(now + kEpochMs / 2, kWindowMs), 0UL);
+
+  // halfway through the window about half of the pages have gone
+  now += kWindowMs / 2;
+  const size_t halfway = gheap.MeshableArena<PageSize>::decayDirty(now, kWindowMs);
+  ASSERT_GT(halfway, 0UL);
+  ASSERT_LT(halfway, dirtyPageCount);
+
+  // and by the end of it, all of them
+  now += kWindowMs / 2;
+  ASSERT_EQ(halfway + gheap.MeshableArena<PageSize>::decayDirty(now, kWindowMs), dirtyPageCount);
+
+  for (size_t i = 1; i < 2 * kSpanCount; i += 2) {
+    gheap.free(spans[i]);
+  }
+  gheap.setDirtyDecayMs(kDirtyDecayMs);
+}
+
+TEST(ScavengeTest, DirtyDecayCurve) {
+  if (getPageSize() == kPageSize4K) {
+    dirtyDecayCurveTestImpl<kPageSize4K>();
+  } else {
+    dirtyDecayCurveTestImpl<kPageSize16K>();
+  }
+}
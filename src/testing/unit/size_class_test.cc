@@ -42,6 +42,18 @@ TEST(SizeClass, SmallClasses) {
   roundtrip(32);
 }
 
+TEST(SizeClass, ConstantSizeClass) {
+  static_assert(SizeMap::ConstantSizeClass(0) == 1, "0-byte requests get 16 bytes");
+  static_assert(SizeMap::ConstantSizeClass(24) == 2, "");
+  static_assert(SizeMap::ConstantSizeClass(kMaxSize + 1) == -1, "");
+
+  for (size_t size = 0; size <= kMaxSize; size++) {
+    uint32_t sizeClass = 0;
+    ASSERT_TRUE(SizeMap::GetSizeClass(size, &sizeClass));
+    ASSERT_EQ(SizeMap::ConstantSizeClass(size), static_cast<int32_t>(sizeClass)) << size;
+  }
+}
+
 TEST(SizeClass, PowerOfTwo) {
   ASSERT_TRUE(powerOfTwo::kMinObjectSize == 8);
   ASSERT_TRUE(powerOfTwo::ClassForByteSize(8) >= 0);
@@ -70,6 +82,19 @@ TEST(SizeClass, Reciprocal) {
   }
 }
 
+TEST(SizeClass, IntReciprocalTable) {
+  // exact for every offset below 2^22; stepping by 7 hits every
+  // remainder of every size class
+  for (size_t i = 0; i < kClassSizesMax; i++) {
+    const size_t objectSize = SizeMap::class_to_size(i);
+    for (size_t j = 0; j < (1UL << 22); j += 7) {
+      if (int_recip::computeIndex(j, i) != j / objectSize) {
+        FAIL() << "Mismatch at sizeClass=" << i << " offset=" << j;
+      }
+    }
+  }
+}
+
 TEST(SizeClass, ReciprocalTable) {
   // Verify that the shared reciprocal table gives correct results
   // for all size classes and all valid byte offsets
@@ -0,0 +1,58 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "common.h"
+#include "internal.h"
+#include "runtime.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+template <size_t PageSize>
+static void sizedFreeTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+  heap->releaseAll();
+  gheap.flushAllBins();
+  const size_t miniheaps = gheap.getAllocatedMiniheapCount();
+
+  // enough objects that some spans are detached by the time they are
+  // freed, so both the local and the global paths run
+  std::vector<void *> ptrs;
+  for (size_t i = 0; i < 4096; i++) {
+    ptrs.push_back(heap->malloc(40));
+  }
+  for (void *ptr : ptrs) {
+    heap->sizedFree(ptr, 40);
+  }
+
+  // sizes that don't match the span fall back to a regular free: a
+  // smaller size class than the object's, and an over-page-aligned large
+  // allocation whose size maps to a small class
+  void *wrongClass = heap->malloc(100);
+  heap->sizedFree(wrongClass, 24);
+  void *large = heap->memalign(2 * PageSize, 10);
+  ASSERT_TRUE(gheap.miniheapFor(large)->isLargeAlloc());
+  heap->sizedFree(large, 10);
+
+  // every object was freed, so every span is empty again
+  heap->releaseAll();
+  gheap.flushAllBins();
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), miniheaps);
+}
+
+TEST(SizedFreeTest, FreesEverything) {
+  if (getPageSize() == kPageSize4K) {
+    sizedFreeTestImpl<kPageSize4K>();
+  } else {
+    sizedFreeTestImpl<kPageSize16K>();
+  }
+}
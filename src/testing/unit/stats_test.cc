@@ -0,0 +1,191 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "stats_segment.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+template <typename T, size_t PageSize>
+static T readStat(GlobalHeap<PageSize> &gheap, const char *name) {
+  T value{};
+  size_t len = sizeof(value);
+  EXPECT_EQ(gheap.mallctl(name, &value, &len, nullptr, 0), 0) << name;
+  return value;
+}
+
+template <size_t PageSize>
+static void sizeClassStatsTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+
+  constexpr size_t kObjectSize = 256;
+  constexpr size_t kObjectCount = 64;
+  uint32_t sizeClass = 0;
+  ASSERT_TRUE(SizeMap::GetSizeClass(kObjectSize, &sizeClass));
+
+  void *ptrs[kObjectCount];
+  for (size_t i = 0; i < kObjectCount; i++) {
+    ptrs[i] = heap->malloc(kObjectSize);
+  }
+  void *large = gheap.malloc(16 * PageSize);
+
+  // stats are a snapshot until the epoch is bumped
+  uint64_t epoch = 1;
+  size_t len = sizeof(epoch);
+  ASSERT_EQ(gheap.mallctl("epoch", &epoch, &len, &epoch, sizeof(epoch)), 0);
+
+  ASSERT_EQ(readStat<unsigned>(gheap, "arenas.nbins"), static_cast<unsigned>(kNumBins));
+
+  char name[128];
+  snprintf(name, sizeof(name), "arenas.bin.%u.size", sizeClass);
+  ASSERT_EQ(readStat<size_t>(gheap, name), kObjectSize);
+
+  snprintf(name, sizeof(name), "stats.arenas.0.bins.%u.curregs", sizeClass);
+  ASSERT_GE(readStat<size_t>(gheap, name), kObjectCount);
+  snprintf(name, sizeof(name), "stats.arenas.0.bins.%u.attached_slabs", sizeClass);
+  ASSERT_GE(readStat<size_t>(gheap, name), 1UL);
+  snprintf(name, sizeof(name), "stats.arenas.4096.bins.%u.nfills", sizeClass);
+  ASSERT_GE(readStat<uint64_t>(gheap, name), 1UL);
+
+  ASSERT_GE(readStat<size_t>(gheap, "stats.allocated"), kObjectCount * kObjectSize + 16 * PageSize);
+  ASSERT_GE(readStat<size_t>(gheap, "stats.active"), readStat<size_t>(gheap, "stats.allocated"));
+  ASSERT_GE(readStat<size_t>(gheap, "stats.arenas.0.large.allocated"), 16 * PageSize);
+
+  // a wrong-sized buffer is rejected, as is an unknown bin
+  uint32_t small = 0;
+  len = sizeof(small);
+  ASSERT_EQ(gheap.mallctl("stats.allocated", &small, &len, nullptr, 0), -1);
+  size_t value = 0;
+  len = sizeof(value);
+  ASSERT_EQ(gheap.mallctl("stats.arenas.0.bins.1000.curregs", &value, &len, nullptr, 0), -1);
+
+  gheap.free(large);
+  for (size_t i = 0; i < kObjectCount; i++) {
+    heap->free(ptrs[i]);
+  }
+
+  // leave no empty miniheaps behind for tests that count them
+  heap->releaseAll();
+  gheap.flushAllBins();
+}
+
+TEST(StatsTest, SizeClassStats) {
+  if (getPageSize() == kPageSize4K) {
+    sizeClassStatsTestImpl<kPageSize4K>();
+  } else {
+    sizeClassStatsTestImpl<kPageSize16K>();
+  }
+}
+
+template <size_t PageSize>
+static void meshFaultStatsTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+
+  const size_t faults = readStat<size_t>(gheap, "stats.mesh_faults");
+  const size_t waitNs = readStat<size_t>(gheap, "stats.mesh_fault_wait_ns");
+
+  gheap.recordMeshFault(1000);
+  gheap.recordMeshFault(500);
+
+  ASSERT_EQ(readStat<size_t>(gheap, "stats.mesh_faults"), faults + 2);
+  ASSERT_EQ(readStat<size_t>(gheap, "stats.mesh_fault_wait_ns"), waitNs + 1500);
+  ASSERT_GE(readStat<size_t>(gheap, "stats.mesh_fault_max_wait_ns"), 1000UL);
+}
+
+TEST(StatsTest, MeshFaultStats) {
+  if (getPageSize() == kPageSize4K) {
+    meshFaultStatsTestImpl<kPageSize4K>();
+  } else {
+    meshFaultStatsTestImpl<kPageSize16K>();
+  }
+}
+
+template <size_t PageSize>
+static void statsSegmentTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+
+  ASSERT_TRUE(gheap.openStatsSegment());
+  ASSERT_TRUE(gheap.hasStatsSegment());
+
+  // find the segment the way meshtop does
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "/memfd:%s", kStatsSegmentName);
+  int fd = -1;
+  for (int i = 0; i < 1024 && fd < 0; i++) {
+    char path[64];
+    char target[256];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", i);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len > 0) {
+      target[len] = '\0';
+      if (strncmp(target, prefix, strlen(prefix)) == 0) {
+        fd = open(path, O_RDONLY);
+      }
+    }
+  }
+  ASSERT_GE(fd, 0);
+  void *ptr = mmap(nullptr, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT_NE(ptr, MAP_FAILED);
+  const auto segment = reinterpret_cast<const StatsSegment *>(ptr);
+
+  ASSERT_EQ(memcmp(segment->magic, kStatsSegmentMagic, sizeof(segment->magic)), 0);
+  ASSERT_EQ(segment->version, kStatsSegmentVersion);
+  ASSERT_EQ(segment->pageSize, PageSize);
+  ASSERT_EQ(segment->binCount, kNumBins);
+
+  constexpr size_t kObjectSize = 256;
+  constexpr size_t kObjectCount = 64;
+  uint32_t sizeClass = 0;
+  ASSERT_TRUE(SizeMap::GetSizeClass(kObjectSize, &sizeClass));
+
+  void *ptrs[kObjectCount];
+  for (size_t i = 0; i < kObjectCount; i++) {
+    ptrs[i] = heap->malloc(kObjectSize);
+  }
+
+  const uint64_t seq = segment->seq.load(std::memory_order_acquire);
+  const uint64_t updates = segment->updateCount;
+  gheap.publishStats();
+
+  // every update leaves seq even and two higher
+  ASSERT_EQ(seq % 2, 0UL);
+  ASSERT_EQ(segment->seq.load(std::memory_order_acquire), seq + 2);
+  ASSERT_EQ(segment->updateCount, updates + 1);
+  ASSERT_EQ(segment->pid, static_cast<uint32_t>(getpid()));
+  ASSERT_GT(segment->rss, 0UL);
+  ASSERT_GE(segment->allocated, kObjectCount * kObjectSize);
+  ASSERT_EQ(segment->sizeClasses[sizeClass].objectSize, kObjectSize);
+  ASSERT_GE(segment->sizeClasses[sizeClass].inUseObjects, kObjectCount);
+  ASSERT_GE(segment->sizeClasses[sizeClass].attachedSpans, 1UL);
+
+  munmap(ptr, sizeof(StatsSegment));
+  for (size_t i = 0; i < kObjectCount; i++) {
+    heap->free(ptrs[i]);
+  }
+
+  heap->releaseAll();
+  gheap.flushAllBins();
+}
+
+TEST(StatsTest, StatsSegment) {
+  if (getPageSize() == kPageSize4K) {
+    statsSegmentTestImpl<kPageSize4K>();
+  } else {
+    statsSegmentTestImpl<kPageSize16K>();
+  }
+}
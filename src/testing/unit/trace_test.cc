@@ -0,0 +1,144 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "thread_local_heap.h"
+#include "trace.h"
+
+using namespace mesh;
+
+// dump the trace and return the count of lines for the given event,
+// checking that timestamps never go backwards
+static size_t dumpAndCount(const char *event, uint64_t *lastArg0 = nullptr) {
+  char path[] = "/tmp/mesh-trace-XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT_GE(fd, 0);
+  EXPECT_EQ(trace::dump(fd), 0);
+
+  std::string contents;
+  char buf[4096];
+  ssize_t len;
+  off_t off = 0;
+  while ((len = pread(fd, buf, sizeof(buf), off)) > 0) {
+    contents.append(buf, len);
+    off += len;
+  }
+  close(fd);
+  unlink(path);
+
+  EXPECT_EQ(contents.find("# mesh trace: pid "), 0UL);
+
+  std::istringstream lines(contents);
+  std::string line;
+  size_t count = 0;
+  unsigned long long lastTimestamp = 0;
+  while (std::getline(lines, line)) {
+    if (line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    unsigned long long timestamp, arg0, arg1;
+    unsigned tid;
+    std::string name;
+    fields >> timestamp >> tid >> name >> arg0 >> arg1;
+    EXPECT_FALSE(fields.fail()) << line;
+    EXPECT_GE(timestamp, lastTimestamp);
+    lastTimestamp = timestamp;
+    if (name == event) {
+      count++;
+      if (lastArg0 != nullptr) {
+        *lastArg0 = arg0;
+      }
+    }
+  }
+  return count;
+}
+
+TEST(TraceTest, RecordsOnlyWhileEnabled) {
+  const size_t before = dumpAndCount("fork_parent");
+
+  trace::record(trace::ForkParent, 1, 2);
+  ASSERT_EQ(dumpAndCount("fork_parent"), before);
+
+  trace::Enabled.store(true);
+  trace::record(trace::ForkParent, 1, 2);
+  // a second thread gets its own ring
+  std::thread other([]() {
+    trace::record(trace::ForkParent, 3, 4);
+    trace::releaseThreadRing();
+  });
+  other.join();
+  trace::Enabled.store(false);
+
+  ASSERT_EQ(dumpAndCount("fork_parent"), before + 2);
+}
+
+TEST(TraceTest, RingWraps) {
+  trace::Enabled.store(true);
+  for (size_t i = 0; i < 3 * trace::kRingSize; i++) {
+    trace::record(trace::ExpandArena, i, 0);
+  }
+  trace::Enabled.store(false);
+
+  // only the newest records survive, and the oldest slot may have been
+  // in flight when it was copied
+  uint64_t last = 0;
+  const size_t count = dumpAndCount("expand_arena", &last);
+  ASSERT_GE(count, trace::kRingSize - 1);
+  ASSERT_LE(count, trace::kRingSize);
+  ASSERT_EQ(last, 3 * trace::kRingSize - 1);
+}
+
+template <size_t PageSize>
+static void traceHeapTestImpl() {
+  GlobalHeap<PageSize> &gheap = runtime<PageSize>().heap();
+  auto heap = ThreadLocalHeap<PageSize>::GetHeap();
+
+  bool enabled = true;
+  bool old = true;
+  size_t len = sizeof(old);
+  ASSERT_EQ(gheap.mallctl("trace.active", &old, &len, &enabled, sizeof(enabled)), 0);
+  ASSERT_FALSE(old);
+
+  const size_t refills = dumpAndCount("refill");
+  const size_t releases = dumpAndCount("release");
+
+  heap->releaseAll();
+  heap->free(heap->malloc(256));
+  heap->releaseAll();
+  gheap.flushAllBins();
+
+  enabled = false;
+  ASSERT_EQ(gheap.mallctl("trace.active", nullptr, nullptr, &enabled, sizeof(enabled)), 0);
+
+  ASSERT_GT(dumpAndCount("refill"), refills);
+  ASSERT_GT(dumpAndCount("release"), releases);
+
+  char path[] = "/tmp/mesh-trace-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  const char *pathp = path;
+  ASSERT_EQ(gheap.mallctl("trace.dump", nullptr, nullptr, &pathp, sizeof(pathp)), 0);
+  ASSERT_EQ(access(path, R_OK), 0);
+  unlink(path);
+}
+
+TEST(TraceTest, HeapEvents) {
+  if (getPageSize() == kPageSize4K) {
+    traceHeapTestImpl<kPageSize4K>();
+  } else {
+    traceHeapTestImpl<kPageSize16K>();
+  }
+}
@@ -16,6 +16,7 @@
 #include <algorithm>
 #include <atomic>
 
+#include "heap_profiler.h"
 #include "internal.h"
 #include "mini_heap.h"
 #include "shuffle_vector.h"
@@ -74,6 +75,10 @@ public:
   void releaseAll();
 
   void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN smallAllocSlowpath(size_t sizeClass);
+  void *ATTRIBUTE_NEVER_INLINE sampledMalloc(size_t sz);
+  void *ATTRIBUTE_NEVER_INLINE largeMalloc(size_t sz);
+  bool ATTRIBUTE_NEVER_INLINE cacheLargeSpan(MiniHeapT *mh, void *ptr);
+  void flushLargeSpans();
   void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN smallAllocGlobalRefill(ShuffleVectorT &shuffleVector,
                                                                            size_t sizeClass);
 
@@ -94,16 +99,13 @@ public:
       auto ptr = this->malloc(size);
       d_assert_msg((reinterpret_cast<uintptr_t>(ptr) % alignment) == 0, "%p(%zu) %% %zu != 0", ptr, size, alignment);
       return ptr;
-    } else if (isSmall) {
-      const auto sizeClassBytes = SizeMap::ByteSizeForClass(sizeClass);
-      // if the alignment is for a small allocation that is less than
-      // the page size, and the size class size in bytes is a multiple
-      // of the alignment, just call malloc
-      if (sizeClassBytes <= PageSize && alignment <= sizeClassBytes && (sizeClassBytes % alignment) == 0) {
-        auto ptr = this->malloc(size);
-        d_assert_msg((reinterpret_cast<uintptr_t>(ptr) % alignment) == 0, "%p(%zu) %% %zu != 0", ptr, size, alignment);
-        return ptr;
-      }
+    } else if (isSmall && alignment <= PageSize) {
+      // e.g. a 48-byte alignas(64) struct comes from the 64-byte class
+      // rather than a page of its own
+      const auto alignedClass = SizeMap::AlignedSizeClass(sizeClass, alignment);
+      auto ptr = this->malloc(SizeMap::ByteSizeForClass(alignedClass));
+      d_assert_msg((reinterpret_cast<uintptr_t>(ptr) % alignment) == 0, "%p(%zu) %% %zu != 0", ptr, size, alignment);
+      return ptr;
     }
 
     // fall back to page-aligned allocation
@@ -122,6 +124,11 @@ public:
       return this->malloc(newSize);
     }
 
+    // huge allocations stay huge, and mremap grows them without a copy
+    if (unlikely(newSize >= _global->hugeThreshold()) && _global->isHuge(oldPtr)) {
+      return _global->hugeRealloc(oldPtr, newSize);
+    }
+
     size_t oldSize = getSize(oldPtr);
 
     // the following is directly from tcmalloc, designed to avoid
@@ -177,13 +184,43 @@ public:
 
   // semiansiheap ensures we never see size == 0
   inline void *ATTRIBUTE_ALWAYS_INLINE ATTRIBUTE_MALLOC malloc(size_t sz) {
+    if (unlikely(_bytesUntilSample < sz)) {
+      return sampledMalloc(sz);
+    }
+    _bytesUntilSample -= sz;
+
+    return mallocUnsampled(sz);
+  }
+
+  // take a new sample point on the next malloc
+  inline void resetSampling() {
+    _bytesUntilSample = 0;
+  }
+
+  inline void *ATTRIBUTE_ALWAYS_INLINE mallocUnsampled(size_t sz) {
     uint32_t sizeClass = 0;
 
     // if the size isn't in our sizemap it is a large alloc
     if (unlikely(!SizeMap::GetSizeClass(sz, &sizeClass))) {
-      return _global->malloc(sz);
+      return largeMalloc(sz);
+    }
+
+    return smallMalloc(sizeClass);
+  }
+
+  // malloc for a small size whose class the caller already knows,
+  // e.g. from SizeMap::ConstantSizeClass (see plasma/mesh_inline.h)
+  inline void *ATTRIBUTE_ALWAYS_INLINE ATTRIBUTE_MALLOC mallocSizeClass(size_t sz, uint32_t sizeClass) {
+    d_assert(sizeClass == static_cast<uint32_t>(SizeMap::SizeClass(sz)));
+    if (unlikely(_bytesUntilSample < sz)) {
+      return sampledMalloc(sz);
     }
+    _bytesUntilSample -= sz;
+
+    return smallMalloc(sizeClass);
+  }
 
+  inline void *ATTRIBUTE_ALWAYS_INLINE smallMalloc(uint32_t sizeClass) {
     ShuffleVectorT &shuffleVector = _shuffleVector[sizeClass];
     if (unlikely(shuffleVector.isExhausted())) {
       return smallAllocSlowpath(sizeClass);
@@ -198,17 +235,48 @@ public:
 
     size_t startEpoch{0};
     auto mh = _global->miniheapForWithEpoch(ptr, startEpoch);
+    // freeFor tells the profiler about frees from sampled spans
+    if (unlikely(mh && mh->isSampled())) {
+      _global->freeFor(mh, ptr, startEpoch);
+      return;
+    }
     if (likely(mh && mh->current() == _current && !mh->hasMeshed())) {
       ShuffleVectorT &shuffleVector = _shuffleVector[mh->sizeClass()];
       shuffleVector.free(mh, ptr);
       return;
     }
+    if (mh && mh->isLargeAlloc() && cacheLargeSpan(mh, ptr)) {
+      return;
+    }
 
     _global->freeFor(mh, ptr, startEpoch);
   }
 
+  // free with the size the object was allocated with (C++ sized
+  // delete, mesh::allocator).  The size gives the size class up front,
+  // so one load of the miniheap's flags checks it against the span and
+  // rules out sampling, and the object index comes from an integer
+  // reciprocal.  Anything else -- large or over-aligned allocations, a
+  // wrong size, sampled spans -- takes the regular free path.
   inline void ATTRIBUTE_ALWAYS_INLINE sizedFree(void *ptr, size_t sz) {
-    this->free(ptr);
+    uint32_t sizeClass = 0;
+    if (unlikely(ptr == nullptr || !SizeMap::GetSizeClass(sz, &sizeClass))) {
+      this->free(ptr);
+      return;
+    }
+
+    size_t startEpoch{0};
+    auto mh = _global->miniheapForWithEpoch(ptr, startEpoch);
+    if (unlikely(mh == nullptr || !mh->isUnsampledSmall(sizeClass))) {
+      this->free(ptr);
+      return;
+    }
+    if (likely(mh->current() == _current && !mh->hasMeshed())) {
+      _shuffleVector[sizeClass].sizedFree(mh, ptr, sizeClass);
+      return;
+    }
+
+    _global->freeFor(mh, ptr, startEpoch);
   }
 
   inline size_t getSize(void *ptr) {
@@ -254,8 +322,21 @@ protected:
   ThreadLocalHeap *_prev{};
   const pthread_t _pthreadCurrent;
   MWC _prng CACHELINE_ALIGNED;
+  size_t _bytesUntilSample{0};  // 0 so the first malloc sets it up
+  bool _inSampler{false};
   const size_t _maxObjectSize;
   LocalHeapStats _stats{};
+  // freed large spans of kMinMidSizePages to kMaxMidSizePages pages,
+  // by page count, kept attached to their miniheaps for reuse by
+  // largeMalloc without the global large-alloc and arena locks
+  static constexpr size_t kMinMidSizePages = kMaxSize / PageSize + 1;
+  static constexpr size_t kMaxMidSizePages = kMaxFastLargeSize / PageSize;
+  struct MidSizeBin {
+    size_t count{0};
+    MiniHeapT *spans[kMidSizeCacheDepth]{};
+  };
+  MidSizeBin _midSizeCache[kMaxMidSizePages - kMinMidSizePages + 1]{};
+  size_t _midSizeCacheBytes{0};
   bool _inSetSpecific{false};
 
 #ifdef MESH_HAVE_TLS
@@ -392,6 +473,35 @@ void ThreadLocalHeap<PageSize>::DeleteHeap(ThreadLocalHeap *heap) {
   // and the global heap lock() already holds all miniheap locks.
   heap->ThreadLocalHeap::~ThreadLocalHeap();
   mesh::internal::Heap().free(reinterpret_cast<void *>(heap));
+  // the thread is exiting, so its trace ring can go to the next one
+  trace::releaseThreadRing();
+}
+
+template <size_t PageSize>
+void *ThreadLocalHeap<PageSize>::sampledMalloc(size_t sz) {
+  void *ptr = mallocUnsampled(sz);
+
+  HeapProfiler &profiler = _global->profiler();
+  // uniform in (0, 1]
+  const double u = static_cast<double>(_prng.inRange(1, 1 << 24)) / (1 << 24);
+  _bytesUntilSample = profiler.nextSampleBytes(u);
+
+  // backtrace() may allocate; those allocations aren't sampled
+  if (ptr == nullptr || profiler.interval() == 0 || _inSampler) {
+    return ptr;
+  }
+
+  MiniHeapT *mh = _global->miniheapFor(ptr);
+  if (mh == nullptr) {
+    return ptr;
+  }
+
+  _inSampler = true;
+  profiler.recordAllocation(ptr, sz);
+  mh->setSampled();
+  _inSampler = false;
+
+  return ptr;
 }
 
 template <size_t PageSize>
@@ -400,6 +510,59 @@ void ThreadLocalHeap<PageSize>::releaseAll() {
     _shuffleVector[i].refillMiniheaps();
     _global->releaseMiniheaps(_shuffleVector[i].miniheaps());
   }
+  flushLargeSpans();
+}
+
+template <size_t PageSize>
+void *ThreadLocalHeap<PageSize>::largeMalloc(size_t sz) {
+  if (sz <= kMaxFastLargeSize) {
+    const size_t pageCount = PageCount(sz);
+    d_assert(pageCount >= kMinMidSizePages && pageCount <= kMaxMidSizePages);
+    MidSizeBin &bin = _midSizeCache[pageCount - kMinMidSizePages];
+    if (bin.count > 0) {
+      MiniHeapT *mh = bin.spans[--bin.count];
+      _midSizeCacheBytes -= mh->spanSize();
+      return mh->mallocAt(_global->arenaBegin(), 0);
+    }
+  }
+
+  return _global->malloc(sz);
+}
+
+// keep a freed large span for this thread to reuse if it is in the
+// mid-size range and there is room; the caller frees it otherwise
+template <size_t PageSize>
+bool ThreadLocalHeap<PageSize>::cacheLargeSpan(MiniHeapT *mh, void *ptr) {
+  const size_t spanSize = mh->spanSize();
+  const size_t pageCount = spanSize / PageSize;
+  // sampled spans go back so the flag doesn't outlive the sample
+  if (pageCount < kMinMidSizePages || pageCount > kMaxMidSizePages || mh->isSampled() ||
+      _midSizeCacheBytes + spanSize > kMidSizeCacheBytes) {
+    return false;
+  }
+
+  MidSizeBin &bin = _midSizeCache[pageCount - kMinMidSizePages];
+  if (bin.count == kMidSizeCacheDepth) {
+    return false;
+  }
+
+  d_assert(reinterpret_cast<uintptr_t>(ptr) == mh->getSpanStart(_global->arenaBegin()));
+  mh->freeOff(0);
+  bin.spans[bin.count++] = mh;
+  _midSizeCacheBytes += spanSize;
+  return true;
+}
+
+template <size_t PageSize>
+void ThreadLocalHeap<PageSize>::flushLargeSpans() {
+  const auto arenaBegin = _global->arenaBegin();
+  for (auto &bin : _midSizeCache) {
+    while (bin.count > 0) {
+      MiniHeapT *mh = bin.spans[--bin.count];
+      _global->freeFor(mh, reinterpret_cast<void *>(mh->getSpanStart(arenaBegin)), 0);
+    }
+  }
+  _midSizeCacheBytes = 0;
 }
 
 // we get here if the shuffleVector is exhausted
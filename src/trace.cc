@@ -0,0 +1,226 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include "fd_writer.h"
+#include "trace.h"
+
+namespace mesh {
+namespace trace {
+
+namespace {
+// a ring is only written by the thread that owns it, so recording an
+// event takes no locks or atomic read-modify-writes.  Rings are never
+// unmapped: when a thread exits its ring goes back to the pool (with
+// its records) for the next new thread.
+struct Ring {
+  std::atomic<uint64_t> head{0};  // number of records ever written
+  std::atomic<pid_t> owner{0};    // tid, or 0 if free
+  Ring *next{nullptr};
+  Record records[kRingSize];
+};
+
+std::atomic<Ring *> Rings{nullptr};
+std::atomic<size_t> DumpSeq{0};
+
+#ifdef MESH_HAVE_TLS
+__thread Ring *ThreadRing ATTR_INITIAL_EXEC;
+#else
+// only the main thread traces without TLS
+Ring *ThreadRing;
+#endif
+
+pid_t gettid() {
+  return static_cast<pid_t>(syscall(SYS_gettid));
+}
+
+Ring *claimRing() {
+  const pid_t tid = gettid();
+
+  for (Ring *ring = Rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+    pid_t expected = 0;
+    if (ring->owner.load(std::memory_order_relaxed) == 0 &&
+        ring->owner.compare_exchange_strong(expected, tid, std::memory_order_acquire)) {
+      return ring;
+    }
+  }
+
+  // rings are mmapped rather than malloced so that tracing can happen
+  // anywhere, including with heap locks held
+  void *ptr = mmap(nullptr, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+
+  Ring *ring = new (ptr) Ring();
+  ring->owner.store(tid, std::memory_order_relaxed);
+  Ring *head = Rings.load(std::memory_order_relaxed);
+  do {
+    ring->next = head;
+  } while (!Rings.compare_exchange_weak(head, ring, std::memory_order_release, std::memory_order_relaxed));
+
+  return ring;
+}
+
+bool byTimestamp(const Record &a, const Record &b) {
+  return a.timestampNs < b.timestampNs;
+}
+}  // namespace
+
+const char *eventName(uint16_t event) {
+  switch (event) {
+  case Refill:
+    return "refill";
+  case Release:
+    return "release";
+  case MeshStart:
+    return "mesh_start";
+  case MeshEnd:
+    return "mesh_end";
+  case Scavenge:
+    return "scavenge";
+  case ExpandArena:
+    return "expand_arena";
+  case ForkPrepare:
+    return "fork_prepare";
+  case ForkParent:
+    return "fork_parent";
+  case ForkChild:
+    return "fork_child";
+  case SegfaultWait:
+    return "segfault_wait";
+  }
+  return "unknown";
+}
+
+void recordSlow(Event event, uint64_t arg0, uint64_t arg1) {
+  Ring *ring = ThreadRing;
+  if (unlikely(ring == nullptr)) {
+    ring = claimRing();
+    if (ring == nullptr) {
+      return;
+    }
+    ThreadRing = ring;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  Record &record = ring->records[head % kRingSize];
+  record.timestampNs = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+  record.arg0 = arg0;
+  record.arg1 = arg1;
+  record.tid = ring->owner.load(std::memory_order_relaxed);
+  record.event = event;
+  record.reserved = 0;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+int dump(int fd) {
+  size_t ringCount = 0;
+  for (Ring *ring = Rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+    ringCount++;
+  }
+
+  // copy everything out first so the records can be sorted
+  const size_t bufSize = std::max<size_t>(ringCount * kRingSize * sizeof(Record), 1);
+  void *buf = mmap(nullptr, bufSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    return -1;
+  }
+  Record *records = reinterpret_cast<Record *>(buf);
+
+  size_t count = 0;
+  Ring *ring = Rings.load(std::memory_order_acquire);
+  for (size_t i = 0; i < ringCount && ring != nullptr; i++, ring = ring->next) {
+    const uint64_t before = ring->head.load(std::memory_order_acquire);
+    const uint64_t first = before > kRingSize ? before - kRingSize : 0;
+    Record *out = records + count;
+    for (uint64_t j = first; j < before; j++) {
+      out[j - first] = ring->records[j % kRingSize];
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // the owner may have overwritten the oldest records while they were
+    // copied, and may be partway through the slot after its head
+    const uint64_t after = ring->head.load(std::memory_order_relaxed);
+    const uint64_t valid = after + 1 > kRingSize ? after + 1 - kRingSize : 0;
+    const uint64_t skip = valid > first ? std::min(valid - first, before - first) : 0;
+    memmove(out, out + skip, (before - first - skip) * sizeof(Record));
+    count += before - first - skip;
+  }
+
+  std::sort(records, records + count, byTimestamp);
+
+  FdWriter out(fd);
+  out.printf("# mesh trace: pid %d\n", getpid());
+  out.printf("# timestamp_ns tid event arg0 arg1\n");
+  for (size_t i = 0; i < count; i++) {
+    const Record &record = records[i];
+    out.printf("%llu %u %s %llu %llu\n", static_cast<unsigned long long>(record.timestampNs), record.tid,
+               eventName(record.event), static_cast<unsigned long long>(record.arg0),
+               static_cast<unsigned long long>(record.arg1));
+  }
+  out.flush();
+
+  munmap(buf, bufSize);
+  return out.failed() ? -1 : 0;
+}
+
+int dump(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    debug("trace: couldn't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int result = dump(fd);
+  close(fd);
+  return result;
+}
+
+int dumpToDefaultPath() {
+  const char *prefix = getenv("MESH_TRACE_PREFIX");
+  if (prefix == nullptr) {
+    prefix = "mesh";
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.%d.%zu.meshtrace", prefix, getpid(), DumpSeq++);
+  return dump(path);
+}
+
+void releaseThreadRing() {
+  Ring *ring = ThreadRing;
+  if (ring == nullptr) {
+    return;
+  }
+  ThreadRing = nullptr;
+  ring->owner.store(0, std::memory_order_release);
+}
+
+void afterForkChild() {
+  const pid_t tid = gettid();
+  for (Ring *ring = Rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+    ring->owner.store(ring == ThreadRing ? tid : 0, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace trace
+}  // namespace mesh
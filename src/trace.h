@@ -0,0 +1,109 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2020 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH_TRACE_H
+#define MESH_TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "common.h"
+
+// USDT probes need systemtap's sys/sdt.h at build time (on Debian,
+// systemtap-sdt-dev); they cost a nop when nothing is attached.  Build
+// with -DMESH_USDT=0 to leave them out.
+#ifndef MESH_USDT
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define MESH_USDT 1
+#endif
+#endif
+#endif
+
+#if defined(MESH_USDT) && MESH_USDT
+#include <sys/sdt.h>
+#define MESH_PROBE(name, a, b) DTRACE_PROBE2(mesh, name, a, b)
+#else
+#define MESH_PROBE(name, a, b) \
+  do {                         \
+  } while (0)
+#endif
+
+// record an allocator event in the calling thread's trace ring (if
+// tracing is on) and fire the USDT probe mesh:<probe>, e.g.
+//
+//   bpftrace -e 'usdt:./libmesh.so:mesh:mesh_end { @ns = hist(arg1); }'
+#define MESH_TRACE(event, probe, a, b)                                                               \
+  do {                                                                                               \
+    MESH_PROBE(probe, a, b);                                                                         \
+    ::mesh::trace::record(::mesh::trace::event, static_cast<uint64_t>(a), static_cast<uint64_t>(b)); \
+  } while (0)
+
+namespace mesh {
+namespace trace {
+
+// each event's two arguments are listed alongside it
+enum Event : uint16_t {
+  Refill = 1,    // size class, miniheaps handed to the thread
+  Release,       // size class, miniheaps given back by the thread
+  MeshStart,     // -, -
+  MeshEnd,       // spans meshed, ns
+  Scavenge,      // pages returned to the OS, ns
+  ExpandArena,   // pages added, arena pages after
+  ForkPrepare,   // pid, -
+  ForkParent,    // pid, -
+  ForkChild,     // pid, -
+  SegfaultWait,  // faulting address, ns waited for a mesh to finish
+};
+
+const char *eventName(uint16_t event);
+
+struct Record {
+  uint64_t timestampNs;  // CLOCK_MONOTONIC
+  uint64_t arg0;
+  uint64_t arg1;
+  uint32_t tid;
+  uint16_t event;
+  uint16_t reserved;
+};
+
+static_assert(sizeof(Record) == 32, "trace record layout changed");
+
+// records per thread; the oldest are overwritten first
+static constexpr size_t kRingSize = 1024;
+
+// set by MESH_TRACE=1 or the trace.active mallctl
+inline std::atomic<bool> Enabled{false};
+
+void recordSlow(Event event, uint64_t arg0, uint64_t arg1);
+
+inline void record(Event event, uint64_t arg0, uint64_t arg1) {
+  if (unlikely(Enabled.load(std::memory_order_relaxed))) {
+    recordSlow(event, arg0, arg1);
+  }
+}
+
+// write every thread's ring, merged in timestamp order, as text lines
+// of "timestamp_ns tid event arg0 arg1".  Returns 0 on success.
+int dump(int fd);
+int dump(const char *path);
+// dump to "<prefix>.<pid>.<seq>.meshtrace", where prefix comes from
+// MESH_TRACE_PREFIX (default "mesh").  Used on SIGTRACE.
+int dumpToDefaultPath();
+
+// hand the calling thread's ring back for reuse; its records stay
+// until another thread claims it
+void releaseThreadRing();
+
+// only the forking thread survives in the child, so free every other
+// ring
+void afterForkChild();
+
+}  // namespace trace
+}  // namespace mesh
+
+#endif  // MESH_TRACE_H
@@ -7,8 +7,11 @@
 #include <stdlib.h>  // size_t
 #include <string.h>  // for memcpy and memset
 
+#include <algorithm>
+#include <limits>
 #include <new>
 
+#include "alloc_recorder.h"
 #include "common.h"
 #include "thread_local_heap.h"
 #include "dispatch_utils.h"
@@ -91,6 +94,8 @@ void xxmalloc_unlock();
 #define CUSTOM_MALLOC_GET_STATE(p) CUSTOM_PREFIX(malloc_get_state)(p)
 #define CUSTOM_MALLOC_SET_STATE(p) CUSTOM_PREFIX(malloc_set_state)(p)
 #define CUSTOM_MALLINFO(a) CUSTOM_PREFIX(mallinfo)(a)
+#define CUSTOM_MALLINFO2(a) CUSTOM_PREFIX(mallinfo2)(a)
+#define CUSTOM_MALLOC_INFO(o, f) CUSTOM_PREFIX(malloc_info)(o, f)
 
 #if defined(_WIN32)
 #define MYCDECL __cdecl
@@ -220,13 +225,29 @@ extern "C" MESH_EXPORT int CUSTOM_MALLOPT(int /* param */, int /* value */) {
   return 1;  // success.
 }
 
+static void collectHeapStats(HeapStats &stats) {
+  dispatchByPageSize([&](auto &rt) { rt.heap().collectStats(stats); });
+}
+
 extern "C" MESH_EXPORT int CUSTOM_MALLOC_TRIM(size_t /* pad */) {
-  // NOP.
-  return 0;  // no memory returned to OS.
+  const size_t released = dispatchByPageSize([](auto &rt) { return rt.trim(kTrimBudgetMs); });
+  return released > 0 ? 1 : 0;  // 1 if memory was returned to the OS
 }
 
 extern "C" MESH_EXPORT void CUSTOM_MALLOC_STATS() {
-  // NOP.
+  HeapStats stats;
+  collectHeapStats(stats);
+
+  // the same layout as glibc.  Huge allocations are mapped outside the
+  // arena, so they are the mmap regions.
+  fprintf(stderr, "Arena 0:\n");
+  fprintf(stderr, "system bytes     = %10zu\n", stats.mapped - stats.hugeBytes);
+  fprintf(stderr, "in use bytes     = %10zu\n", stats.allocated - stats.hugeBytes);
+  fprintf(stderr, "Total (incl. mmap):\n");
+  fprintf(stderr, "system bytes     = %10zu\n", stats.mapped);
+  fprintf(stderr, "in use bytes     = %10zu\n", stats.allocated);
+  fprintf(stderr, "max mmap regions = %10zu\n", stats.hugeCountMax);
+  fprintf(stderr, "max mmap bytes   = %10zu\n", stats.hugeBytesMax);
 }
 
 extern "C" MESH_EXPORT void *CUSTOM_MALLOC_GET_STATE() {
@@ -238,21 +259,96 @@ extern "C" MESH_EXPORT int CUSTOM_MALLOC_SET_STATE(void * /* ptr */) {
 }
 
 #if defined(__GNUC__) && !defined(__FreeBSD__) && defined(__GLIBC__)
-extern "C" MESH_EXPORT struct mallinfo CUSTOM_MALLINFO() {
-  // For now, we return useless stats.
-  struct mallinfo m;
-  m.arena = 0;
-  m.ordblks = 0;
-  m.smblks = 0;
-  m.hblks = 0;
-  m.hblkhd = 0;
-  m.usmblks = 0;
-  m.fsmblks = 0;
-  m.uordblks = 0;
-  m.fordblks = 0;
-  m.keepcost = 0;
+// Fills glibc's mallinfo fields from our own accounting.  Large
+// allocations are reported the way glibc reports mmapped chunks;
+// everything else is the "arena", and the dirty pages malloc_trim
+// would release are the keepcost.
+template <typename Info>
+static Info meshMallinfo() {
+  HeapStats stats;
+  collectHeapStats(stats);
+
+  using Field = decltype(Info::arena);
+  auto clamp = [](size_t value) {
+    return static_cast<Field>(std::min(value, static_cast<size_t>(std::numeric_limits<Field>::max())));
+  };
+
+  const size_t smallMapped = stats.mapped - std::min(stats.mapped, stats.largeBytes);
+  const size_t smallAllocated = stats.allocated - stats.largeBytes;
+
+  Info m;
+  memset(&m, 0, sizeof(m));
+  m.arena = clamp(smallMapped);
+  m.ordblks = clamp(stats.freeSpanCount);
+  m.hblks = clamp(stats.largeCount);
+  m.hblkhd = clamp(stats.largeBytes);
+  m.uordblks = clamp(smallAllocated);
+  m.fordblks = clamp(smallMapped - std::min(smallMapped, smallAllocated));
+  m.keepcost = clamp(stats.dirty);
   return m;
 }
+
+extern "C" MESH_EXPORT struct mallinfo CUSTOM_MALLINFO() {
+  // the fields are ints, so large heaps saturate; see mallinfo2
+  return meshMallinfo<struct mallinfo>();
+}
+
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+extern "C" MESH_EXPORT struct mallinfo2 CUSTOM_MALLINFO2() {
+  return meshMallinfo<struct mallinfo2>();
+}
+#endif
+
+extern "C" MESH_EXPORT int CUSTOM_MALLOC_INFO(int options, FILE *fp) {
+  if (options != 0 || fp == nullptr) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  HeapStats stats;
+  collectHeapStats(stats);
+
+  // glibc's XML layout, with one <size> entry per size class holding
+  // the free slots in its spans
+  size_t freeCount = 0;
+  size_t freeBytes = 0;
+  fprintf(fp, "<malloc version=\"1\">\n<heap nr=\"0\">\n<sizes>\n");
+  size_t from = 1;
+  for (const auto &sc : stats.sizeClasses) {
+    const size_t count = sc.spans * sc.objectCount - sc.inUseObjects;
+    if (sc.spans > 0) {
+      fprintf(fp, "<size from=\"%zu\" to=\"%zu\" total=\"%zu\" count=\"%zu\"/>\n", from, sc.objectSize,
+              count * sc.objectSize, count);
+    }
+    freeCount += count;
+    freeBytes += count * sc.objectSize;
+    from = sc.objectSize + 1;
+  }
+  fprintf(fp, "</sizes>\n");
+  fprintf(fp, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+  fprintf(fp, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", freeCount + stats.freeSpanCount,
+          freeBytes + stats.dirty);
+  // the heap is the arena; all of the arena handed out so far is
+  // read-write, so it is both the address space and the mprotect size
+  fprintf(fp, "<system type=\"current\" size=\"%zu\"/>\n", stats.mapped - stats.hugeBytes);
+  fprintf(fp, "<system type=\"max\" size=\"%zu\"/>\n", stats.arenaMappedMax);
+  fprintf(fp, "<aspace type=\"total\" size=\"%zu\"/>\n", stats.arenaExtent);
+  fprintf(fp, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", stats.arenaExtent);
+  fprintf(fp, "</heap>\n");
+  fprintf(fp, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+  fprintf(fp, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", freeCount + stats.freeSpanCount,
+          freeBytes + stats.dirty);
+  fprintf(fp, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n", stats.largeCount, stats.largeBytes);
+  // the totals add the huge mappings; like glibc's sum over arenas,
+  // the max is the sum of the separate peaks
+  fprintf(fp, "<system type=\"current\" size=\"%zu\"/>\n", stats.mapped);
+  fprintf(fp, "<system type=\"max\" size=\"%zu\"/>\n", stats.arenaMappedMax + stats.hugeBytesMax);
+  fprintf(fp, "<aspace type=\"total\" size=\"%zu\"/>\n", stats.arenaExtent + stats.hugeBytes);
+  fprintf(fp, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", stats.arenaExtent + stats.hugeBytes);
+  fprintf(fp, "</malloc>\n");
+
+  return 0;
+}
 #endif
 
 #if defined(__SVR4)
@@ -276,7 +372,7 @@ extern "C" MESH_EXPORT struct mallinfo CUSTOM_MALLINFO() {
 template <size_t PageSize>
 static void *cxx_new_impl(size_t sz) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     return mesh::cxxNewSlowpath<PageSize>(sz);
   }
   return localHeap->cxxNew(sz);
@@ -285,7 +381,7 @@ static void *cxx_new_impl(size_t sz) {
 template <size_t PageSize>
 static void *cxx_new_nothrow_impl(size_t sz, const std::nothrow_t &) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     return mesh::allocSlowpath<PageSize>(sz);
   }
   return localHeap->malloc(sz);
@@ -294,7 +390,7 @@ static void *cxx_new_nothrow_impl(size_t sz, const std::nothrow_t &) {
 template <size_t PageSize>
 static void cxx_delete_impl(void *ptr) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     mesh::freeSlowpath<PageSize>(ptr);
     return;
   }
@@ -304,13 +400,45 @@ static void cxx_delete_impl(void *ptr) {
 template <size_t PageSize>
 static void cxx_sized_delete_impl(void *ptr, size_t sz) {
   auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
-  if (unlikely(localHeap == nullptr)) {
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
     mesh::freeSlowpath<PageSize>(ptr);
     return;
   }
   localHeap->sizedFree(ptr, sz);
 }
 
+#if defined(__cpp_aligned_new) && __cpp_aligned_new >= 201606
+template <size_t PageSize>
+static void *cxx_new_aligned_nothrow_impl(size_t sz, std::align_val_t al, const std::nothrow_t &) {
+  auto *localHeap = ThreadLocalHeap<PageSize>::GetHeapIfPresent();
+  if (unlikely(localHeap == nullptr) || recorder::recording()) {
+    return mesh::memalignSlowpath<PageSize>(static_cast<size_t>(al), sz);
+  }
+  return localHeap->memalign(static_cast<size_t>(al), sz);
+}
+
+template <size_t PageSize>
+static void *cxx_new_aligned_impl(size_t sz, std::align_val_t al) {
+  void *ptr = cxx_new_aligned_nothrow_impl<PageSize>(sz, al, std::nothrow);
+  if (unlikely(ptr == nullptr)) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+// an aligned allocation may come from a larger size class than its
+// size implies, so aligned deletes ignore the size and do a plain free
+template <size_t PageSize>
+static void cxx_delete_aligned_impl(void *ptr, std::align_val_t) {
+  cxx_delete_impl<PageSize>(ptr);
+}
+
+template <size_t PageSize>
+static void cxx_sized_delete_aligned_impl(void *ptr, size_t, std::align_val_t) {
+  cxx_delete_impl<PageSize>(ptr);
+}
+#endif  // __cpp_aligned_new
+
 #if defined(__linux__) && defined(__aarch64__)
 // ===================================================================
 // IFUNC Resolvers for C++ Operators (ARM64 Linux only)
@@ -348,6 +476,35 @@ __attribute__((no_stack_protector)) static cxx_sized_delete_func resolve_cxx_siz
   size_t pageSize = mesh::ifunc::getPageSizeFromAuxv();
   return (pageSize == kPageSize4K) ? cxx_sized_delete_impl<kPageSize4K> : cxx_sized_delete_impl<kPageSize16K>;
 }
+
+#if defined(__cpp_aligned_new) && __cpp_aligned_new >= 201606
+typedef void *(*cxx_new_aligned_func)(size_t, std::align_val_t);
+typedef void *(*cxx_new_aligned_nothrow_func)(size_t, std::align_val_t, const std::nothrow_t &);
+typedef void (*cxx_delete_aligned_func)(void *, std::align_val_t);
+typedef void (*cxx_sized_delete_aligned_func)(void *, size_t, std::align_val_t);
+
+__attribute__((no_stack_protector)) static cxx_new_aligned_func resolve_cxx_new_aligned() {
+  size_t pageSize = mesh::ifunc::getPageSizeFromAuxv();
+  return (pageSize == kPageSize4K) ? cxx_new_aligned_impl<kPageSize4K> : cxx_new_aligned_impl<kPageSize16K>;
+}
+
+__attribute__((no_stack_protector)) static cxx_new_aligned_nothrow_func resolve_cxx_new_aligned_nothrow() {
+  size_t pageSize = mesh::ifunc::getPageSizeFromAuxv();
+  return (pageSize == kPageSize4K) ? cxx_new_aligned_nothrow_impl<kPageSize4K>
+                                   : cxx_new_aligned_nothrow_impl<kPageSize16K>;
+}
+
+__attribute__((no_stack_protector)) static cxx_delete_aligned_func resolve_cxx_delete_aligned() {
+  size_t pageSize = mesh::ifunc::getPageSizeFromAuxv();
+  return (pageSize == kPageSize4K) ? cxx_delete_aligned_impl<kPageSize4K> : cxx_delete_aligned_impl<kPageSize16K>;
+}
+
+__attribute__((no_stack_protector)) static cxx_sized_delete_aligned_func resolve_cxx_sized_delete_aligned() {
+  size_t pageSize = mesh::ifunc::getPageSizeFromAuxv();
+  return (pageSize == kPageSize4K) ? cxx_sized_delete_aligned_impl<kPageSize4K>
+                                   : cxx_sized_delete_aligned_impl<kPageSize16K>;
+}
+#endif  // __cpp_aligned_new
 }
 #endif  // defined(__linux__) && defined(__aarch64__)
 
@@ -485,6 +642,117 @@ MESH_EXPORT CACHELINE_ALIGNED_FN void operator delete[](void *ptr, size_t sz)
 
 #endif  // __cpp_sized_deallocation
 
+#if defined(__cpp_aligned_new) && __cpp_aligned_new >= 201606
+
+// alignas(N) types with N above __STDCPP_DEFAULT_NEW_ALIGNMENT__.
+// Without these, libstdc++ sends them through aligned_alloc.
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void *operator new(size_t sz, std::align_val_t al)
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_new_aligned")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    return cxx_new_aligned_impl<kPageSize4K>(sz, al);
+  } else {
+    return cxx_new_aligned_impl<kPageSize16K>(sz, al);
+  }
+}
+#endif
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void *operator new[](size_t sz, std::align_val_t al)
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_new_aligned")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    return cxx_new_aligned_impl<kPageSize4K>(sz, al);
+  } else {
+    return cxx_new_aligned_impl<kPageSize16K>(sz, al);
+  }
+}
+#endif
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void *operator new(size_t sz, std::align_val_t al, const std::nothrow_t &nt) noexcept
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_new_aligned_nothrow")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    return cxx_new_aligned_nothrow_impl<kPageSize4K>(sz, al, nt);
+  } else {
+    return cxx_new_aligned_nothrow_impl<kPageSize16K>(sz, al, nt);
+  }
+}
+#endif
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void *operator new[](size_t sz, std::align_val_t al, const std::nothrow_t &nt) noexcept
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_new_aligned_nothrow")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    return cxx_new_aligned_nothrow_impl<kPageSize4K>(sz, al, nt);
+  } else {
+    return cxx_new_aligned_nothrow_impl<kPageSize16K>(sz, al, nt);
+  }
+}
+#endif
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void operator delete(void *ptr, std::align_val_t al) noexcept
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_delete_aligned")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    cxx_delete_aligned_impl<kPageSize4K>(ptr, al);
+  } else {
+    cxx_delete_aligned_impl<kPageSize16K>(ptr, al);
+  }
+}
+#endif
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void operator delete[](void *ptr, std::align_val_t al) noexcept
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_delete_aligned")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    cxx_delete_aligned_impl<kPageSize4K>(ptr, al);
+  } else {
+    cxx_delete_aligned_impl<kPageSize16K>(ptr, al);
+  }
+}
+#endif
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void operator delete(void *ptr, size_t sz, std::align_val_t al) noexcept
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_sized_delete_aligned")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    cxx_sized_delete_aligned_impl<kPageSize4K>(ptr, sz, al);
+  } else {
+    cxx_sized_delete_aligned_impl<kPageSize16K>(ptr, sz, al);
+  }
+}
+#endif
+
+MESH_EXPORT CACHELINE_ALIGNED_FN void operator delete[](void *ptr, size_t sz, std::align_val_t al) noexcept
+#if defined(__linux__) && defined(__aarch64__)
+    __attribute__((ifunc("resolve_cxx_sized_delete_aligned")));
+#else
+{
+  if (likely(getPageSize() == kPageSize4K)) {
+    cxx_sized_delete_aligned_impl<kPageSize4K>(ptr, sz, al);
+  } else {
+    cxx_sized_delete_aligned_impl<kPageSize16K>(ptr, sz, al);
+  }
+}
+#endif
+
+#endif  // __cpp_aligned_new
+
 #endif  // !defined(__SUNPRO_CC) || __SUNPRO_CC > 0x420
 #endif  // NEW_INCLUDED
 
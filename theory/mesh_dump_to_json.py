@@ -0,0 +1,87 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+'''
+Converts a binary heap dump from libmesh (written on SIGDUMP or with the
+heap.dump mallctl, see src/heap_dump.h) into the JSON lines format read
+by read_mesh_dump.py.
+'''
+
+from __future__ import print_function
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b'MESHDUMP'
+VERSION = 1
+
+HEADER = struct.Struct('=8sIIQII')
+RECORD = struct.Struct('=QIiIIIIHBBI')
+
+ATTACHED = 1 << 0
+LARGE = 1 << 1
+SAMPLED = 1 << 2
+
+
+def read_records(f):
+    '''
+    Yields (header, record) dicts for each miniheap in the dump file `f`
+    '''
+    magic, version, page_size, arena_begin, pid, _ = HEADER.unpack(f.read(HEADER.size))
+    if magic != MAGIC:
+        raise ValueError('not a mesh heap dump')
+    if version != VERSION:
+        raise ValueError('unsupported heap dump version %d' % version)
+
+    header = {'page-size': page_size, 'arena-begin': arena_begin, 'pid': pid}
+
+    while True:
+        buf = f.read(RECORD.size)
+        if not buf:
+            break
+        if len(buf) < RECORD.size:
+            raise ValueError('truncated heap dump')
+
+        (object_size, mh_id, size_class, object_count, in_use, span_offset,
+         span_length, mesh_count, flags, bitmap_words, _) = RECORD.unpack(buf)
+        words = struct.unpack('=%dQ' % bitmap_words, f.read(8 * bitmap_words))
+
+        bitmap = ''.join('1' if words[i // 64] >> (i % 64) & 1 else '0'
+                         for i in range(object_count))
+
+        yield header, {
+            'name': '%#x' % (arena_begin + span_offset * page_size),
+            'id': mh_id,
+            'size-class': size_class,
+            'object-size': object_size,
+            'length': object_count,
+            'in-use': in_use,
+            'span-length': span_length,
+            'mesh-count': mesh_count,
+            'attached': bool(flags & ATTACHED),
+            'large': bool(flags & LARGE),
+            'sampled': bool(flags & SAMPLED),
+            'bitmap': bitmap,
+        }
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--include-large', action='store_true',
+                        help='also emit large allocations')
+    parser.add_argument('dump_file', nargs=1, help='A binary heap dump from libmesh')
+    args = parser.parse_args()
+
+    with open(args.dump_file[0], 'rb') as f:
+        for _, record in read_records(f):
+            if record['large'] and not args.include_large:
+                continue
+            print(json.dumps(record))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())